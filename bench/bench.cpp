@@ -0,0 +1,378 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "../src/tosuto.h"
+#include "../src/lex.h"
+#include "../src/parse.h"
+#include "../src/perf.h"
+#include "../src/vm/vm.h"
+#include "../src/vm/compile.h"
+#include "../src/vm/cache.h"
+#include "../src/vm/snapshot.h"
+#include "../src/vm/tasks.h"
+#include "../src/vm/coro.h"
+#include "../src/vm/actors.h"
+#include "../src/vm/loop.h"
+#include "../src/vm/reload.h"
+#include "../src/vm/modules.h"
+
+// runs the programs in bench/ (or the ones given) on fresh vms, a few times
+// to warm up and then for real, and reports the median and p95 of the
+// runs. only run() is timed, each program is lexed, parsed and compiled
+// once up front. --json writes the same numbers for comparing commits.
+// --perf adds hardware counters for lexing, parsing, compiling and the
+// average run, see src/perf.h. --lazy leaves function bodies to compile on
+// their first call, like ami does, instead of up front. --cached runs what
+// the .tsc cache gives back for each program, after writing it. with
+// --snapshot every run after the first restores the snapshot the first one
+// took, if it took one.
+//
+//   ami_bench [--warmup n] [--reps n] [--perf] [--lazy] [--cached]
+//             [--snapshot] [--json out.json] [file.tosuto...]
+
+namespace {
+  using namespace tosuto;
+  using clock = std::chrono::steady_clock;
+  using nt_ret = std::expected<vm::value, std::string>;
+
+  // what the program logged last, to check it still computes the same
+  thread_local std::string last_log;
+
+  // with --perf
+  std::optional<perf_counters> counters;
+
+  // with --lazy, along with what the bodies get compiled from
+  bool lazy = false;
+  std::vector<std::shared_ptr<node>> asts;
+
+  // with --cached
+  bool cached = false;
+
+  // with --snapshot
+  bool snapshots = false;
+
+  using phase_counts = std::vector<std::pair<std::string, perf_counts>>;
+
+  struct result {
+    std::string name;
+    std::vector<u64> runs_ns{};
+    std::string output{};
+    std::string error{};
+    phase_counts perf{};
+  };
+
+  template<typename F>
+  auto counted(phase_counts& phases, std::string const& phase, F&& fn) {
+    if (!counters) return fn();
+    auto before = counters->read();
+    auto res = fn();
+    phases.emplace_back(phase, counters->read() - before);
+    return res;
+  }
+
+  std::expected<vm::value::function, std::string>
+  compile(std::string const& path, phase_counts& phases) {
+    std::stringstream src;
+    if (!(src << std::ifstream(path).rdbuf())) {
+      return std::unexpected{"Can't read " + path};
+    }
+
+    std::vector<token> toks;
+    try {
+      lexer lx{to_utf32(src.str()), 1};
+      toks = counted(phases, "lex", [&] { return lx.lex(); });
+    } catch (std::runtime_error const& err) {
+      return std::unexpected{err.what()};
+    }
+
+    parser p{std::move(toks)};
+    auto ast = ami_unwrap(counted(phases, "parse", [&] { return p.global(); }));
+    return counted(phases, "compile", [&]() -> std::expected<vm::value::function, std::string> {
+      vm::compiler comp{vm::value::function::type::script};
+      auto fn = ami_unwrap(comp.global(ast.get()));
+      if (lazy) {
+        asts.push_back(ast);
+      } else {
+        ami_discard(vm::compile_all(fn, ast.get()));
+      }
+      return fn;
+    });
+  }
+
+  // what caches and snapshots of path are keyed by
+  u64 source_hash(std::string const& path) {
+    std::stringstream src;
+    src << std::ifstream(path).rdbuf();
+    return vm::fnv1a(src.str());
+  }
+
+  // writes fn to path's cache and reads it back, see cache.h
+  std::expected<vm::value::function, std::string>
+  through_cache(std::string const& path, vm::value::function const& fn) {
+    auto hash = source_hash(path);
+    auto cache = vm::cache_path(path);
+    ami_discard(vm::write_cache(cache, hash, fn));
+    return vm::read_cache(cache, hash);
+  }
+
+  std::expected<u64, std::string>
+  run_once(vm::value::function& fn, std::string const& path, perf_counts& counts) {
+    vm::vm vm{fn};
+    vm.def_native("log", 1, [](std::span<vm::value> args) {
+      last_log = args[0].to_string();
+      return nt_ret{vm::value::nil{}};
+    });
+    vm.def_native("to_str", 1, [](std::span<vm::value> args) {
+      return nt_ret{vm::value{vm::value::str{args[0].to_string()}}};
+    });
+    // what `@parallel for` compiles to
+    vm.def_native("@parallel_for", 9, vm::parallel_for);
+    // for tests/
+    vm.def_native("spawn", 1, vm::spawn);
+    vm.def_native("join", 1, vm::join);
+    vm.def_native("coro", 1, vm::coro);
+    vm.def_native("resume", 1, vm::resume);
+    vm.def_native("done", 1, vm::done);
+    vm.def_native("actor", 1, vm::actor);
+    vm.def_native("send", 2, vm::send);
+    vm.def_native("receive", 0, vm::receive);
+    vm.def_native("self", 0, vm::self);
+    vm.def_native("freeze", 1, vm::freeze);
+    vm.def_native("go", 1, vm::go);
+    vm.def_native("run_loop", 0, vm::run_loop);
+    vm.def_native("sleep", 1, vm::sleep);
+    vm.def_native("hot_reload", 1, vm::hot_reload);
+    vm.def_native("@import", 1, vm::import);
+    vm.def_native("write_file", 2, [](std::span<vm::value> args) {
+      auto text = args[1].text();
+      if (!args[0].is<vm::value::str>() || !text) {
+        return nt_ret{std::unexpected{"write_file() needs a path and a string!"}};
+      }
+      std::ofstream(std::string(args[0].get<vm::value::str>())) << *text;
+      return nt_ret{vm::value::nil{}};
+    });
+    vm.def_native("snapshot", 0, vm::snapshot);
+
+    // natives first, the snapshot refers to them by name
+    if (snapshots) {
+      vm.snapshot_path = vm::snapshot_path(path);
+      vm.snapshot_key = source_hash(path);
+      vm::restore_snapshot(vm);
+    }
+
+    auto before = counters ? counters->read() : perf_counts{};
+    auto start = clock::now();
+    auto res = vm.run(std::cout);
+    auto finish = clock::now();
+    if (counters) counts = counters->read() - before;
+    if (!res.has_value()) return std::unexpected{res.error()};
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count();
+  }
+
+  result bench(std::string const& path, size_t warmup, size_t reps) {
+    result out{std::filesystem::path(path).stem().string()};
+    auto fn = compile(path, out.perf);
+    if (fn.has_value() && cached) fn = through_cache(path, *fn);
+    if (!fn.has_value()) {
+      out.error = fn.error();
+      return out;
+    }
+
+    // one left from an earlier invocation would be restored by the first run
+    if (snapshots) {
+      std::error_code err;
+      std::filesystem::remove(vm::snapshot_path(path), err);
+    }
+
+    perf_counts run_total;
+    for (size_t i = 0; i < warmup + reps; i++) {
+      perf_counts counts;
+      auto ns = run_once(*fn, path, counts);
+      if (!ns.has_value()) {
+        out.error = ns.error();
+        return out;
+      }
+      if (i < warmup) continue;
+      out.runs_ns.push_back(*ns);
+      run_total += counts;
+    }
+    out.output = last_log;
+
+    if (counters) {
+      // the average run
+      auto& run = out.perf.emplace_back("run", run_total).second;
+      run.cycles /= reps;
+      run.instructions /= reps;
+      run.branch_misses /= reps;
+      run.cache_misses /= reps;
+    }
+    return out;
+  }
+
+  // nearest rank, runs has to be sorted
+  u64 percentile(std::vector<u64> const& runs, double p) {
+    auto rank = size_t(std::ceil(p / 100 * double(runs.size())));
+    return runs[std::clamp<size_t>(rank, 1, runs.size()) - 1];
+  }
+
+  std::string json_string(std::string const& str) {
+    std::string out = "\"";
+    for (char ch: str) {
+      switch (ch) {
+        case '"': out += "\\\"";
+          break;
+        case '\\': out += "\\\\";
+          break;
+        case '\n': out += "\\n";
+          break;
+        case '\r': out += "\\r";
+          break;
+        case '\t': out += "\\t";
+          break;
+        default: {
+          if (u8(ch) < 0x20) {
+            out += "\\u00";
+            out += "0123456789abcdef"[ch >> 4];
+            out += "0123456789abcdef"[ch & 0xf];
+          } else {
+            out += ch;
+          }
+        }
+      }
+    }
+    return out + '"';
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t warmup = 2, reps = 10;
+  bool perf = false;
+  std::string json_path;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--warmup" && i + 1 < argc) {
+      warmup = std::stoul(argv[++i]);
+    } else if (arg == "--reps" && i + 1 < argc) {
+      reps = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "--perf") {
+      perf = true;
+    } else if (arg == "--lazy") {
+      lazy = true;
+    } else if (arg == "--cached") {
+      cached = true;
+    } else if (arg == "--snapshot") {
+      snapshots = true;
+    } else if (arg == "--json" && i + 1 < argc) {
+      json_path = argv[++i];
+    } else {
+      paths.push_back(arg);
+    }
+  }
+
+  if (paths.empty()) {
+    std::error_code err;
+    for (auto const& it: std::filesystem::directory_iterator("bench", err)) {
+      if (it.path().extension() == ".tosuto") paths.push_back(it.path().string());
+    }
+    std::ranges::sort(paths);
+  }
+  if (paths.empty()) {
+    std::cerr << "No benchmarks, run from the repo root or pass some\n";
+    return 1;
+  }
+
+  if (perf) {
+    auto opened = perf_counters::open();
+    if (!opened.has_value()) {
+      std::cerr << opened.error() << '\n';
+      return 1;
+    }
+    counters.emplace(std::move(*opened));
+  }
+
+  std::vector<result> results;
+  bool failed = false;
+  std::cout << std::left << std::setw(14) << "benchmark" << std::right
+            << std::setw(12) << "median ms" << std::setw(12) << "p95 ms"
+            << std::setw(12) << "min ms" << "  result\n"
+            << std::fixed << std::setprecision(3);
+  for (auto const& path: paths) {
+    auto it = bench(path, warmup, reps);
+    if (!it.error.empty()) {
+      std::cout << std::left << std::setw(14) << it.name << std::right
+                << " failed: " << it.error << '\n';
+      failed = true;
+      results.push_back(std::move(it));
+      continue;
+    }
+
+    std::ranges::sort(it.runs_ns);
+    std::cout << std::left << std::setw(14) << it.name << std::right
+              << std::setw(12) << double(percentile(it.runs_ns, 50)) / 1e6
+              << std::setw(12) << double(percentile(it.runs_ns, 95)) / 1e6
+              << std::setw(12) << double(it.runs_ns.front()) / 1e6
+              << "  " << it.output << '\n';
+    results.push_back(std::move(it));
+  }
+
+  for (auto const& it: results) {
+    if (it.perf.empty()) continue;
+    std::cout << '\n' << it.name << ":\n";
+    print_perf_header(std::cout);
+    for (auto const& [phase, counts]: it.perf) print_perf(std::cout, phase, counts);
+  }
+
+  if (!json_path.empty()) {
+    std::ofstream out{json_path};
+    out << "{\n  \"warmup\": " << warmup << ",\n  \"reps\": " << reps
+        << ",\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      auto const& it = results[i];
+      out << (i ? "," : "") << "\n    {\"name\": " << json_string(it.name);
+      if (!it.error.empty()) {
+        out << ", \"error\": " << json_string(it.error) << '}';
+        continue;
+      }
+
+      out << ", \"median_ns\": " << percentile(it.runs_ns, 50)
+          << ", \"p95_ns\": " << percentile(it.runs_ns, 95)
+          << ", \"min_ns\": " << it.runs_ns.front()
+          << ", \"max_ns\": " << it.runs_ns.back()
+          << ", \"result\": " << json_string(it.output) << ", \"runs_ns\": [";
+      for (size_t j = 0; j < it.runs_ns.size(); j++) {
+        out << (j ? ", " : "") << it.runs_ns[j];
+      }
+      out << ']';
+      if (!it.perf.empty()) {
+        out << ", \"perf\": {";
+        for (size_t j = 0; j < it.perf.size(); j++) {
+          auto const& [phase, counts] = it.perf[j];
+          out << (j ? ", " : "") << json_string(phase) << ": ";
+          if (counts.missing) {
+            out << "null";
+            continue;
+          }
+          out << "{\"cycles\": " << counts.cycles
+              << ", \"instructions\": " << counts.instructions
+              << ", \"branch_misses\": " << counts.branch_misses
+              << ", \"cache_misses\": " << counts.cache_misses
+              << ", \"ipc\": " << counts.ipc() << '}';
+        }
+        out << '}';
+      }
+      out << '}';
+    }
+    out << "\n  ]\n}\n";
+    if (!out) {
+      std::cerr << "Can't write " << json_path << '\n';
+      return 1;
+    }
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include "../src/tosuto.h"
+#include "../src/lex.h"
+#include "../src/parse.h"
+#include "../src/vm/vm.h"
+#include "../src/vm/compile.h"
+
+// front-end throughput on generated sources. each kind of source is lexed,
+// parsed and compiled a few times, each phase timed on its own against a
+// fresh copy of the last one's output, and the medians reported as MB/s of
+// source, tokens/s and AST nodes/s along with how many allocations the
+// phase made. parsing parses function bodies too and compiling compiles
+// them, rather than leaving them for their first call.
+//
+//   ami_frontend_bench [--size mb] [--reps n] [--emit dir] [kind...]
+//
+// kinds are functions, nesting, strings, objects and mixed. --emit writes
+// the generated sources to dir instead of timing them.
+
+namespace {
+  std::atomic<tosuto::u64> alloc_count = 0;
+  std::atomic<tosuto::u64> alloc_bytes = 0;
+}
+
+void* operator new(std::size_t size) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (auto* it = std::malloc(size ? size : 1)) return it;
+  throw std::bad_alloc{};
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+namespace {
+  using namespace tosuto;
+  using clock = std::chrono::steady_clock;
+
+  // lots of small functions calling each other
+  void gen_functions(std::ostream& out, size_t i) {
+    out << "f" << i << " : a b {\n"
+        << "  x := a * " << i % 97 << " + b\n"
+        << "  y := [| lo = x - " << i % 7 << ", hi = x + " << i % 11 << " |]\n"
+        << "  for k : 0..a {\n"
+        << "    x = x + k * y.lo % 3\n"
+        << "  }\n"
+        << "  if x > y.hi { ret f" << (i ? i - 1 : 0) << "(x, b) } "
+        << "elif x < 0 { ret -x } else { ret x / 2 }\n"
+        << "}\n\n";
+  }
+
+  // blocks and parens nested as deep as they go in real code and then some
+  void gen_nesting(std::ostream& out, size_t i) {
+    constexpr size_t depth = 48;
+    out << "n" << i << " : a {\n";
+    for (size_t d = 0; d < depth; d++) {
+      out << std::string(d * 2 + 2, ' ') << "if a > " << d << " {\n";
+    }
+    out << std::string(depth * 2 + 2, ' ');
+    for (size_t d = 0; d < depth; d++) out << "(a + ";
+    out << i;
+    for (size_t d = 0; d < depth; d++) out << ")";
+    out << '\n';
+    for (size_t d = depth; d-- > 0;) {
+      out << std::string(d * 2 + 2, ' ') << "} else { " << d << " }\n";
+    }
+    out << "}\n\n";
+  }
+
+  // long literals, with escapes and some multibyte utf-8 sprinkled in
+  void gen_strings(std::ostream& out, size_t i) {
+    out << "s" << i << " : -> \"";
+    for (size_t j = 0; j < 64; j++) {
+      out << "line " << j << " of string " << i << ", caf\u00e9 \u3068\u3059\u3068 "
+          << "and an escaped newline\\n";
+    }
+    out << "\"\n\n";
+  }
+
+  // big object literals, nested a couple of levels
+  void gen_objects(std::ostream& out, size_t i) {
+    out << "o" << i << " : -> [|\n";
+    for (size_t j = 0; j < 200; j++) {
+      out << "  k" << j << " = ";
+      switch (j % 4) {
+        case 0: out << j * i; break;
+        case 1: out << "\"v" << j << "\""; break;
+        case 2: out << "[| x = " << j << ", y = [| z = " << i << " |] |]"; break;
+        default: out << "[" << j << ", " << j + 1 << ", " << j + 2 << "]";
+      }
+      out << (j + 1 < 200 ? ",\n" : "\n");
+    }
+    out << "|]\n\n";
+  }
+
+  using generator = void (*)(std::ostream&, size_t);
+
+  const std::vector<std::pair<std::string, generator>> generators{
+    {"functions", gen_functions},
+    {"nesting", gen_nesting},
+    {"strings", gen_strings},
+    {"objects", gen_objects},
+  };
+
+  // every definition is a function, each with its own literal pool, so
+  // however big it gets the script's pool only holds their names
+  std::string generate(std::string const& kind, size_t bytes) {
+    std::stringstream out;
+    for (size_t i = 0; size_t(out.tellp()) < bytes; i++) {
+      if (kind == "mixed") {
+        generators[i % generators.size()].second(out, i);
+        continue;
+      }
+      auto it = std::ranges::find(generators, kind, &std::pair<std::string, generator>::first);
+      it->second(out, i);
+    }
+    return out.str();
+  }
+
+  size_t count_nodes(node* n) {
+    size_t count = 1;
+    for_each_child(n, [&](node* child) { count += count_nodes(child); });
+    return count;
+  }
+
+  struct phase {
+    std::vector<double> seconds;
+    u64 allocs = 0, bytes = 0;
+
+    template<typename F>
+    auto time(F&& fn) {
+      auto allocs_before = allocs_now(), bytes_before = bytes_now();
+      auto start = clock::now();
+      auto res = fn();
+      seconds.push_back(std::chrono::duration<double>(clock::now() - start).count());
+      allocs = allocs_now() - allocs_before;
+      bytes = bytes_now() - bytes_before;
+      return res;
+    }
+
+    [[nodiscard]] double median() {
+      std::ranges::sort(seconds);
+      return seconds[seconds.size() / 2];
+    }
+
+    static u64 allocs_now() { return alloc_count.load(std::memory_order_relaxed); }
+
+    static u64 bytes_now() { return alloc_bytes.load(std::memory_order_relaxed); }
+  };
+
+  void report(std::string const& name, phase& it, double mb, double units,
+              char const* unit) {
+    auto median = it.median();
+    std::cout << "  " << std::left << std::setw(8) << name << std::right
+              << std::setw(10) << median * 1e3 << " ms"
+              << std::setw(10) << mb / median << " MB/s"
+              << std::setw(12) << units / median / 1e6 << " M" << unit << "/s"
+              << std::setw(12) << it.allocs << " allocs"
+              << std::setw(10) << double(it.bytes) / 1e6 << " MB\n";
+  }
+
+  std::expected<void, std::string>
+  bench(std::string const& kind, size_t bytes, size_t reps) {
+    auto src = generate(kind, bytes);
+    auto text = to_utf32(src);
+    auto mb = double(src.size()) / 1e6;
+
+    phase lex, parse, compile;
+    size_t toks_count = 0, nodes = 0;
+    for (size_t i = 0; i < reps; i++) {
+      lexer lx{text, 1};
+      std::vector<token> toks;
+      try {
+        toks = lex.time([&] { return lx.lex(); });
+      } catch (std::runtime_error const& err) {
+        return std::unexpected{err.what()};
+      }
+      toks_count = toks.size();
+
+      parser p{std::move(toks)};
+      p.pre_parse = false;
+      auto ast = parse.time([&] { return p.global(); });
+      if (!ast.has_value()) return std::unexpected{ast.error()};
+      nodes = count_nodes(ast->get());
+
+      vm::compiler comp{vm::value::function::type::script};
+      comp.lazy = false;
+      auto fn = compile.time([&] { return comp.global(ast->get()); });
+      if (!fn.has_value()) return std::unexpected{fn.error()};
+    }
+
+    std::cout << kind << ": " << std::fixed << std::setprecision(2) << mb
+              << " MB, " << toks_count << " tokens, " << nodes << " nodes\n";
+    report("lex", lex, mb, double(toks_count), "tokens");
+    report("parse", parse, mb, double(nodes), "nodes");
+    report("compile", compile, mb, double(nodes), "nodes");
+    return {};
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t bytes = 4'000'000, reps = 5;
+  std::string emit;
+  std::vector<std::string> kinds;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--size" && i + 1 < argc) {
+      bytes = size_t(std::stod(argv[++i]) * 1e6);
+    } else if (arg == "--reps" && i + 1 < argc) {
+      reps = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "--emit" && i + 1 < argc) {
+      emit = argv[++i];
+    } else {
+      kinds.push_back(arg);
+    }
+  }
+
+  if (kinds.empty()) {
+    for (auto const& [kind, _]: generators) kinds.push_back(kind);
+    kinds.emplace_back("mixed");
+  }
+
+  bool failed = false;
+  for (auto const& kind: kinds) {
+    if (kind != "mixed" &&
+        std::ranges::find(generators, kind, &std::pair<std::string, generator>::first) ==
+        generators.end()) {
+      std::cerr << "Unknown kind " << kind << '\n';
+      return 1;
+    }
+
+    if (!emit.empty()) {
+      std::filesystem::create_directories(emit);
+      auto path = std::filesystem::path(emit) / (kind + ".tosuto");
+      std::ofstream(path) << generate(kind, bytes);
+      std::cout << "wrote " << path.string() << '\n';
+      continue;
+    }
+
+    auto res = bench(kind, bytes, reps);
+    if (!res.has_value()) {
+      std::cout << kind << " failed: " << res.error() << '\n';
+      failed = true;
+    }
+  }
+
+  return failed ? 1 : 0;
+}
@@ -3,8 +3,20 @@
 #include "src/tosuto.h"
 #include "src/lex.h"
 #include "src/parse.h"
+#include "src/perf.h"
 #include "src/vm/vm.h"
 #include "src/vm/compile.h"
+#include "src/vm/cache.h"
+#include "src/vm/snapshot.h"
+#include "src/vm/tasks.h"
+#include "src/vm/coro.h"
+#include "src/vm/loop.h"
+#include "src/vm/actors.h"
+#include "src/vm/gc.h"
+#include "src/vm/reload.h"
+#include "src/vm/modules.h"
+#include "src/vm/profile.h"
+#include "src/vm/stats.h"
 
 size_t cur_ms() {
   using namespace std::chrono;
@@ -13,34 +25,39 @@ size_t cur_ms() {
   ).count();
 }
 
-void test_vm() {
+void test_vm(bool perf) {
   size_t start, finish;
-  start = cur_ms();
-  auto lex = tosuto::lexer{"test.tosuto"};
-  auto toks = lex.lex();
-  finish = cur_ms();
-  size_t lex_time = finish - start;
+  size_t lex_time = 0, parse_time = 0, compile_time = 0;
 
-  start = cur_ms();
-  auto parse = tosuto::parser{toks};
-  auto ast = parse.global();
-  finish = cur_ms();
-  size_t parse_time = finish - start;
-  if (!ast.has_value()) throw std::runtime_error(ast.error());
-  std::ofstream("out.txt") << (*ast)->pretty(0);
-
-  start = cur_ms();
-  auto compile = tosuto::vm::compiler{tosuto::vm::value::function::type::script};
-  auto res = compile.global(ast->get());
-  finish = cur_ms();
-  size_t compile_time = finish - start;
-  if (!res.has_value()) throw std::runtime_error(res.error());
-  auto& fn = res.value();
-  fn.desc->chunk.disasm(std::cout);
-  std::cout << "\nvm: \n";
+  std::string path = "test.tosuto";
+  std::stringstream source;
+  source << std::ifstream(path).rdbuf();
+  auto hash = tosuto::vm::fnv1a(source.str());
+  auto cache = tosuto::vm::cache_path(path);
 
   using namespace tosuto;
 
+  // hardware counters for each phase, with --perf
+  std::optional<perf_counters> counters;
+  std::vector<std::pair<std::string, perf_counts>> phases;
+  if (perf) {
+    auto opened = perf_counters::open();
+    if (opened.has_value()) {
+      counters.emplace(std::move(*opened));
+    } else {
+      std::cerr << opened.error() << '\n';
+    }
+  }
+  auto counted = [&](std::string const& phase, auto&& fn) {
+    if (!counters) return fn();
+    auto before = counters->read();
+    auto res = fn();
+    phases.emplace_back(phase, counters->read() - before);
+    return res;
+  };
+
+  // the script itself is filled in below, unless a snapshot brings its own
+  vm::value::function fn;
   auto vm = vm::vm{fn};
   using nt_ret = std::expected<vm::value, std::string>;
   vm.def_native(
@@ -69,21 +86,135 @@ void test_vm() {
       return nt_ret{vm::value{vm::value::str{args[0].to_string()}}};
     });
 
+  vm.def_native("snapshot", 0, vm::snapshot);
+  vm.def_native("freeze", 1, vm::freeze);
+  vm.def_native("gc", 0, vm::gc);
+  vm.def_native("gc_stats", 0, vm::gc_stats);
+  vm.def_native("gc_pause", 1, vm::gc_pause);
+  vm.def_native("spawn", 1, vm::spawn);
+  vm.def_native("join", 1, vm::join);
+  vm.def_native("@parallel_for", 9, vm::parallel_for);
+  vm.def_native("coro", 1, vm::coro);
+  vm.def_native("resume", 1, vm::resume);
+  vm.def_native("done", 1, vm::done);
+  vm.def_native("go", 1, vm::go);
+  vm.def_native("run_loop", 0, vm::run_loop);
+  vm.def_native("sleep", 1, vm::sleep);
+  vm.def_native("read_file_async", 1, vm::read_file_async);
+  vm.def_native("tcp_listen", 1, vm::tcp_listen);
+  vm.def_native("tcp_accept", 1, vm::tcp_accept);
+  vm.def_native("tcp_connect", 1, vm::tcp_connect);
+  vm.def_native("tcp_recv", 1, vm::tcp_recv);
+  vm.def_native("tcp_send", 2, vm::tcp_send);
+  vm.def_native("tcp_close", 1, vm::tcp_close);
+  vm.def_native("actor", 1, vm::actor);
+  vm.def_native("send", 2, vm::send);
+  vm.def_native("receive", 0, vm::receive);
+  vm.def_native("self", 0, vm::self);
+  vm.def_native("hot_reload", 1, vm::hot_reload);
+  vm.def_native("@import", 1, vm::import);
+  vm.def_native("profile_start", 1, vm::profile_start);
+  vm.def_native("profile_stop", 1, vm::profile_stop);
+  vm.snapshot_path = vm::snapshot_path(path);
+  vm.snapshot_key = hash;
+
+  start = cur_ms();
+  auto restored = vm::restore_snapshot(vm);
+  finish = cur_ms();
+  size_t restore_time = finish - start;
+
+  std::expected<vm::value::function, std::string> cached;
+  size_t load_time = 0;
+  // kept past the run, bodies that never ran still compile from it when
+  // the cache is written
+  std::expected<std::shared_ptr<node>, std::string> ast;
+  if (!restored.has_value()) {
+    start = cur_ms();
+    cached = vm::read_cache(cache, hash);
+    finish = cur_ms();
+    load_time = finish - start;
+
+    if (cached.has_value()) {
+      fn = *cached;
+    } else {
+      start = cur_ms();
+      auto lex = tosuto::lexer{path};
+      auto toks = counted("lex", [&] { return lex.lex(); });
+      finish = cur_ms();
+      lex_time = finish - start;
+
+      start = cur_ms();
+      auto parse = tosuto::parser{toks};
+      ast = counted("parse", [&] { return parse.global(); });
+      finish = cur_ms();
+      parse_time = finish - start;
+      if (!ast.has_value()) throw std::runtime_error(ast.error());
+      std::ofstream("out.txt") << (*ast)->pretty(0);
+
+      // bodies stay deferred until their first call, the cache is written
+      // once the run is over
+      start = cur_ms();
+      auto compile = vm::compiler{vm::value::function::type::script};
+      auto compiled = counted("compile", [&]() -> std::expected<void, std::string> {
+        fn = ami_unwrap(compile.global(ast->get()));
+        vm::load_modules(vm::imports_of(ast->get()));
+        return {};
+      });
+      if (!compiled.has_value()) throw std::runtime_error(compiled.error());
+      finish = cur_ms();
+      compile_time = finish - start;
+    }
+  }
+
+  vm.frames.back().fn.desc->chunk.disasm(std::cout);
+  std::cout << "\nvm: \n";
+#ifdef AMI_OPCODE_STATS
+  // the frame's gone once run() returns
+  auto script = vm.frames.back().fn;
+#endif
+
   start = cur_ms();
-  auto interp_res = vm.run(std::cout);
+  auto interp_res = counted("run", [&] { return vm.run(std::cout); });
   finish = cur_ms();
   size_t run_time = finish - start;
   if (!interp_res.has_value()) throw std::runtime_error(interp_res.error());
 
+  // what ran is compiled by now, the writer compiles the rest
+  if (!restored.has_value() && !cached.has_value()) {
+    auto written = vm::write_cache(cache, hash, fn);
+    if (!written.has_value()) std::cerr << written.error() << '\n';
+  }
+
   std::cout << "\n\n\n";
 
-  std::cout << "lex took " << lex_time << "ms" << '\n';
-  std::cout << "parse took " << parse_time << "ms" << '\n';
-  std::cout << "compile took " << compile_time << "ms" << '\n';
+  if (restored.has_value()) {
+    std::cout << "restoring " << vm.snapshot_path << " took " << restore_time
+              << "ms" << '\n';
+  } else if (cached.has_value()) {
+    std::cout << "loading " << cache << " took " << load_time << "ms" << '\n';
+  } else {
+    std::cout << "lex took " << lex_time << "ms" << '\n';
+    std::cout << "parse took " << parse_time << "ms" << '\n';
+    std::cout << "compile took " << compile_time << "ms" << '\n';
+  }
   std::cout << "run took " << run_time << "ms" << '\n';
+
+  if (!phases.empty()) {
+    std::cout << "\n";
+    print_perf_header(std::cout);
+    for (auto const& [phase, counts]: phases) print_perf(std::cout, phase, counts);
+  }
+
+#ifdef AMI_OPCODE_STATS
+  std::cout << "\n";
+  script.desc->chunk.disasm(std::cout);
+  vm::print_op_stats(std::cout);
+#endif
 }
 
-int main() {
-  test_vm();
+int main(int argc, char** argv) {
+  // --perf reports hardware counters for each phase, see src/perf.h
+  bool perf = argc > 1 && std::string_view(argv[1]) == "--perf";
+  test_vm(perf);
   return 0;
 }
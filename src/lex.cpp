@@ -1,9 +1,13 @@
+#include <algorithm>
+#include <exception>
+#include <iterator>
 #include <sstream>
 #include <iostream>
+#include <thread>
 #include "lex.h"
 
 namespace tosuto {
-  static std::unordered_map<std::u32string, tok_type> keywords =
+  static const std::unordered_map<std::u32string, tok_type> keywords =
     {
       {U"if",    tok_type::key_if},
       {U"elif",  tok_type::key_elif},
@@ -16,10 +20,12 @@ namespace tosuto {
       {U"with",  tok_type::key_with},
       {U"false", tok_type::key_false},
       {U"true",  tok_type::key_true},
-      {U"nil",   tok_type::key_nil}
+      {U"nil",   tok_type::key_nil},
+      {U"yield", tok_type::key_yield},
+      {U"import", tok_type::key_import}
     };
 
-  static std::unordered_map<char32_t, tok_type> symbols =
+  static const std::unordered_map<char32_t, tok_type> symbols =
     {
       {U']',  tok_type::r_square},
       {U'{',  tok_type::l_curly},
@@ -46,20 +52,137 @@ namespace tosuto {
     ch = text[0];
   }
 
+  lexer::lexer(std::u32string text, size_t row) : text(std::move(text)),
+                                                 cpos{0, 1, row} {
+    ch = this->text[0];
+  }
+
   void lexer::advance() {
     switch (ch) {
       case '\n':cpos.idx++, cpos.row++, cpos.col = 1;
         break;
-      case '\r':break;
+      case '\r':cpos.idx++;
+        break;
       default:cpos.idx++, cpos.col++;
     }
 
     ch = cpos.idx >= text.length() ? '\0' : text[cpos.idx];
   }
 
+  namespace {
+    // below this lexing the whole thing takes about as long as starting
+    // the threads
+    constexpr size_t parallel_min = size_t(1) << 20;
+    constexpr size_t piece_min = size_t(1) << 18;
+
+    struct piece {
+      size_t begin, end, row;
+    };
+
+    // cuts text into about count pieces, each one starting right after a
+    // newline the lexer would only ever skip as whitespace. that's one
+    // that's not in a string, a backquoted id or a comment's text
+    std::vector<piece> split(std::u32string const& text, size_t count) {
+      enum class in { code, string, quoted, comment } state = in::code;
+      std::vector<piece> out{{0, 0, 1}};
+      size_t row = 1;
+      size_t next_cut = text.length() / count;
+      for (size_t i = 0; i < text.length(); i++) {
+        auto ch = text[i];
+        switch (state) {
+          case in::code:
+            if (ch == '"') state = in::string;
+            else if (ch == '`') state = in::quoted;
+            else if (ch == '/' && i + 1 < text.length() && text[i + 1] == '/') {
+              state = in::comment;
+            }
+            break;
+          case in::string:
+            if (ch == '\\' && i + 1 < text.length()) {
+              // the lexer rejects escaped newlines, still a row though
+              if (text[++i] == '\n') row++;
+            } else if (ch == '"') state = in::code;
+            break;
+          case in::quoted:
+            if (ch == '`') state = in::code;
+            break;
+          case in::comment:
+            if (ch == '\n') state = in::code;
+            break;
+        }
+
+        if (ch != '\n') continue;
+        row++;
+        if (state != in::code || i + 1 < next_cut || i + 1 == text.length()) {
+          continue;
+        }
+
+        out.back().end = i + 1;
+        out.push_back({i + 1, 0, row});
+        next_cut = i + 1 + text.length() / count;
+      }
+
+      out.back().end = text.length();
+      return out;
+    }
+  }
+
   std::vector<token> lexer::lex() {
+    size_t threads = std::thread::hardware_concurrency();
+    size_t count = std::min(threads, text.length() / piece_min);
+    if (text.length() < parallel_min || count < 2) {
+      std::vector<token> toks;
+      lex_all(toks);
+      toks.emplace_back(tok_type::eof, "", cpos, cpos);
+      return toks;
+    }
+
+    auto pieces = split(text, count);
+    std::vector<std::vector<token>> lexed(pieces.size());
+    std::vector<std::exception_ptr> errors(pieces.size());
+    auto lex_piece = [&](size_t i) {
+      try {
+        auto const& it = pieces[i];
+        lexer part{text.substr(it.begin, it.end - it.begin), it.row};
+        part.lex_all(lexed[i]);
+        for (auto& tok: lexed[i]) {
+          tok.begin.idx += it.begin;
+          tok.end.idx += it.begin;
+        }
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    };
+
+    {
+      std::vector<std::jthread> running;
+      for (size_t i = 1; i < pieces.size(); i++) running.emplace_back(lex_piece, i);
+      lex_piece(0);
+    }
+
+    // the error serial lexing would've run into first
+    for (auto const& it: errors) {
+      if (it) std::rethrow_exception(it);
+    }
+
     std::vector<token> toks;
+    size_t total = 1;
+    for (auto const& it: lexed) total += it.size();
+    toks.reserve(total);
+    for (auto& it: lexed) std::ranges::move(it, std::back_inserter(toks));
 
+    // where serial lexing would've ended up
+    cpos = {text.length(), 1, pieces.back().row};
+    for (size_t i = pieces.back().begin; i < text.length(); i++) {
+      if (text[i] == '\n') cpos.row++, cpos.col = 1;
+      else if (text[i] != '\r') cpos.col++;
+    }
+    ch = '\0';
+    toks.emplace_back(tok_type::eof, "", cpos, cpos);
+    return toks;
+  }
+
+  void lexer::lex_all(std::vector<token>& toks) {
     while (cpos.idx < text.length()) {
       pos begin = cpos;
       if (is_id_start(ch)) {
@@ -69,8 +192,8 @@ namespace tosuto {
           advance();
         }
 
-        if (keywords.contains(buf)) {
-          toks.emplace_back(keywords[buf], to_utf8(buf), begin, cpos);
+        if (auto kw = keywords.find(buf); kw != keywords.end()) {
+          toks.emplace_back(kw->second, to_utf8(buf), begin, cpos);
         } else {
           toks.emplace_back(tok_type::id, to_utf8(buf), begin, cpos);
         }
@@ -195,7 +318,7 @@ namespace tosuto {
       } else if (symbols.contains(ch)) {
         char32_t cur = ch;
         advance();
-        toks.emplace_back(symbols[cur], to_utf8(std::u32string(1, cur)), begin,
+        toks.emplace_back(symbols.at(cur), to_utf8(std::u32string(1, cur)), begin,
                           cpos);
       } else if (isdigit(ch)) {
         std::u32string buf;
@@ -270,9 +393,6 @@ namespace tosuto {
       }
     }
 
-    toks.emplace_back(tok_type::eof, "", cpos, cpos);
-
-    return toks;
   }
 
   bool lexer::is_id_start(char32_t ch) {
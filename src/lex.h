@@ -64,7 +64,9 @@ namespace tosuto {
     key_nil,
     question,
     key_of,
-    ellipsis
+    ellipsis,
+    key_yield,
+    key_import
   };
 
   static std::string to_string(tok_type type) {
@@ -129,6 +131,8 @@ namespace tosuto {
         "question",
         "of",
         "ellipsis",
+        "yield",
+        "import",
       };
 
     return tok_type_to_string[std::to_underlying(type)];
@@ -149,10 +153,19 @@ namespace tosuto {
 
     explicit lexer(std::string const& path);
 
+    // lexes text as if it started on row, for the pieces lex() splits big
+    // files into
+    lexer(std::u32string text, size_t row);
+
     void advance();
 
+    // splits big files at newlines outside of strings and comments and
+    // lexes the pieces on threads of their own
     std::vector<token> lex();
 
+    // lexes everything without the eof token
+    void lex_all(std::vector<token>& toks);
+
     static bool is_id_start(char32_t ch);
 
     static bool is_id_continue(char32_t ch);
@@ -6,16 +6,24 @@
 
 namespace tosuto {
   parser::parser(std::vector<token> toks) :
+    parser(std::make_shared<std::vector<token> const>(std::move(toks)), 0) {}
+
+  parser::parser(std::shared_ptr<std::vector<token> const> toks, size_t idx) :
     toks(std::move(toks)),
-    idx(0) {
-    tok = this->toks[0];
-    next = this->toks[1];
+    idx(idx) {
+    tok = (*this->toks)[idx];
+    next = (*this->toks)[std::min(this->toks->size() - 1, idx + 1)];
   }
 
   void parser::advance() {
     idx++;
-    tok = toks[idx];
-    next = toks[std::min(toks.size() - 1, idx + 1)];
+    tok = (*toks)[idx];
+    next = (*toks)[std::min(toks->size() - 1, idx + 1)];
+  }
+
+  bool parser::at_annotation() const {
+    return tok.type == tok_type::colon && next.type == tok_type::id &&
+           (*toks)[std::min(toks->size() - 1, idx + 2)].type == tok_type::walrus;
   }
 
   std::expected<std::shared_ptr<node>, std::string> parser::block() {
@@ -118,7 +126,12 @@ namespace tosuto {
 
     switch (tok.type) {
       case tok_type::key_for: {
-        return for_loop();
+        auto loop = ami_unwrap(for_loop());
+        if (decor.empty()) return loop;
+
+        return std::make_shared<decorated_node>(decor, loop,
+                                                decor.front()->begin,
+                                                tok.begin);
       }
       case tok_type::key_ret: {
         token cur = tok;
@@ -130,6 +143,28 @@ namespace tosuto {
         return std::make_shared<ret_node>(ret_val, cur.begin,
                                           ret_val ? ret_val->end : cur.end);
       }
+      case tok_type::key_yield: {
+        token cur = tok;
+        advance();
+        std::shared_ptr<node> value = nullptr;
+        auto exp = expr();
+        if (exp.has_value()) value = exp.value();
+
+        return std::make_shared<yield_node>(value, cur.begin,
+                                            value ? value->end : cur.end);
+      }
+      case tok_type::key_import: {
+        token cur = tok;
+        advance();
+        if (tok.type != tok_type::string) {
+          return std::unexpected{"Expected a path after import, got " +
+                                 tok.to_string()};
+        }
+
+        token path = tok;
+        advance();
+        return std::make_shared<import_node>(path.lexeme, cur.begin, path.end);
+      }
       case tok_type::key_next: {
         token cur = tok;
         advance();
@@ -165,16 +200,26 @@ namespace tosuto {
 
     std::string id = tok.lexeme;
     auto lhs = ami_unwrap(assign());
+
+    std::string type_name;
+    if (at_annotation()) {
+      advance();
+      type_name = tok.lexeme;
+      advance();
+    }
+
     while (tok.type == tok_type::walrus) {
       advance();
       auto rhs = ami_unwrap(assign());
-      lhs = std::make_shared<var_def_node>(id, rhs, lhs->begin, rhs->end);
+      lhs = std::make_shared<var_def_node>(id, type_name, rhs, lhs->begin,
+                                           rhs->end);
+      type_name.clear();
     }
 
     return lhs;
   }
 
-  static std::unordered_map<tok_type, std::optional<tok_type>> assign_ops
+  static const std::unordered_map<tok_type, std::optional<tok_type>> assign_ops
     {
       {tok_type::add_assign, {tok_type::add}},
       {tok_type::mul_assign, {tok_type::mul}},
@@ -190,7 +235,7 @@ namespace tosuto {
       tok_type type = tok.type;
       advance();
       auto rhs = ami_unwrap(sym_or());
-      auto secondary = assign_ops[type];
+      auto secondary = assign_ops.at(type);
       auto begin = lhs->begin, end = rhs->end;
       if (secondary.has_value()) {
         lhs = std::make_shared<bin_op_node>(
@@ -232,7 +277,7 @@ namespace tosuto {
     return lhs;
   }
 
-  static std::unordered_set<tok_type> comp_ops
+  static const std::unordered_set<tok_type> comp_ops
     {
       tok_type::eq,
       tok_type::neq,
@@ -254,7 +299,7 @@ namespace tosuto {
     return lhs;
   }
 
-  static std::unordered_set<tok_type> add_ops
+  static const std::unordered_set<tok_type> add_ops
     {
       tok_type::add,
       tok_type::sub
@@ -272,7 +317,7 @@ namespace tosuto {
     return lhs;
   }
 
-  static std::unordered_set<tok_type> mul_ops
+  static const std::unordered_set<tok_type> mul_ops
     {
       tok_type::mul,
       tok_type::div,
@@ -333,7 +378,7 @@ namespace tosuto {
     return lhs;
   }
 
-  static std::unordered_set<tok_type> pre_unary_ops
+  static const std::unordered_set<tok_type> pre_unary_ops
     {
       tok_type::exclaim,
       tok_type::add,
@@ -352,7 +397,7 @@ namespace tosuto {
     return post_unary();
   }
 
-  static std::unordered_set<tok_type> post_unary_ops
+  static const std::unordered_set<tok_type> post_unary_ops
     {
       tok_type::inc,
       tok_type::dec,
@@ -374,7 +419,8 @@ namespace tosuto {
     pos begin = tok.begin;
     std::shared_ptr<node> body = ami_unwrap(atom());
     while ((tok.type == tok_type::l_paren && allow_parens) || tok.type == tok_type::dot ||
-           tok.type == tok_type::colon || tok.type == tok_type::l_square) {
+           (tok.type == tok_type::colon && !at_annotation()) ||
+           tok.type == tok_type::l_square) {
       auto type = tok.type;
       advance();
       switch (type) {
@@ -584,6 +630,7 @@ namespace tosuto {
     bool is_variadic = false;
 
     std::vector<std::pair<std::string, bool>> args;
+    std::vector<std::string> arg_types;
     if (tok.type == tok_type::colon) {
       advance();
       while (tok.type == tok_type::id) {
@@ -593,10 +640,20 @@ namespace tosuto {
           arg.second = true;
           advance();
         }
+
+        std::string type_name;
+        if (tok.type == tok_type::colon && next.type == tok_type::id) {
+          advance();
+          type_name = tok.lexeme;
+          advance();
+        }
+
         args.push_back(arg);
+        arg_types.push_back(type_name);
       }
 
-      if (tok.type == tok_type::l_paren) {
+      // `x: num := ..` is an annotated definition, not a function
+      if (tok.type == tok_type::l_paren || tok.type == tok_type::walrus) {
         set_state(save_in_case_of_call);
         return std::unexpected{call_error_tag};
       }
@@ -611,13 +668,155 @@ namespace tosuto {
       advance();
       auto body = ami_unwrap(expr());
       return std::make_shared<fn_def_node>(
-        id, args, body, is_variadic, begin, body->end);
+        id, args, arg_types, body, is_variadic, begin, body->end);
     }
 
     ami_discard(expect(tok_type::l_curly, false));
+    if (pre_parse) {
+      auto deferred = ami_unwrap(skip_body());
+      auto fn = std::make_shared<fn_def_node>(
+        id, args, arg_types, nullptr, is_variadic, begin,
+        (*toks)[idx - 1].end);
+      fn->deferred = deferred;
+      return fn;
+    }
+
     auto body = ami_unwrap(block());
     return std::make_shared<fn_def_node>(
-      id, args, body, is_variadic, begin, body->end);
+      id, args, arg_types, body, is_variadic, begin, body->end);
+  }
+
+  // what an expression can start with, see atom and pre_unary
+  static const std::unordered_set<tok_type> operand_starts
+    {
+      tok_type::id,
+      tok_type::number,
+      tok_type::string,
+      tok_type::l_paren,
+      tok_type::l_square,
+      tok_type::l_object,
+      tok_type::colon,
+      tok_type::key_if,
+      tok_type::key_false,
+      tok_type::key_true,
+      tok_type::key_nil,
+      tok_type::exclaim,
+      tok_type::add,
+      tok_type::sub
+    };
+
+  // operators that always need an operand after them. mul isn't one, a
+  // trailing `*` spreads
+  static const std::unordered_set<tok_type> needs_operand
+    {
+      tok_type::assign,
+      tok_type::add_assign,
+      tok_type::sub_assign,
+      tok_type::mul_assign,
+      tok_type::div_assign,
+      tok_type::mod_assign,
+      tok_type::walrus,
+      tok_type::eq,
+      tok_type::neq,
+      tok_type::less_than,
+      tok_type::less_than_equal,
+      tok_type::greater_than,
+      tok_type::greater_than_equal,
+      tok_type::sym_or,
+      tok_type::sym_and,
+      tok_type::add,
+      tok_type::sub,
+      tok_type::div,
+      tok_type::mod,
+      tok_type::exclaim,
+      tok_type::range,
+      tok_type::key_with
+    };
+
+  std::expected<std::shared_ptr<deferred_body>, std::string>
+  parser::skip_body() {
+    static const std::unordered_map<tok_type, tok_type> closers{
+      {tok_type::l_curly,  tok_type::r_curly},
+      {tok_type::l_paren,  tok_type::r_paren},
+      {tok_type::l_square, tok_type::r_square},
+      {tok_type::l_object, tok_type::r_object},
+    };
+
+    auto body = std::make_shared<deferred_body>();
+    body->toks = toks;
+    body->begin = idx;
+
+    std::vector<tok_type> open;
+    do {
+      switch (tok.type) {
+        case tok_type::l_curly:
+        case tok_type::l_paren:
+        case tok_type::l_square:
+        case tok_type::l_object: open.push_back(closers.at(tok.type));
+          break;
+        case tok_type::r_curly:
+        case tok_type::r_paren:
+        case tok_type::r_square:
+        case tok_type::r_object: {
+          if (open.back() != tok.type) {
+            return std::unexpected{
+              "Expected " + to_string(open.back()) + ", got " +
+              tok.to_string()};
+          }
+          open.pop_back();
+          break;
+        }
+        case tok_type::eof:
+          return std::unexpected{
+            "Unterminated function body at " +
+            (*toks)[body->begin].to_string()};
+        case tok_type::key_import: body->imports = true;
+          break;
+        case tok_type::id: {
+          if ((*toks)[idx - 1].type == tok_type::dot) {
+            if (assign_ops.contains(next.type)) body->props.emplace(tok.lexeme);
+            break;
+          }
+
+          body->names.emplace(tok.lexeme);
+          if (assign_ops.contains(next.type)) body->assigned.emplace(tok.lexeme);
+          if (next.type == tok_type::walrus || next.type == tok_type::colon) {
+            body->defined.emplace(tok.lexeme);
+          }
+          break;
+        }
+        case tok_type::dot:
+          if (next.type != tok_type::id) {
+            return std::unexpected{"Expected id after dot, got " + next.to_string()};
+          }
+          break;
+        default:;
+      }
+
+      // a cheap look at what follows, so bodies that are never parsed still
+      // report the most common mistakes
+      if (needs_operand.contains(tok.type) && !operand_starts.contains(next.type)) {
+        return std::unexpected{
+          "Expected atom after " + tok.to_string() + ", got " + next.to_string()};
+      }
+
+      advance();
+    } while (!open.empty());
+
+    body->end = idx;
+    return body;
+  }
+
+  std::expected<void, std::string> fn_def_node::parse_body() {
+    if (!deferred) return {};
+
+    parser p{deferred->toks, deferred->begin};
+    auto parsed = p.block();
+    if (!parsed.has_value()) return std::unexpected{parsed.error()};
+
+    body = std::move(*parsed);
+    deferred = nullptr;
+    return {};
   }
 
   void parser::set_state(parser::state const& s) {
@@ -628,6 +827,117 @@ namespace tosuto {
     return state{idx, tok, next};
   }
 
+  void for_each_child(node* n, std::function<void(node*)> const& fn) {
+    switch (n->type) {
+      case node_type::fn_def:
+      case node_type::anon_fn_def: {
+        auto it = static_cast<fn_def_node*>(n);
+        if (it->body) fn(it->body.get());
+        break;
+      }
+      case node_type::block: {
+        for (auto const& it: static_cast<block_node*>(n)->exprs) fn(it.get());
+        break;
+      }
+      case node_type::array: {
+        for (auto const& it: static_cast<array_node*>(n)->exprs) fn(it.get());
+        break;
+      }
+      case node_type::sized_array: {
+        auto it = static_cast<sized_array_node*>(n);
+        fn(it->size.get());
+        fn(it->val.get());
+        break;
+      }
+      case node_type::call: {
+        auto it = static_cast<call_node*>(n);
+        fn(it->callee.get());
+        for (auto const& arg: it->args) fn(arg.get());
+        break;
+      }
+      case node_type::member_call: {
+        auto it = static_cast<member_call_node*>(n);
+        fn(it->callee.get());
+        for (auto const& arg: it->args) fn(arg.get());
+        break;
+      }
+      case node_type::un_op: {
+        fn(static_cast<un_op_node*>(n)->target.get());
+        break;
+      }
+      case node_type::bin_op: {
+        auto it = static_cast<bin_op_node*>(n);
+        fn(it->lhs.get());
+        fn(it->rhs.get());
+        break;
+      }
+      case node_type::object: {
+        for (auto const& it: static_cast<object_node*>(n)->fields) {
+          fn(it.second.get());
+        }
+        break;
+      }
+      case node_type::field_get: {
+        auto it = static_cast<field_get_node*>(n);
+        if (it->target) fn(it->target.get());
+        break;
+      }
+      case node_type::if_stmt: {
+        auto it = static_cast<if_node*>(n);
+        for (auto const& [cond, body]: it->cases) {
+          fn(cond.get());
+          fn(body.get());
+        }
+        if (it->else_case) fn(it->else_case.get());
+        break;
+      }
+      case node_type::ret: {
+        auto it = static_cast<ret_node*>(n);
+        if (it->ret_val) fn(it->ret_val.get());
+        break;
+      }
+      case node_type::yield: {
+        auto it = static_cast<yield_node*>(n);
+        if (it->value) fn(it->value.get());
+        break;
+      }
+      case node_type::var_def: {
+        fn(static_cast<var_def_node*>(n)->value.get());
+        break;
+      }
+      case node_type::range: {
+        auto it = static_cast<range_node*>(n);
+        fn(it->start.get());
+        fn(it->finish.get());
+        break;
+      }
+      case node_type::for_loop: {
+        auto it = static_cast<for_node*>(n);
+        fn(it->iterable.get());
+        fn(it->body.get());
+        break;
+      }
+      case node_type::deco: {
+        auto it = static_cast<deco_node*>(n);
+        fn(it->deco.get());
+        for (auto const& field: it->fields) fn(field.get());
+        break;
+      }
+      case node_type::decorated: {
+        auto it = static_cast<decorated_node*>(n);
+        for (auto const& deco: it->decos) fn(deco.get());
+        fn(it->target.get());
+        break;
+      }
+      case node_type::number:
+      case node_type::string:
+      case node_type::kw_literal:
+      case node_type::next:
+      case node_type::brk:
+      case node_type::import_stmt: break;
+    }
+  }
+
   node::node(node_type type, pos begin, pos end) :
     type(type),
     begin(begin),
@@ -635,10 +945,12 @@ namespace tosuto {
 
   fn_def_node::fn_def_node(std::string name,
                            std::vector<std::pair<std::string, bool>> args,
+                           std::vector<std::string> arg_types,
                            std::shared_ptr<node> body,
                            bool is_variadic, pos begin, pos end) :
     name(std::move(name)),
     args(std::move(args)),
+    arg_types(std::move(arg_types)),
     body(std::move(body)),
     is_variadic(is_variadic),
     node(node_type::fn_def, begin, end) {
@@ -650,9 +962,12 @@ namespace tosuto {
   std::string fn_def_node::pretty(int indent) const {
     std::string ind = std::string((indent + 1) * 2, ' ');
     std::string arg_str;
-    for (auto const& it: args) {
-      arg_str += it.first;
-      if (it.second) arg_str += "*";
+    for (size_t i = 0; i < args.size(); i++) {
+      arg_str += args[i].first;
+      if (args[i].second) arg_str += "*";
+      if (i < arg_types.size() && !arg_types[i].empty()) {
+        arg_str += ": " + arg_types[i];
+      }
       arg_str += ", ";
     }
 
@@ -665,7 +980,10 @@ namespace tosuto {
         << "fn_def_node: {\n"
         << ind << "name: " << name << ",\n"
         << ind << "args: [" << arg_str << ']' << ",\n"
-        << ind << "body: " << body->pretty(indent + 1) << '\n'
+        << ind << "body: " << (body ? body->pretty(indent + 1)
+                                    : "pre-parsed, tokens " +
+                                      std::to_string(deferred->begin) + ".." +
+                                      std::to_string(deferred->end)) << '\n'
         << std::string(indent * 2, ' ') << '}').str();
   }
 
@@ -817,10 +1135,11 @@ namespace tosuto {
         << std::string(indent * 2, ' ') << '}').str();
   }
 
-  var_def_node::var_def_node(std::string name, std::shared_ptr<node> value,
-                             pos begin, pos end)
+  var_def_node::var_def_node(std::string name, std::string type_name,
+                             std::shared_ptr<node> value, pos begin, pos end)
     :
     name(std::move(name)),
+    type_name(std::move(type_name)),
     value(std::move(value)),
     node(node_type::var_def, begin, end) {}
 
@@ -831,6 +1150,7 @@ namespace tosuto {
       std::stringstream()
         << "var_def_node: {\n"
         << ind << "name: " << name << ",\n"
+        << ind << "type: " << (type_name.empty() ? "any" : type_name) << ",\n"
         << ind << "value: " << value->pretty(indent + 1) << ",\n"
         << std::string(indent * 2, ' ') << '}').str();
   }
@@ -883,6 +1203,22 @@ namespace tosuto {
     return ret_val ? "ret: " + ret_val->pretty(indent + 1) : "ret";
   }
 
+  import_node::import_node(std::string path, pos begin, pos end) :
+    path(std::move(path)),
+    node(node_type::import_stmt, begin, end) {}
+
+  std::string import_node::pretty(int indent) const {
+    return "import: " + path;
+  }
+
+  yield_node::yield_node(std::shared_ptr<node> value, pos begin, pos end) :
+    value(std::move(value)),
+    node(node_type::yield, begin, end) {}
+
+  std::string yield_node::pretty(int indent) const {
+    return value ? "yield: " + value->pretty(indent + 1) : "yield";
+  }
+
   next_node::next_node(pos begin, pos end) : node(node_type::next, begin,
                                                   end) {}
 
@@ -3,6 +3,7 @@
 #include <string>
 #include <sstream>
 #include <memory>
+#include <unordered_set>
 #include "tosuto.h"
 #include "lex.h"
 
@@ -30,7 +31,9 @@ namespace tosuto {
     kw_literal,
     member_call,
     array,
-    sized_array
+    sized_array,
+    yield,
+    import_stmt
   };
 
   static std::string to_string(node_type type) {
@@ -58,12 +61,14 @@ namespace tosuto {
       "member_call",
       "array",
       "sized_array",
+      "yield",
+      "import",
     };
 
     return node_type_to_string[std::to_underlying(type)];
   }
 
-  struct node {
+  struct node : public std::enable_shared_from_this<node> {
     pos begin, end;
     node_type type;
 
@@ -74,17 +79,36 @@ namespace tosuto {
     [[nodiscard]] virtual std::string pretty(int indent) const = 0;
   };
 
+  // a function body that was only pre-parsed, see parser::skip_body. keeps
+  // what the compiler's analyses need to know about a nested function
+  struct deferred_body {
+    std::shared_ptr<std::vector<token> const> toks;
+    // token range of the body, braces included
+    size_t begin, end;
+    // bare names mentioned, bare names and fields assigned, names defined
+    std::unordered_set<std::string> names, assigned, props, defined;
+    // whether it imports anything
+    bool imports = false;
+  };
+
   struct fn_def_node : public node {
     std::string name;
     std::vector<std::pair<std::string, bool>> args;
+    // `x: num`, one per arg, empty where there's no annotation
+    std::vector<std::string> arg_types;
+    // null until parse_body() if the body was pre-parsed
     std::shared_ptr<node> body;
+    std::shared_ptr<deferred_body> deferred;
     bool is_variadic;
 
     fn_def_node(
       std::string name,
       std::vector<std::pair<std::string, bool>> args,
+      std::vector<std::string> arg_types,
       std::shared_ptr<node> body, bool is_variadic, pos begin, pos end);
 
+    std::expected<void, std::string> parse_body();
+
     [[nodiscard]] std::string pretty(int indent) const override;
   };
 
@@ -214,10 +238,12 @@ namespace tosuto {
 
   struct var_def_node : public node {
     std::string name;
+    // `x: num := ..`, empty without an annotation
+    std::string type_name;
     std::shared_ptr<node> value;
 
-    var_def_node(std::string name, std::shared_ptr<node> value, pos begin,
-                 pos end);
+    var_def_node(std::string name, std::string type_name,
+                 std::shared_ptr<node> value, pos begin, pos end);
 
     [[nodiscard]] std::string pretty(int indent) const override;
   };
@@ -251,6 +277,22 @@ namespace tosuto {
     [[nodiscard]] std::string pretty(int indent) const override;
   };
 
+  struct yield_node : public node {
+    std::shared_ptr<node> value;
+
+    yield_node(std::shared_ptr<node> value, pos begin, pos end);
+
+    [[nodiscard]] std::string pretty(int indent) const override;
+  };
+
+  struct import_node : public node {
+    std::string path;
+
+    import_node(std::string path, pos begin, pos end);
+
+    [[nodiscard]] std::string pretty(int indent) const override;
+  };
+
   struct next_node : public node {
     next_node(pos begin, pos end);
 
@@ -285,10 +327,15 @@ namespace tosuto {
     [[nodiscard]] std::string pretty(int indent) const override;
   };
 
+  // calls fn on every direct child of n, in the order they're evaluated
+  void for_each_child(node* n, std::function<void(node*)> const& fn);
+
   struct parser {
-    std::vector<token> toks;
+    std::shared_ptr<std::vector<token> const> toks;
     size_t idx;
     token tok, next;
+    // only check `{}` function bodies and parse them when they're compiled
+    bool pre_parse = true;
 
     struct state {
       size_t idx;
@@ -301,8 +348,13 @@ namespace tosuto {
 
     explicit parser(std::vector<token> toks);
 
+    parser(std::shared_ptr<std::vector<token> const> toks, size_t idx);
+
     void advance();
 
+    // at the `:` of `x: type := ..`
+    [[nodiscard]] bool at_annotation() const;
+
     std::expected<token, std::string> expect(tok_type type, bool advance = true,
                                              std::source_location loc = std::source_location::current());
 
@@ -314,6 +366,15 @@ namespace tosuto {
 
     std::expected<std::shared_ptr<node>, std::string> function();
 
+    // balances brackets and checks that operators have an operand and dots
+    // a name. the rest of the body's syntax is only checked once it's
+    // parsed, on its first call, and fails that call instead of the
+    // script: keywords where they can't go like an else without an if, for
+    // and if heads missing a part, nested functions' argument lists, import
+    // without a path, with and anything but an object. a body that's never
+    // called never reports them. `ret ret` isn't one, it returns nil
+    std::expected<std::shared_ptr<deferred_body>, std::string> skip_body();
+
     std::expected<std::shared_ptr<node>, std::string> statement();
 
     std::expected<std::shared_ptr<node>, std::string> expr();
@@ -0,0 +1,144 @@
+#include "perf.h"
+
+#include <algorithm>
+#include <iomanip>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace tosuto {
+#ifdef __linux__
+  namespace {
+    constexpr std::pair<u32, u64> events[]{
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+
+    // what a PERF_FORMAT_GROUP read of the leader gives back
+    struct group_read {
+      u64 nr;
+      u64 time_enabled;
+      u64 time_running;
+      u64 values[std::size(events)];
+    };
+  }
+
+  perf_counters::perf_counters(perf_counters&& other) noexcept {
+    std::ranges::copy(other.fds, fds);
+    std::ranges::fill(other.fds, -1);
+  }
+
+  perf_counters::~perf_counters() {
+    for (auto fd: fds) {
+      if (fd >= 0) ::close(fd);
+    }
+  }
+
+  std::expected<perf_counters, std::string> perf_counters::open() {
+    perf_counters out;
+    for (size_t i = 0; i < std::size(events); i++) {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = events[i].first;
+      attr.config = events[i].second;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+      // the leader starts the lot once they're all in
+      attr.disabled = i == 0;
+
+      auto fd = int(::syscall(SYS_perf_event_open, &attr, 0, -1, out.fds[0], 0));
+      if (fd < 0) {
+        std::string why = std::strerror(errno);
+        if (errno == ENOENT || errno == EOPNOTSUPP) {
+          why = "this machine doesn't expose them";
+        } else if (errno == EACCES || errno == EPERM) {
+          why += ", see /proc/sys/kernel/perf_event_paranoid";
+        }
+        return std::unexpected{"Can't open perf counters: " + why};
+      }
+      out.fds[i] = fd;
+    }
+
+    if (::ioctl(out.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) != 0) {
+      return std::unexpected{std::string("Can't start perf counters: ") +
+                             std::strerror(errno)};
+    }
+    return out;
+  }
+
+  perf_counts perf_counters::read() const {
+    group_read it{};
+    perf_counts out;
+    if (::read(fds[0], &it, sizeof(it)) != ssize_t(sizeof(it))) {
+      out.missing = true;
+      return out;
+    }
+
+    out.cycles = it.values[0];
+    out.instructions = it.values[1];
+    out.branch_misses = it.values[2];
+    out.cache_misses = it.values[3];
+    out.time_enabled = it.time_enabled;
+    out.time_running = it.time_running;
+    return out;
+  }
+#else
+  perf_counters::perf_counters(perf_counters&& other) noexcept {}
+
+  perf_counters::~perf_counters() = default;
+
+  std::expected<perf_counters, std::string> perf_counters::open() {
+    return std::unexpected{"Perf counters need linux"};
+  }
+
+  perf_counts perf_counters::read() const {
+    perf_counts out;
+    out.missing = true;
+    return out;
+  }
+#endif
+
+  void print_perf_header(std::ostream& out) {
+    out << std::left << std::setw(10) << "phase" << std::right
+        << std::setw(16) << "cycles" << std::setw(16) << "instructions"
+        << std::setw(8) << "ipc" << std::setw(14) << "branch miss"
+        << std::setw(10) << "/ kinst" << std::setw(14) << "cache miss"
+        << std::setw(10) << "/ kinst" << '\n';
+  }
+
+  void print_perf(std::ostream& out, std::string const& phase,
+                  perf_counts const& counts) {
+    auto per_kinst = [&](u64 value) {
+      return 1000.0 * double(value) / double(std::max(counts.instructions, u64(1)));
+    };
+    if (counts.missing) {
+      out << std::left << std::setw(10) << phase << std::right
+          << std::setw(16) << "-" << "  (couldn't read the counters)\n";
+      return;
+    }
+
+    auto flags = out.flags();
+    auto precision = out.precision();
+
+    out << std::left << std::setw(10) << phase << std::right
+        << std::setw(16) << counts.cycles << std::setw(16) << counts.instructions
+        << std::fixed << std::setprecision(2)
+        << std::setw(8) << counts.ipc()
+        << std::setw(14) << counts.branch_misses
+        << std::setw(10) << per_kinst(counts.branch_misses)
+        << std::setw(14) << counts.cache_misses
+        << std::setw(10) << per_kinst(counts.cache_misses) << '\n';
+    out.flags(flags);
+    out.precision(precision);
+  }
+}
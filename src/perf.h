@@ -0,0 +1,95 @@
+#pragma once
+
+#include <ostream>
+#include "tosuto.h"
+
+namespace tosuto {
+  // hardware counters through perf_event_open, for judging changes to the
+  // hot paths by more than wall time. the counters count this thread only,
+  // in user space, from when they're opened, so a phase's counts are the
+  // difference between two reads around it. work it hands to other threads
+  // (the lexer splitting big files, bodies compiled on the task pool) isn't
+  // in there. the four run as one group so their ratios hold up when the
+  // kernel has to multiplex them with something else, a phase's counts are
+  // scaled up by how much of it the group was actually on.
+  //
+  // needs linux and a kernel that lets us count, so perf_event_paranoid at
+  // 2 or less, and a pmu, which not every vm has. elsewhere open() just
+  // says why not.
+
+  struct perf_counts {
+    u64 cycles = 0;
+    u64 instructions = 0;
+    u64 branch_misses = 0;
+    u64 cache_misses = 0;
+    // ns the group was enabled, and of that actually counting
+    u64 time_enabled = 0;
+    u64 time_running = 0;
+    // a read failed or the group never got on, the counts mean nothing
+    bool missing = false;
+
+    [[nodiscard]] double ipc() const {
+      return cycles ? double(instructions) / double(cycles) : 0;
+    }
+
+    // what read() gives is raw and cumulative, the difference of two is
+    // scaled by how much of the time between them the group was on
+    perf_counts operator-(perf_counts const& rhs) const {
+      auto sub = [](u64 lhs, u64 rhs) { return lhs > rhs ? lhs - rhs : u64(0); };
+      perf_counts out;
+      out.time_enabled = sub(time_enabled, rhs.time_enabled);
+      out.time_running = sub(time_running, rhs.time_running);
+      if (missing || rhs.missing || (out.time_running == 0 && out.time_enabled != 0)) {
+        out.missing = true;
+        return out;
+      }
+
+      auto scaled = [&](u64 lhs, u64 rhs) {
+        auto it = sub(lhs, rhs);
+        if (out.time_running == out.time_enabled) return it;
+        return u64(double(it) * double(out.time_enabled) / double(out.time_running));
+      };
+      out.cycles = scaled(cycles, rhs.cycles);
+      out.instructions = scaled(instructions, rhs.instructions);
+      out.branch_misses = scaled(branch_misses, rhs.branch_misses);
+      out.cache_misses = scaled(cache_misses, rhs.cache_misses);
+      return out;
+    }
+
+    // for adding up differences
+    perf_counts& operator+=(perf_counts const& rhs) {
+      cycles += rhs.cycles;
+      instructions += rhs.instructions;
+      branch_misses += rhs.branch_misses;
+      cache_misses += rhs.cache_misses;
+      time_enabled += rhs.time_enabled;
+      time_running += rhs.time_running;
+      missing = missing || rhs.missing;
+      return *this;
+    }
+  };
+
+  class perf_counters {
+    // the group leader comes first
+    int fds[4]{-1, -1, -1, -1};
+
+    perf_counters() = default;
+
+   public:
+    perf_counters(perf_counters&& other) noexcept;
+    perf_counters& operator=(perf_counters&&) = delete;
+    ~perf_counters();
+
+    static std::expected<perf_counters, std::string> open();
+
+    // the raw counts so far, flagged missing if the read fails
+    [[nodiscard]] perf_counts read() const;
+  };
+
+  // a header for print_perf's lines
+  void print_perf_header(std::ostream& out);
+
+  // one line of the counts of a phase, with the rates worked out
+  void print_perf(std::ostream& out, std::string const& phase,
+                  perf_counts const& counts);
+}
@@ -1,4 +1,8 @@
+#include <bit>
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
 #include "tosuto.h"
 
 namespace tosuto {
@@ -13,37 +17,74 @@ namespace tosuto {
     return buf;
   }
 
-  std::vector<std::string>* backing_array;
-
-  interned_string::interned_string(const std::string& str) {
-    static std::unordered_map<std::string, size_t> my_map;
-    static std::vector<std::string> my_backing_array;
-    static int run_once = []{backing_array = &my_backing_array; return 1;}();
-    auto it = my_map.find(str);
-    if (it != my_map.end()) {
-      index = it->second;
-    } else {
-      my_backing_array.emplace_back(str);
-      index = my_backing_array.size() - 1;
-      my_map.emplace(str, index);
+  namespace {
+    // shared by every thread. strings never move once interned, so the
+    // references handed out stay good while other threads keep interning.
+    // block i holds block_size << i strings, so the table of blocks never
+    // moves either and can't fill up before size_t runs out
+    struct interner {
+      static constexpr size_t block_bits = 12;
+      static constexpr size_t block_size = size_t(1) << block_bits;
+      static constexpr size_t max_blocks =
+        std::numeric_limits<size_t>::digits - block_bits;
+
+      std::shared_mutex mutex;
+      std::unordered_map<std::string_view, size_t> indices;
+      std::unique_ptr<std::string[]> blocks[max_blocks];
+      size_t count = 0;
+
+      size_t intern(std::string const& str) {
+        {
+          std::shared_lock lock{mutex};
+          auto it = indices.find(str);
+          if (it != indices.end()) return it->second;
+        }
+
+        std::unique_lock lock{mutex};
+        auto it = indices.find(str);
+        if (it != indices.end()) return it->second;
+
+        auto [idx, offset] = slot_of(count);
+        auto& block = blocks[idx];
+        if (!block) block = std::make_unique<std::string[]>(block_size << idx);
+        auto& slot = block[offset];
+        slot = str;
+        indices.emplace(slot, count);
+        return count++;
+      }
+
+      std::string const& at(size_t index) const {
+        auto [idx, offset] = slot_of(index);
+        return blocks[idx][offset];
+      }
+
+      // block and offset of index
+      static std::pair<size_t, size_t> slot_of(size_t index) {
+        auto biased = index + block_size;
+        size_t idx = std::bit_width(biased) - 1 - block_bits;
+        return {idx, biased - (block_size << idx)};
+      }
+    };
+
+    interner& strings() {
+      static interner it;
+      return it;
     }
   }
 
+  interned_string::interned_string(const std::string& str)
+    : index(strings().intern(str)) {}
+
   bool interned_string::operator==(const interned_string& other) const {
     return index == other.index;
   }
 
   interned_string interned_string::operator+(const interned_string& other) const {
-    return interned_string{
-      backing_array->at(index) + backing_array->at(other.index)};
+    return interned_string{strings().at(index) + strings().at(other.index)};
   }
 
   interned_string::operator std::string const&() const {
-    return backing_array->at(index);
-  }
-
-  std::vector<std::string> const& get_interned_string_backing_array() {
-    return *backing_array;
+    return strings().at(index);
   }
 
   pos pos::synthesized{0, 0, 0};
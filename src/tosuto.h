@@ -32,13 +32,14 @@
 #define ami_dyn_cast_fast(type, exp) ami_dyn_cast(type, exp)
 #endif
 
+// one per thread, so vms can run side by side
 template<typename V>
 struct temp_storage {
-  static V held;
+  static thread_local V held;
 };
 
 template<typename V>
-V temp_storage<V>::held;
+thread_local V temp_storage<V>::held;
 
 #include <stack>
 #include <queue>
@@ -115,6 +116,7 @@ namespace tosuto {
   using u8 = uint8_t;
   using u16 = uint16_t;
   using u32 = uint32_t;
+  using u64 = uint64_t;
 
   template<typename T>
   constexpr T max_of = std::numeric_limits<T>::max();
@@ -180,8 +182,6 @@ namespace tosuto {
     inline void operator*() {
     }
   };
-
-  std::vector<std::string> const& get_interned_string_backing_array();
 }
 
 template<>
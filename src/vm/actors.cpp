@@ -0,0 +1,190 @@
+#include "actors.h"
+
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include "tasks.h"
+
+namespace tosuto::vm {
+  namespace {
+    // holds isolates weakly, an actor keeps itself alive through its vm's
+    // self until it returns and anything else lives as long as its vm
+    struct registry {
+      std::shared_mutex mutex;
+      std::unordered_map<u64, std::weak_ptr<isolate>> isolates;
+      u64 next_handle = 0;
+    };
+
+    // never destroyed, jobs still queued on the pool at exit drop isolates
+    registry& isolates() {
+      static auto* it = new registry;
+      return *it;
+    }
+
+    void add(std::shared_ptr<isolate> const& it) {
+      auto& reg = isolates();
+      std::unique_lock lock{reg.mutex};
+      it->handle = reg.next_handle++;
+      reg.isolates.emplace(it->handle, it);
+    }
+
+    std::shared_ptr<isolate> find(value const& handle) {
+      if (!handle.is<value::num>()) return nullptr;
+
+      auto& reg = isolates();
+      std::shared_lock lock{reg.mutex};
+      auto found = reg.isolates.find(u64(handle.get<value::num>()));
+      return found == reg.isolates.end() ? nullptr : found->second.lock();
+    }
+
+    void run_actor(std::shared_ptr<isolate> const& it);
+
+    // queues it unless it's queued or running already, which then sees
+    // the message itself
+    void wake(std::shared_ptr<isolate> const& it) {
+      if (!it->runner || it->scheduled.exchange(true)) return;
+      post([it] { run_actor(it); });
+    }
+
+    // runs it until it waits on an empty mailbox or returns
+    void run_actor(std::shared_ptr<isolate> const& it) {
+      auto& runner = *it->runner;
+      for (;;) {
+        std::expected<void, std::string> res;
+        if (!it->started) {
+          it->started = true;
+          auto ret = runner.run_fn(it->fn, std::cout);
+          if (!ret.has_value()) res = std::unexpected{std::move(ret.error())};
+        } else if (auto msg = it->box.pop()) {
+          res = runner.resume_run(std::move(*msg), std::cout);
+        } else {
+          it->scheduled.store(false);
+          // a send in between saw us scheduled and left its message to us.
+          // the box is only ever touched by whoever holds scheduled, so this
+          // counts instead of looking, and carries on only if no other job
+          // got queued for it meanwhile
+          if (it->box.pushed.load() == it->box.popped.load() ||
+              it->scheduled.exchange(true)) {
+            return;
+          }
+          continue;
+        }
+
+        if (!res.has_value()) {
+          std::cerr << "In actor " << it->handle << ": " << res.error() << '\n';
+        }
+        if (!res.has_value() || !runner.paused) {
+          // stays scheduled, so nothing queues it again
+          {
+            auto& reg = isolates();
+            std::unique_lock lock{reg.mutex};
+            reg.isolates.erase(it->handle);
+          }
+          runner.globals.clear();
+          runner.self = nullptr;
+          gc_release(runner);
+          return;
+        }
+      }
+    }
+  }
+
+  mailbox::mailbox() {
+    tail = new node{};
+    head = tail;
+  }
+
+  mailbox::~mailbox() {
+    while (pop());
+    delete tail;
+  }
+
+  void mailbox::push(value msg) {
+    auto* it = new node{nullptr, std::move(msg)};
+    auto* prev = head.exchange(it, std::memory_order_acq_rel);
+    prev->next.store(it);
+
+    pushed.fetch_add(1, std::memory_order_release);
+    pushed.notify_all();
+  }
+
+  std::optional<value> mailbox::pop() {
+    auto* next = tail->next.load(std::memory_order_acquire);
+    if (!next) return std::nullopt;
+
+    // next becomes the stub, its message is ours now
+    auto msg = std::move(next->msg);
+    delete tail;
+    tail = next;
+    popped.fetch_add(1, std::memory_order_release);
+    return msg;
+  }
+
+  isolate::~isolate() {
+    auto& reg = isolates();
+    std::unique_lock lock{reg.mutex};
+    auto found = reg.isolates.find(handle);
+    if (found != reg.isolates.end() && found->second.expired()) {
+      reg.isolates.erase(found);
+    }
+  }
+
+  std::expected<value, std::string> actor(std::span<value> args) {
+    if (!args[0].is<value::function>() ||
+        args[0].get<value::function>().desc->arity != 0) {
+      return std::unexpected{"actor() needs a function without arguments!"};
+    }
+
+    auto it = std::make_shared<isolate>();
+    copier copy;
+    it->fn = copy.copy(args[0]).get<value::function>();
+    it->runner = std::make_unique<vm>(it->fn);
+    copy_globals(copy, it->fn, it->runner->globals);
+    it->runner->imported = vm::current->imported;
+    it->runner->self = it;
+
+    add(it);
+    wake(it);
+    return value{double(it->handle)};
+  }
+
+  std::expected<value, std::string> send(std::span<value> args) {
+    auto it = find(args[0]);
+    if (!it) return std::unexpected{"Can't send to " + args[0].to_string()};
+
+    it->box.push(copier{}.copy(args[1]));
+    wake(it);
+    return value{value::nil{}};
+  }
+
+  std::expected<value, std::string> receive(std::span<value> args) {
+    auto& cur = *vm::current;
+    if (!cur.self) {
+      return std::unexpected{"Nothing can send here, receive() needs self() first!"};
+    }
+
+    auto& box = cur.self->box;
+    if (auto msg = box.pop()) return std::move(*msg);
+
+    // actors give their worker back, the next send queues them again
+    if (cur.self->runner.get() == &cur) {
+      cur.pause = true;
+      return value{value::nil{}};
+    }
+
+    for (;;) {
+      auto seen = box.pushed.load(std::memory_order_acquire);
+      if (auto msg = box.pop()) return std::move(*msg);
+      if (!help()) box.pushed.wait(seen, std::memory_order_acquire);
+    }
+  }
+
+  std::expected<value, std::string> self(std::span<value> args) {
+    auto& cur = *vm::current;
+    if (!cur.self) {
+      cur.self = std::make_shared<isolate>();
+      add(cur.self);
+    }
+    return value{double(cur.self->handle)};
+  }
+}
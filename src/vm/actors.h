@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include "vm.h"
+
+namespace tosuto::vm {
+  // actors, isolated vms that only talk through messages. `a := actor(f)`
+  // starts f, a function without arguments, on a vm of its own against
+  // copies of it and of the spawner's globals it can reach, and returns a
+  // handle like spawn's. `send(a, msg)` puts a copy of msg in a's mailbox
+  // and `receive()` takes the oldest message out of the caller's own,
+  // `self()` is the caller's handle to pass around for replies.
+  //
+  // actors run as jobs on the task pool, one job at a time per actor. an
+  // actor receiving from an empty mailbox pauses its vm and gives the
+  // worker back, the next send queues it again, so any number of actors
+  // share the pool's threads. anything else that receives, the main vm or
+  // a task, blocks and helps the pool until a message shows up. an actor
+  // is gone once f returns, what it returns is dropped.
+
+  // vyukov's mpsc queue: any thread pushes with one exchange, only the
+  // owner pops. pop can miss a push that's halfway done, which then shows
+  // up on the owner's next look
+  struct mailbox {
+    struct node {
+      std::atomic<node*> next = nullptr;
+      value msg;
+    };
+
+    std::atomic<node*> head;
+    node* tail;
+    // bumped on every push, for receivers that wait on it
+    std::atomic<u32> pushed = 0;
+    // bumped on every pop, pushed running ahead of it means there's more
+    std::atomic<u32> popped = 0;
+
+    mailbox();
+
+    ~mailbox();
+
+    void push(value msg);
+
+    std::optional<value> pop();
+  };
+
+  struct isolate {
+    u64 handle;
+    mailbox box;
+    // null for vms that only receive, like the main one
+    std::unique_ptr<vm> runner;
+    value::function fn;
+    // whether a job for this actor is queued or running
+    std::atomic<bool> scheduled = false;
+    bool started = false;
+
+    ~isolate();
+  };
+
+  std::expected<value, std::string> actor(std::span<value> args);
+
+  std::expected<value, std::string> send(std::span<value> args);
+
+  std::expected<value, std::string> receive(std::span<value> args);
+
+  std::expected<value, std::string> self(std::span<value> args);
+}
@@ -0,0 +1,272 @@
+#include "cache.h"
+
+#include <filesystem>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace tosuto::vm {
+  // layout, all little endian:
+  //   header   "tsc\0", u32 version, u16 opcode count, u64 source hash
+  //   strings  u32 count, then u32 length + bytes each
+  //   script   function
+  //
+  // function: u32 name, u8 arity, u8 has varargs, u8 varargs start,
+  //           u16 upval count, u32 code size + code,
+  //           u32 literal count + literals
+  // literal:  u8 tag, then f64 for num, u8 for bool, u32 string index for
+  //           str, a nested function for function, nothing for nil
+  //
+  // strings are interned once on load, which is the only fix-up needed.
+
+  namespace {
+    constexpr char magic[4] = {'t', 's', 'c', '\0'};
+
+    enum class lit_tag : u8 {
+      num,
+      boolean,
+      nil,
+      str,
+      function
+    };
+  }
+
+  u32 writer::intern(std::string const& str) {
+    auto [it, inserted] = string_idx.emplace(str, u32(strings.size()));
+    if (inserted) strings.push_back(str);
+    return it->second;
+  }
+
+  std::expected<void, std::string> writer::function(value::function const& fn) {
+    if (!fn.desc->is_compiled()) {
+      auto copy = fn;
+      ami_discard(compile_lazy(copy));
+    }
+
+    auto const& desc = *fn.desc;
+    put(intern(desc.chunk.name));
+    put(desc.arity);
+    put(u8(desc.varargs_start.has_value()));
+    put(desc.varargs_start.value_or(0));
+    put(desc.num_upvals);
+
+    put(u32(desc.chunk.data.size()));
+    out.insert(out.end(), desc.chunk.data.begin(), desc.chunk.data.end());
+
+    put(u32(desc.chunk.literals.size()));
+    for (auto const& lit: desc.chunk.literals) {
+      switch (lit.val.index()) {
+        case index_of<value::num>: put(lit_tag::num);
+          put(lit.get<value::num>());
+          break;
+        case index_of<bool>: put(lit_tag::boolean);
+          put(u8(lit.get<bool>()));
+          break;
+        case index_of<value::nil>: put(lit_tag::nil);
+          break;
+        case index_of<value::str>: put(lit_tag::str);
+          put(intern(lit.get<value::str>()));
+          break;
+        case index_of<value::function>: put(lit_tag::function);
+          ami_discard(function(lit.get<value::function>()));
+          break;
+        default:
+          return std::unexpected{"Can't write literal " + lit.to_string()};
+      }
+    }
+
+    return {};
+  }
+
+  std::vector<u8>
+  writer::file(char const (&magic)[4], u32 version, u64 key) const {
+    writer file;
+    file.out.insert(file.out.end(), std::begin(magic), std::end(magic));
+    file.put(version);
+    file.put(op_count);
+    file.put(key);
+    file.put(u32(strings.size()));
+    for (auto const& str: strings) {
+      file.put(u32(str.size()));
+      file.out.insert(file.out.end(), str.begin(), str.end());
+    }
+    file.out.insert(file.out.end(), out.begin(), out.end());
+
+    return std::move(file.out);
+  }
+
+  std::expected<std::span<u8 const>, std::string> reader::bytes(size_t size) {
+    if (in.size() - at < size) return std::unexpected{"File is truncated!"};
+    auto it = in.subspan(at, size);
+    at += size;
+    return it;
+  }
+
+  std::expected<void, std::string>
+  reader::header(char const (&magic)[4], u32 version, u64 key,
+                 std::string const& what) {
+    auto head = ami_unwrap(bytes(sizeof(magic)));
+    if (std::memcmp(head.data(), magic, sizeof(magic)) != 0) {
+      return std::unexpected{what + " has a bad header!"};
+    }
+
+    auto file_version = ami_unwrap(get<u32>());
+    auto ops = ami_unwrap(get<u16>());
+    if (file_version != version || ops != op_count) {
+      return std::unexpected{what + " is from another version!"};
+    }
+
+    auto file_key = ami_unwrap(get<u64>());
+    if (file_key != key) return std::unexpected{what + " is stale!"};
+
+    auto string_count = ami_unwrap(get<u32>());
+    strings.reserve(string_count);
+    for (u32 i = 0; i < string_count; i++) {
+      auto size = ami_unwrap(get<u32>());
+      auto str = ami_unwrap(bytes(size));
+      strings.emplace_back(std::string(str.begin(), str.end()));
+    }
+
+    return {};
+  }
+
+  std::expected<u32, std::string> reader::string() {
+    auto idx = ami_unwrap(get<u32>());
+    if (idx >= strings.size()) return std::unexpected{"Bad string index!"};
+    return idx;
+  }
+
+  std::expected<value::function, std::string> reader::function() {
+    value::function fn;
+    auto& desc = *fn.desc;
+
+    auto name = ami_unwrap(string());
+    desc.chunk.name = strings[name];
+    desc.arity = ami_unwrap(get<u8>());
+    auto has_varargs = ami_unwrap(get<u8>());
+    auto varargs_start = ami_unwrap(get<u8>());
+    if (has_varargs) desc.varargs_start = varargs_start;
+    desc.num_upvals = ami_unwrap(get<u16>());
+
+    auto code_size = ami_unwrap(get<u32>());
+    auto code = ami_unwrap(bytes(code_size));
+    desc.chunk.data.assign(code.begin(), code.end());
+
+    auto lit_count = ami_unwrap(get<u32>());
+    desc.chunk.literals.reserve(lit_count);
+    for (u32 i = 0; i < lit_count; i++) {
+      auto tag = ami_unwrap(get<lit_tag>());
+      switch (tag) {
+        case lit_tag::num: {
+          auto it = ami_unwrap(get<value::num>());
+          desc.chunk.literals.push_back(value{it});
+          break;
+        }
+        case lit_tag::boolean: {
+          auto it = ami_unwrap(get<u8>());
+          desc.chunk.literals.push_back(value{bool(it)});
+          break;
+        }
+        case lit_tag::nil: desc.chunk.literals.push_back(value{value::nil{}});
+          break;
+        case lit_tag::str: {
+          auto it = ami_unwrap(string());
+          desc.chunk.literals.push_back(value{strings[it]});
+          break;
+        }
+        case lit_tag::function: {
+          auto it = ami_unwrap(function());
+          desc.chunk.literals.push_back(value{it});
+          break;
+        }
+        default: return std::unexpected{"Bad literal tag!"};
+      }
+    }
+
+    return fn;
+  }
+
+  mapped_file::~mapped_file() {
+#ifndef _WIN32
+    if (!data.empty()) munmap((void*) data.data(), data.size());
+#endif
+  }
+
+  bool mapped_file::open(std::string const& path) {
+#ifdef _WIN32
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    buf.assign(std::istreambuf_iterator<char>(in), {});
+    data = buf;
+    return true;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return false;
+    }
+
+    void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return false;
+
+    data = {static_cast<u8 const*>(mem), size_t(st.st_size)};
+    return true;
+#endif
+  }
+
+  std::expected<void, std::string>
+  write_file(std::string const& path, std::span<u8 const> data) {
+    auto tmp = path + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+      out.write(reinterpret_cast<char const*>(data.data()),
+                std::streamsize(data.size()));
+      if (!out) return std::unexpected{"Couldn't write " + tmp};
+    }
+
+    std::error_code err;
+    std::filesystem::rename(tmp, path, err);
+    if (err) return std::unexpected{"Couldn't write " + path + ": " + err.message()};
+
+    return {};
+  }
+
+  u64 fnv1a(std::string_view data) {
+    u64 hash = 0xcbf29ce484222325;
+    for (char ch: data) {
+      hash ^= u8(ch);
+      hash *= 0x100000001b3;
+    }
+
+    return hash;
+  }
+
+  std::string cache_path(std::string const& source_path) {
+    return std::filesystem::path(source_path).replace_extension(".tsc").string();
+  }
+
+  std::expected<void, std::string>
+  write_cache(std::string const& path, u64 hash, value::function const& fn) {
+    writer body;
+    ami_discard(body.function(fn));
+    return write_file(path, body.file(magic, cache_version, hash));
+  }
+
+  std::expected<value::function, std::string>
+  read_cache(std::string const& path, u64 hash) {
+    mapped_file file;
+    if (!file.open(path)) return std::unexpected{"No cache at " + path};
+
+    reader in{file.data};
+    ami_discard(in.header(magic, cache_version, hash, path));
+    return in.function();
+  }
+}
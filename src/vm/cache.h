@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstring>
+#include <string_view>
+#include "vm.h"
+
+namespace tosuto::vm {
+  // .tsc bytecode cache, written next to the source and keyed by a hash of
+  // its contents. bump cache_version whenever the format or the meaning of
+  // an opcode changes, adding opcodes invalidates old caches on its own.
+  constexpr u32 cache_version = 3;
+
+  u64 fnv1a(std::string_view data);
+
+  // foo.tosuto -> foo.tsc
+  std::string cache_path(std::string const& source_path);
+
+  // bodies that are still lazy get compiled on the way
+  std::expected<void, std::string>
+  write_cache(std::string const& path, u64 hash, value::function const& fn);
+
+  // fails if the file is missing, stale or from another version
+  std::expected<value::function, std::string>
+  read_cache(std::string const& path, u64 hash);
+
+  // the pieces below are shared with the snapshot format, see snapshot.cpp
+
+  struct writer {
+    std::vector<u8> out;
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, u32> string_idx;
+
+    template<typename T>
+    void put(T it) {
+      auto bytes = reinterpret_cast<u8 const*>(&it);
+      out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    u32 intern(std::string const& str);
+
+    std::expected<void, std::string> function(value::function const& fn);
+
+    // header and string table, followed by out
+    std::vector<u8> file(char const (&magic)[4], u32 version, u64 key) const;
+  };
+
+  struct reader {
+    std::span<u8 const> in;
+    size_t at = 0;
+    std::vector<value::str> strings{};
+
+    template<typename T>
+    std::expected<T, std::string> get() {
+      if (in.size() - at < sizeof(T)) {
+        return std::unexpected{"File is truncated!"};
+      }
+
+      T it;
+      std::memcpy(&it, in.data() + at, sizeof(T));
+      at += sizeof(T);
+      return it;
+    }
+
+    std::expected<std::span<u8 const>, std::string> bytes(size_t size);
+
+    // checks what writer::file wrote and loads the string table, what names
+    // the kind of file in errors
+    std::expected<void, std::string>
+    header(char const (&magic)[4], u32 version, u64 key, std::string const& what);
+
+    // index into strings
+    std::expected<u32, std::string> string();
+
+    std::expected<value::function, std::string> function();
+  };
+
+  // the whole file, mapped where we can
+  struct mapped_file {
+    std::span<u8 const> data;
+#ifdef _WIN32
+    std::vector<u8> buf;
+#endif
+
+    mapped_file() = default;
+    mapped_file(mapped_file const&) = delete;
+
+    ~mapped_file();
+
+    bool open(std::string const& path);
+  };
+
+  // writes next to path and renames, so a reader never sees half a file
+  std::expected<void, std::string>
+  write_file(std::string const& path, std::span<u8 const> data);
+}
@@ -5,7 +5,7 @@
 #include <iostream>
 
 namespace tosuto::vm {
-  std::unordered_map<node_type, std::expected<void, std::string>(compiler::*)(
+  const std::unordered_map<node_type, std::expected<void, std::string>(compiler::*)(
     tosuto::node*)> compilers{
     {node_type::bin_op,      &compiler::bin_op},
     {node_type::number,      &compiler::number},
@@ -19,6 +19,8 @@ namespace tosuto::vm {
     {node_type::fn_def,      &compiler::fn_def},
     {node_type::call,        &compiler::call},
     {node_type::ret,         &compiler::ret},
+    {node_type::yield,       &compiler::yield},
+    {node_type::import_stmt, &compiler::import},
     {node_type::object,      &compiler::object},
     {node_type::anon_fn_def, &compiler::anon_fn_def},
     {node_type::member_call, &compiler::member_call},
@@ -29,6 +31,7 @@ namespace tosuto::vm {
   };
 
 #define AMI_SIMPLE_CVT_TOKTYPE_TO_INSTR(op) case tok_type::op: cur_ch().add(op_code::op); break;
+#define AMI_NUM_CVT_TOKTYPE_TO_INSTR(op) case tok_type::op: cur_ch().add(nums ? op_code::op##_nn : op_code::op); break;
 
   std::expected<void, std::string> compiler::bin_op(tosuto::node* n) {
     auto it = ami_dyn_cast(bin_op_node*, n);
@@ -36,6 +39,19 @@ namespace tosuto::vm {
       if (it->lhs->type == node_type::bin_op) {
         auto lhs = ami_dyn_cast(bin_op_node*, it->lhs.get());
         if (lhs->op == tok_type::l_square) {
+          if (lhs->rhs->type == node_type::number) {
+            auto idx = ami_dyn_cast(number_node*, lhs->rhs.get());
+            auto key = "[" + std::to_string(size_t(idx->value)) + "]";
+            if (auto slot = resolve_scalar(lhs->lhs.get(), key)) {
+              ami_discard(compile(it->rhs.get()));
+              cur_ch().add(op_code::loc_s);
+              cur_ch().add(*slot);
+              set_type(*slot, last_type);
+
+              return {};
+            }
+          }
+
           // a[b] = c
           ami_discard(compile(lhs->lhs.get()));
           ami_discard(compile(lhs->rhs.get()));
@@ -52,6 +68,15 @@ namespace tosuto::vm {
 
       auto lhs = ami_dyn_cast(field_get_node*, it->lhs.get());
       if (lhs->target) {
+        if (auto slot = resolve_scalar(lhs->target.get(), "." + lhs->field)) {
+          ami_discard(compile(it->rhs.get()));
+          cur_ch().add(op_code::loc_s);
+          cur_ch().add(*slot);
+          set_type(*slot, last_type);
+
+          return {};
+        }
+
         ami_discard(compile(lhs->target.get()));
         ami_discard(compile(it->rhs.get()));
         cur_ch().add(op_code::prop_s);
@@ -63,9 +88,19 @@ namespace tosuto::vm {
 
       ami_discard(compile(it->rhs.get()));
       auto op = set_instr(lhs->field);
+      // closures writing an annotated local check it too
+      auto annotation = op.first == op_code::loc_s ? locals[op.second].annotation
+        : op.first == op_code::upval_s ? upval_annotation(lhs->field)
+        : global_annotation(lhs->field);
+      if (!annotation.empty()) {
+        ami_discard(check_annotation(lhs->field, annotation));
+      }
 
+      auto type = last_type;
       cur_ch().add(op.first);
       cur_ch().add(op.second);
+      if (op.first == op_code::loc_s) set_type(op.second, type);
+      last_type = type;
 
       return {};
     }
@@ -74,8 +109,11 @@ namespace tosuto::vm {
       ami_discard(compile(it->lhs.get()));
       auto else_jmp = emit_jump(op_code::jmpf);
       cur_ch().add(op_code::pop);
+      auto skipped = save_types();
       ami_discard(compile(it->rhs.get()));
       ami_discard(patch_jump(else_jmp));
+      restore_types(join_types({skipped, save_types()}));
+      last_type = static_type::any;
 
       return {};
     }
@@ -88,33 +126,55 @@ namespace tosuto::vm {
       ami_discard(patch_jump(else_jmp));
       cur_ch().add(op_code::pop);
 
+      auto skipped = save_types();
       ami_discard(compile(it->rhs.get()));
       ami_discard(patch_jump(end_jmp));
+      restore_types(join_types({skipped, save_types()}));
+      last_type = static_type::any;
 
       return {};
     }
 
+    if (it->op == tok_type::l_square && it->rhs->type == node_type::number) {
+      auto idx = ami_dyn_cast(number_node*, it->rhs.get());
+      auto key = "[" + std::to_string(size_t(idx->value)) + "]";
+      if (auto slot = resolve_scalar(it->lhs.get(), key)) {
+        cur_ch().add(op_code::loc_g);
+        cur_ch().add(*slot);
+        last_type = locals[*slot].type;
+
+        return {};
+      }
+    }
+
     ami_discard(compile(it->lhs.get()));
+    auto lhs_type = last_type;
     ami_discard(compile(it->rhs.get()));
+    bool nums = lhs_type == static_type::num && last_type == static_type::num;
+    bool strs = lhs_type == static_type::str && last_type == static_type::str;
+    last_type = static_type::any;
     switch (it->op) {
-      AMI_SIMPLE_CVT_TOKTYPE_TO_INSTR(add)
-      AMI_SIMPLE_CVT_TOKTYPE_TO_INSTR(sub)
-      AMI_SIMPLE_CVT_TOKTYPE_TO_INSTR(mul)
-      AMI_SIMPLE_CVT_TOKTYPE_TO_INSTR(div)
-      AMI_SIMPLE_CVT_TOKTYPE_TO_INSTR(mod)
+      case tok_type::add: cur_ch().add(nums ? op_code::add_nn
+                                            : strs ? op_code::add_ss
+                                                   : op_code::add);
+        break;
+      AMI_NUM_CVT_TOKTYPE_TO_INSTR(sub)
+      AMI_NUM_CVT_TOKTYPE_TO_INSTR(mul)
+      AMI_NUM_CVT_TOKTYPE_TO_INSTR(div)
+      AMI_NUM_CVT_TOKTYPE_TO_INSTR(mod)
       AMI_SIMPLE_CVT_TOKTYPE_TO_INSTR(eq)
       AMI_SIMPLE_CVT_TOKTYPE_TO_INSTR(key_with)
       case tok_type::neq: cur_ch().add(op_code::eq);
         cur_ch().add(op_code::inv);
         break;
-      case tok_type::greater_than: cur_ch().add(op_code::gt);
+      case tok_type::greater_than: cur_ch().add(nums ? op_code::gt_nn : op_code::gt);
         break;
-      case tok_type::less_than: cur_ch().add(op_code::lt);
+      case tok_type::less_than: cur_ch().add(nums ? op_code::lt_nn : op_code::lt);
         break;
-      case tok_type::greater_than_equal: cur_ch().add(op_code::lt);
+      case tok_type::greater_than_equal: cur_ch().add(nums ? op_code::lt_nn : op_code::lt);
         cur_ch().add(op_code::inv);
         break;
-      case tok_type::less_than_equal: cur_ch().add(op_code::gt);
+      case tok_type::less_than_equal: cur_ch().add(nums ? op_code::gt_nn : op_code::gt);
         cur_ch().add(op_code::inv);
         break;
       case tok_type::l_square: cur_ch().add(op_code::idx_g);
@@ -123,11 +183,54 @@ namespace tosuto::vm {
         return std::unexpected{"Unknown infix operator at " + n->pretty(0)};
     }
 
+    switch (it->op) {
+      case tok_type::add: if (strs) last_type = static_type::str;
+        [[fallthrough]];
+      case tok_type::sub:
+      case tok_type::mul:
+      case tok_type::div:
+      case tok_type::mod: if (nums) last_type = static_type::num;
+        break;
+      default:;
+    }
+
     return {};
   }
 
   std::expected<void, std::string> compiler::compile(node* n) {
-    return (this->*compilers[n->type])(n);
+    if (hoisted.empty()) return dispatch(n);
+
+    auto hoist = hoisted.find(n);
+    if (hoist == hoisted.end()) return dispatch(n);
+
+    // loop invariant, only evaluated until its slot is filled
+    u16 slot = hoist->second;
+    cur_ch().add(op_code::loc_g);
+    cur_ch().add(slot);
+    auto filled = emit_jump(op_code::jmpt);
+    cur_ch().add(op_code::pop);
+    ami_discard(dispatch(n));
+    cur_ch().add(op_code::loc_s);
+    cur_ch().add(slot);
+    ami_discard(patch_jump(filled));
+
+    return {};
+  }
+
+  std::expected<void, std::string> compiler::dispatch(node* n) {
+    ami_discard((this->*compilers.at(n->type))(n));
+
+    // only these leave a value whose type they know about
+    switch (n->type) {
+      case node_type::number:
+      case node_type::string:
+      case node_type::field_get:
+      case node_type::bin_op:
+      case node_type::un_op: break;
+      default: last_type = static_type::any;
+    }
+
+    return {};
   }
 
   std::expected<void, std::string> compiler::sized_array(node* n) {
@@ -151,20 +254,43 @@ namespace tosuto::vm {
 
     begin_block();
 
+    effects loop;
+    collect_effects(it->body.get(), loop);
+
     ami_discard(compile(iter->start.get()));
+    auto counter_type = last_type;
     ami_discard(add_local(it->id));
     auto slot = *resolve_local(it->id); // no way this fails, right?
+    set_type(slot, counter_type);
 
     ami_discard(compile(iter->finish.get()));
-    auto end_id = "@" + std::to_string(rand());
+    auto end_type = last_type;
+    auto end_id = "@" + std::to_string(next_suffix++);
     ami_discard(add_local(end_id));
     auto end_slot = *resolve_local(end_id);
+    set_type(end_slot, end_type);
+
+    // whatever the body assigns may hold anything when an iteration starts
+    forget_types(loop.assigned);
+    bool nums = locals[slot].type == static_type::num &&
+                end_type == static_type::num;
+    loop.assigned.emplace(it->id);
+
+    auto invariants = ami_unwrap(hoist_invariants(it, loop));
 
     begin_block();
 
     std::vector<size_t> next_jmps, break_jmps;
     auto body = ami_dyn_cast(block_node*, it->body.get());
 
+    // the check's at the bottom, an empty range mustn't get that far
+    cur_ch().add(op_code::loc_g);
+    cur_ch().add(slot);
+    cur_ch().add(op_code::loc_g);
+    cur_ch().add(end_slot);
+    cur_ch().add(nums ? op_code::lt_nn : op_code::lt);
+    break_jmps.push_back(emit_jump(op_code::jmpf_pop));
+
     size_t block_start = cur_ch().data.size();
 
     for (auto const& stmt: body->exprs) {
@@ -194,12 +320,12 @@ namespace tosuto::vm {
     cur_ch().add(op_code::loc_g);
     cur_ch().add(slot);
     cur_ch().add(op_code::ld_1);
-    cur_ch().add(op_code::add);
+    cur_ch().add(nums ? op_code::add_nn : op_code::add);
     cur_ch().add(op_code::loc_s);
     cur_ch().add(slot);
     cur_ch().add(op_code::loc_g);
     cur_ch().add(end_slot);
-    cur_ch().add(op_code::lt);
+    cur_ch().add(nums ? op_code::lt_nn : op_code::lt);
     size_t loop_jmp = emit_jump(op_code::jmpb_pop);
     u16 jmp = loop_jmp - block_start + 2;
     cur_ch().data[loop_jmp] = u8(jmp & 0xff);
@@ -209,6 +335,12 @@ namespace tosuto::vm {
       ami_discard(patch_jump(break_jmp));
     }
 
+    for (auto* invariant: invariants) {
+      hoisted.erase(invariant);
+    }
+
+    forget_types(loop.assigned);
+
     end_block();
 
     return {};
@@ -278,7 +410,8 @@ namespace tosuto::vm {
 
     auto definition =
       std::make_shared<var_def_node>(
-        fn_def_casted->name, first_arg, pos::synthesized, pos::synthesized);
+        fn_def_casted->name, "", first_arg, pos::synthesized,
+        pos::synthesized);
 
     ami_discard(compile(definition.get()));
 
@@ -293,6 +426,10 @@ namespace tosuto::vm {
         ami_discard(decorate_fn(it, it->target));
         break;
       }
+      case node_type::for_loop: {
+        ami_discard(parallel_for(it, static_cast<for_node*>(it->target.get())));
+        break;
+      }
       default:; return std::unexpected{"Can't decorate " + it->target->pretty(0)};
     }
 
@@ -319,7 +456,7 @@ namespace tosuto::vm {
   std::expected<void, std::string> compiler::object(node* n) {
     auto it = ami_dyn_cast(object_node*, n);
     cur_ch().add(op_code::new_obj);
-    auto r = rand();
+    auto r = next_suffix++;
     for (auto const& [k, v]: it->fields) {
       if (v->type == node_type::anon_fn_def) {
         auto fn_def = ami_dyn_cast(fn_def_node*, v.get());
@@ -335,6 +472,38 @@ namespace tosuto::vm {
     return {};
   }
 
+  std::expected<void, std::string> compiler::yield(node* n) {
+    if (fn_type == value::function::type::script) {
+      return std::unexpected{"Can't yield from top level!"};
+    }
+
+    auto it = ami_dyn_cast(yield_node*, n);
+    if (it->value) {
+      ami_discard(compile(it->value.get()));
+    } else {
+      cur_ch().add(op_code::key_nil);
+    }
+    cur_ch().add(op_code::yield);
+
+    return {};
+  }
+
+  std::expected<void, std::string> compiler::import(node* n) {
+    auto it = ami_dyn_cast(import_node*, n);
+
+    // @import(path) hands back the module's script, or something that does
+    // nothing if this vm already ran it, which then gets called
+    auto at = pos::synthesized;
+    auto load = std::make_shared<call_node>(
+      std::make_shared<field_get_node>(nullptr, "@import", at, at),
+      std::vector<std::shared_ptr<node>>{
+        std::make_shared<string_node>(it->path, at, at)},
+      at, at);
+    auto run = std::make_shared<call_node>(
+      load, std::vector<std::shared_ptr<node>>{}, it->begin, it->end);
+    return call(run.get());
+  }
+
   std::expected<void, std::string> compiler::ret(node* n) {
     if (fn_type == value::function::type::script) {
       return std::unexpected{"Can't return from top level!"};
@@ -359,7 +528,9 @@ namespace tosuto::vm {
 
     compiler comp{type};
     comp.enclosing = this;
-    comp.begin_block();
+    comp.lazy = lazy;
+    comp.program_effects = program_effects;
+    comp.global_annotations = global_annotations;
 
     auto& args = it->args;
     if (args.size() > max_of<u8>)
@@ -371,14 +542,18 @@ namespace tosuto::vm {
     }
 
     comp.fun.desc->chunk.name = it->name.empty() ? value::str{"anonymous"} : value::str{it->name};
-    for (auto const& arg: args) {
-      ami_discard(comp.add_local(arg.first));
-    }
-
-    ami_discard(comp.exp_or_block_no_pop(it->body.get()));
 
-    comp.cur_ch().add(op_code::ret);
+    if (lazy) {
+      comp.capture_free_names(it);
+      comp.fun.desc->lazy = std::make_shared<lazy_fn>(
+        it->shared_from_this(), type, comp.upval_names,
+        comp.upval_annotations, program_effects, global_annotations);
+      comp.fun.desc->compiled = false;
+    } else {
+      ami_discard(comp.function_body(it));
+    }
 
+    comp.fun.desc->num_upvals = u16(comp.upvals.size());
     u16 lit = cur_ch().add_lit_get(value{comp.fun});
     if (comp.upvals.empty()) {
       cur_ch().add(op_code::lit_16);
@@ -397,6 +572,40 @@ namespace tosuto::vm {
     return {};
   }
 
+  std::expected<void, std::string> compiler::function_body(fn_def_node* n) {
+    ami_discard(n->parse_body());
+    begin_block();
+
+    auto& args = n->args;
+    for (auto const& arg: args) {
+      ami_discard(add_local(arg.first));
+    }
+
+    find_scalar_locals(n->body.get(), n);
+    find_closure_writes(n->body.get());
+
+    // annotated args are checked once on entry
+    for (size_t i = 0; i < n->arg_types.size(); i++) {
+      if (n->arg_types[i].empty()) continue;
+
+      auto slot = *resolve_local(args[i].first);
+      cur_ch().add(op_code::loc_g);
+      cur_ch().add(slot);
+      // what the last arg's check proved says nothing about this one
+      last_type = locals[slot].type;
+      ami_discard(check_annotation(args[i].first, n->arg_types[i]));
+      cur_ch().add(op_code::pop);
+      set_type(slot, last_type);
+      locals[slot].annotation = n->arg_types[i];
+    }
+
+    ami_discard(exp_or_block_no_pop(n->body.get()));
+
+    cur_ch().add(op_code::ret);
+
+    return {};
+  }
+
   std::expected<void, std::string> compiler::fn_def(node* n) {
     auto it = ami_dyn_cast(fn_def_node*, n);
 
@@ -474,20 +683,31 @@ namespace tosuto::vm {
     auto it = ami_dyn_cast(if_node*, n);
 
     std::vector<size_t> else_jumps;
+    std::vector<std::vector<static_type>> paths;
     for (auto& i: it->cases) {
       ami_discard(compile(i.first.get()));
       size_t then_jump = emit_jump(op_code::jmpf_pop);
 
+      auto skipped = save_types();
       ami_discard(exp_or_block_no_pop(i.second.get()));
       else_jumps.push_back(emit_jump(op_code::jmp));
+      paths.push_back(save_types());
+      restore_types(skipped);
 
       ami_discard(patch_jump(then_jump));
     }
 
     if (it->else_case) {
       ami_discard(exp_or_block_no_pop(it->else_case.get()));
+    } else {
+      // every path leaves a value, this one doesn't have any
+      cur_ch().add(op_code::key_nil);
     }
 
+    paths.push_back(save_types());
+    restore_types(join_types(paths));
+    last_type = static_type::any;
+
     for (auto else_jump: else_jumps) {
       ami_discard(patch_jump(else_jump));
     }
@@ -529,10 +749,22 @@ namespace tosuto::vm {
   std::expected<void, std::string> compiler::var_def(node* n) {
     auto it = ami_dyn_cast(var_def_node*, n);
 
+    if (depth > 0 && it->type_name.empty() && scalar_locals.contains(it->name)) {
+      return scalar_def(it);
+    }
+
     ami_discard(compile(it->value.get()));
+    // redefining an annotated global keeps to its annotation
+    auto type_name = it->type_name;
+    if (type_name.empty() && depth == 0) type_name = global_annotation(it->name);
+    if (!type_name.empty()) {
+      ami_discard(check_annotation(it->name, type_name));
+    }
 
     if (depth > 0) {
       ami_discard(add_local(it->name));
+      set_type(locals.size() - 1, last_type);
+      locals.back().annotation = it->type_name;
     } else {
       cur_ch().add(op_code::glob_d);
       auto lit = cur_ch().add_lit_get(value{value::str{it->name}});
@@ -555,10 +787,18 @@ namespace tosuto::vm {
   std::expected<void, std::string> compiler::field_get(node* n) {
     auto it = ami_dyn_cast(field_get_node*, n);
     if (it->target) {
+      if (auto slot = resolve_scalar(it->target.get(), "." + it->field)) {
+        cur_ch().add(op_code::loc_g);
+        cur_ch().add(*slot);
+        last_type = locals[*slot].type;
+        return {};
+      }
+
       ami_discard(compile(it->target.get()));
       cur_ch().add(op_code::prop_g);
       auto field_name = cur_ch().add_lit_get(value{value::str{it->field}});
       cur_ch().add(field_name);
+      last_type = static_type::any;
       return {};
     }
 
@@ -566,6 +806,9 @@ namespace tosuto::vm {
 
     cur_ch().add(op.first);
     cur_ch().add(op.second);
+    // globals and upvalues can be set from anywhere, their type is never known
+    last_type = op.first == op_code::loc_g ? locals[op.second].type
+                                           : static_type::any;
 
     return {};
   }
@@ -579,12 +822,14 @@ namespace tosuto::vm {
     } else {
       cur_ch().add_lit(value{it->value});
     }
+    last_type = static_type::num;
     return {};
   }
 
   std::expected<void, std::string> compiler::string(node* n) {
     auto it = ami_dyn_cast(string_node*, n);
     cur_ch().add_lit(value{value::str{it->value}});
+    last_type = static_type::str;
     return {};
   }
 
@@ -594,10 +839,12 @@ namespace tosuto::vm {
     switch (it->op) {
       case tok_type::sub: {
         cur_ch().add(op_code::neg);
+        last_type = static_type::num;
         break;
       }
       case tok_type::exclaim: {
         cur_ch().add(op_code::inv);
+        last_type = static_type::any;
         break;
       }
       default:
@@ -613,9 +860,12 @@ namespace tosuto::vm {
       case node_type::for_loop:break;
       case node_type::decorated: {
         auto decor = ami_dyn_cast(decorated_node*, exp);
-        if (decor->target->type == node_type::fn_def || decor->target->type == node_type::anon_fn_def) {
+        if (decor->target->type == node_type::fn_def ||
+            decor->target->type == node_type::anon_fn_def ||
+            decor->target->type == node_type::for_loop) {
           break;
         }
+        [[fallthrough]];
       }
       default:cur_ch().add(op_code::pop);
     }
@@ -633,6 +883,7 @@ namespace tosuto::vm {
       if (pop_last || i != last) {
         ami_discard(pop_for_exp_stmt(exp.get()));
       }
+      i++;
     }
 
     return {};
@@ -646,12 +897,39 @@ namespace tosuto::vm {
   }
 
   std::expected<value::function, std::string> compiler::global(node* n) {
+    find_scalar_locals(n);
+    find_closure_writes(n);
+    // set up front when n is only part of the program, see reload.cpp
+    if (!program_effects) {
+      program_effects = std::make_shared<effects>();
+      collect_effects(n, *program_effects);
+      if (program_effects->reloaded) forget_fns(*program_effects);
+    }
+    // code in other modules can assign anything, see modules.h
+    if (module || program_effects->imports) program_effects = nullptr;
+
+    global_annotations = std::make_shared<std::unordered_map<std::string, std::string>>();
+    for (auto const& it: static_cast<block_node*>(n)->exprs) {
+      if (it->type != node_type::var_def) continue;
+
+      auto def = static_cast<var_def_node*>(it.get());
+      if (def->type_name.empty()) continue;
+      auto [found, added] = global_annotations->emplace(def->name, def->type_name);
+      if (!added && found->second != def->type_name) {
+        return std::unexpected{"Conflicting annotations on " + def->name};
+      }
+    }
     ami_discard(basic_block(n, true));
 
     cur_ch().add(op_code::ret);
     return fun;
   }
 
+  void compiler::forget_fns(effects& it) {
+    for (auto const& [name, fn]: it.fns) it.assigned.emplace(name);
+    it.fns.clear();
+  }
+
   compiler::compiler(value::function::type type) : fn_type(type), enclosing(nullptr) {
     locals.emplace_back(value::str{""}, 0);
   }
@@ -665,7 +943,12 @@ namespace tosuto::vm {
   }
 
   std::optional<u16> compiler::resolve_upval(std::string const& name) {
-    if (enclosing == nullptr) return std::nullopt;
+    if (enclosing == nullptr) {
+      // a lazily compiled body only has what it captured when it was defined
+      auto it = std::ranges::find(upval_names, name);
+      if (it == upval_names.end()) return std::nullopt;
+      return u16(it - upval_names.begin());
+    }
 
     auto local = enclosing->resolve_local(name);
     if (local) {
@@ -681,6 +964,24 @@ namespace tosuto::vm {
     return std::nullopt;
   }
 
+  std::string compiler::global_annotation(std::string const& name) const {
+    if (!global_annotations) return {};
+    auto it = global_annotations->find(name);
+    return it == global_annotations->end() ? std::string{} : it->second;
+  }
+
+  std::string compiler::upval_annotation(std::string const& name) {
+    if (enclosing == nullptr) {
+      auto it = std::ranges::find(upval_names, name);
+      if (it == upval_names.end()) return {};
+      return upval_annotations[it - upval_names.begin()];
+    }
+
+    auto local = enclosing->resolve_local(name);
+    if (local) return enclosing->locals[*local].annotation;
+    return enclosing->upval_annotation(name);
+  }
+
   u16 compiler::add_upval(u16 idx, bool is_local) {
     auto it = std::find_if(upvals.begin(), upvals.end(), [&](upvalue const& val) {
       return val.index == idx && val.is_local == is_local;
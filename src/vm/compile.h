@@ -1,9 +1,17 @@
 #pragma once
 
+#include <unordered_set>
 #include "vm.h"
 #include "../parse.h"
 
 namespace tosuto::vm {
+  // what the compiler can prove about a value, see types.cpp
+  enum class static_type : u8 {
+    any,
+    num,
+    str
+  };
+
   struct compiler {
     struct upvalue {
       u16 index;
@@ -16,6 +24,9 @@ namespace tosuto::vm {
       value::str name{""};
       u8 depth{};
       bool is_captured;
+      static_type type = static_type::any;
+      // declared type, checked on every assignment
+      std::string annotation;
 
       inline local(value::str&& name, u8 depth) :
         name(name), depth(depth), is_captured(false) {}
@@ -30,6 +41,44 @@ namespace tosuto::vm {
     std::vector<local> locals;
     std::vector<upvalue> upvals;
     u8 depth{};
+    // object/array locals that never escape, stored as one local per field
+    std::unordered_set<std::string> scalar_locals;
+
+    // what a piece of code assigns or defines, see licm.cpp
+    struct effects {
+      std::unordered_set<std::string> assigned, props, defined;
+      // named functions defined, null for names defined more than once
+      std::unordered_map<std::string, fn_def_node*> fns;
+      // whether hot_reload() is called, which swaps functions behind the
+      // compiler's back, see reload.h
+      bool reloaded = false;
+      // whether it imports modules, whose code the compiler never sees
+      bool imports = false;
+    };
+
+    // everything assigned anywhere in the program, shared with nested
+    // compilers. global() collects it unless it's already set
+    std::shared_ptr<effects> program_effects;
+    // loop-invariant expressions and the hidden locals caching them
+    std::unordered_map<node*, u16> hoisted;
+    // locals some closure assigns, whose type is never known
+    std::unordered_set<std::string> closure_writes;
+    // type of the value the last compiled expression left on the stack
+    static_type last_type = static_type::any;
+    // defer compiling function bodies until their first call
+    bool lazy = true;
+    // compiling an imported module, whose globals its importers can write
+    bool module = false;
+    // what each upval captured, for resolving them without an enclosing
+    // compiler once the body is compiled lazily
+    std::vector<std::string> upval_names;
+    // and what each of them was annotated with, one per upval_names
+    std::vector<std::string> upval_annotations;
+    // `x: num := ..` at the top level, checked wherever the global's
+    // assigned. shared with nested compilers
+    std::shared_ptr<std::unordered_map<std::string, std::string>> global_annotations;
+    // suffix for generated names, rand() isn't safe to share between threads
+    u32 next_suffix = 0;
 
     explicit compiler(value::function::type type);
 
@@ -47,6 +96,8 @@ namespace tosuto::vm {
 
     std::expected<void, std::string> compile(node* n);
 
+    std::expected<void, std::string> dispatch(node* n);
+
     std::expected<void, std::string> kw_literal(node* n);
 
     std::expected<void, std::string> string(node* n);
@@ -64,6 +115,12 @@ namespace tosuto::vm {
     std::optional<u16> resolve_local(std::string const& name);
     std::optional<u16> resolve_upval(std::string const& name);
 
+    // declared type of the enclosing local name captures, empty if none
+    std::string upval_annotation(std::string const& name);
+
+    // declared type of the global name, empty if none
+    std::string global_annotation(std::string const& name) const;
+
     std::expected<void, std::string> if_stmt(node* n);
 
     size_t emit_jump(op_code type);
@@ -76,6 +133,10 @@ namespace tosuto::vm {
 
     std::expected<void, std::string> function(value::function::type type, node* n);
 
+    std::expected<void, std::string> function_body(fn_def_node* n);
+
+    void capture_free_names(fn_def_node* n);
+
     std::expected<void, std::string> pop_for_exp_stmt(node* exp);
 
     std::expected<void, std::string> call(node* n);
@@ -86,6 +147,10 @@ namespace tosuto::vm {
 
     std::expected<void, std::string> ret(node* n);
 
+    std::expected<void, std::string> yield(node* n);
+
+    std::expected<void, std::string> import(node* n);
+
     std::expected<void, std::string> object(node* n);
 
     std::expected<void, std::string> anon_fn_def(node* n);
@@ -107,5 +172,67 @@ namespace tosuto::vm {
 
     std::expected<void, std::string>
     decorate_fn(decorated_node* decor, std::shared_ptr<node> const& fn);
+
+    // `@parallel for`, a plain loop unless the body is safe to split up,
+    // see parallel.cpp
+    std::expected<void, std::string>
+    parallel_for(decorated_node* decor, for_node* n);
+
+    // whether name is a local of this or an enclosing function
+    bool is_lexical(std::string const& name);
+
+    void find_scalar_locals(node* body, fn_def_node* fn = nullptr);
+
+    std::optional<u16> resolve_scalar(node* target, std::string const& key);
+
+    std::expected<void, std::string> scalar_def(var_def_node* n);
+
+    static void collect_effects(node* n, effects& out);
+
+    // for programs that hot_reload(), whose functions get swapped behind
+    // the compiler's back: each one counts as assigned instead
+    static void forget_fns(effects& it);
+
+    bool is_invariant(node* n, effects const& loop);
+
+    bool does_lookup(node* n);
+
+    void find_invariants(node* n, effects const& loop, std::vector<node*>& out);
+
+    std::expected<std::vector<node*>, std::string>
+    hoist_invariants(for_node* n, effects const& loop);
+
+    void find_closure_writes(node* n);
+
+    void set_type(u16 slot, static_type type);
+
+    void forget_types(std::unordered_set<std::string> const& names);
+
+    [[nodiscard]] std::vector<static_type> save_types() const;
+
+    void restore_types(std::vector<static_type> const& types);
+
+    static std::vector<static_type>
+    join_types(std::vector<std::vector<static_type>> const& paths);
+
+    static_type type_of(node* n);
+
+    std::expected<void, std::string>
+    check_annotation(std::string const& name, std::string const& type_name);
+  };
+
+  struct lazy_fn {
+    std::shared_ptr<node> def;
+    value::function::type type;
+    std::vector<std::string> upval_names;
+    std::vector<std::string> upval_annotations;
+    std::shared_ptr<compiler::effects> program_effects;
+    std::shared_ptr<std::unordered_map<std::string, std::string>> global_annotations;
   };
+
+  // compiles every body fn, the lazily compiled script of ast, still
+  // defers, independent ones in parallel on the task pool. each body's
+  // literals stay in its own chunk, so the result doesn't depend on which
+  // finishes first. see lazy.cpp
+  std::expected<void, std::string> compile_all(value::function& fn, node* ast);
 }
@@ -0,0 +1,26 @@
+#include "coro.h"
+
+namespace tosuto::vm {
+  std::expected<value, std::string> coro(std::span<value> args) {
+    if (!args[0].is<value::function>() ||
+        args[0].get<value::function>().desc->arity != 0) {
+      return std::unexpected{"coro() needs a function without arguments!"};
+    }
+
+    auto it = std::make_shared<coroutine>();
+    it->fn = args[0].get<value::function>();
+    return value{it};
+  }
+
+  std::expected<value, std::string> resume(std::span<value> args) {
+    return std::unexpected{"Can't resume " + args[0].to_string()};
+  }
+
+  std::expected<value, std::string> done(std::span<value> args) {
+    if (!args[0].is<value::coro>()) {
+      return std::unexpected{"done() needs a coroutine!"};
+    }
+
+    return value{args[0].get<value::coro>()->state == coroutine::status::done};
+  }
+}
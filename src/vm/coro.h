@@ -0,0 +1,18 @@
+#pragma once
+
+#include "vm.h"
+
+namespace tosuto::vm {
+  // coroutines. `co := coro(: -> ...)` wraps a function without arguments,
+  // `resume(co)` runs it until it yields or returns and evaluates to the
+  // yielded or returned value, `yield x` inside it hands x back and evaluates
+  // to nil once resumed. `done(co)` tells whether it returned. a coroutine
+  // can call functions that yield on its behalf, its whole stack is kept.
+  std::expected<value, std::string> coro(std::span<value> args);
+
+  // the vm handles calls to this itself, the native only exists so resume
+  // can be passed around like any other function
+  std::expected<value, std::string> resume(std::span<value> args);
+
+  std::expected<value, std::string> done(std::span<value> args);
+}
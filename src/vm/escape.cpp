@@ -0,0 +1,254 @@
+#include "compile.h"
+
+#include <unordered_set>
+#include <algorithm>
+#include <format>
+
+namespace tosuto::vm {
+  // escape analysis: finds `p := [| x = .., y = .. |]` and `a := [.., ..]`
+  // definitions whose value is only ever read or written field-by-field
+  // (`p.x`, `p.x = v`, `a[0]`, `a[0] = v` with a constant in-range index)
+  // inside the function that defines them. those never need a heap object, so
+  // the compiler keeps every field in its own local instead.
+
+  namespace {
+    struct escape_walker {
+      struct candidate {
+        node* literal = nullptr;
+        size_t defs = 0;
+        bool escapes = false;
+      };
+
+      std::unordered_map<std::string, candidate> names;
+      std::vector<std::pair<std::string, std::string>> accesses;
+      // arguments of the nested functions being walked, which hide our names
+      std::vector<std::string> shadowed;
+
+      static std::optional<std::string> bare_name(node* n) {
+        if (n->type != node_type::field_get) return std::nullopt;
+        auto it = static_cast<field_get_node*>(n);
+        if (it->target) return std::nullopt;
+        return it->field;
+      }
+
+      // a[k] with a constant k, as the key the scalar local is stored under
+      static std::optional<std::string> const_index(node* n) {
+        if (n->type != node_type::number) return std::nullopt;
+        double idx = static_cast<number_node*>(n)->value;
+        if (idx < 0 || idx != floor(idx)) return std::nullopt;
+        return "[" + std::to_string(size_t(idx)) + "]";
+      }
+
+      // records `name.key` / `name[key]` accesses, returns false if n isn't one
+      bool access(node* n, bool nested) {
+        std::optional<std::string> name, key;
+        if (n->type == node_type::field_get) {
+          auto it = static_cast<field_get_node*>(n);
+          if (!it->target) return false;
+          name = bare_name(it->target.get());
+          key = "." + it->field;
+        } else if (n->type == node_type::bin_op) {
+          auto it = static_cast<bin_op_node*>(n);
+          if (it->op != tok_type::l_square) return false;
+          name = bare_name(it->lhs.get());
+          key = const_index(it->rhs.get());
+          if (name && !key) {
+            escape(*name);
+            walk(it->rhs.get(), nested);
+            return true;
+          }
+        }
+
+        if (!name || !key) return false;
+
+        // anything a nested function touches is captured
+        if (nested) escape(*name);
+        else accesses.emplace_back(*name, *key);
+        return true;
+      }
+
+      void escape(std::string const& name) {
+        if (std::ranges::find(shadowed, name) != shadowed.end()) return;
+        names[name].escapes = true;
+      }
+
+      void nested_fn(fn_def_node* n) {
+        for (auto const& arg: n->args) shadowed.push_back(arg.first);
+        if (n->deferred) {
+          // only pre-parsed, anything it mentions may be captured
+          for (auto const& name: n->deferred->names) escape(name);
+        } else {
+          walk(n->body.get(), true);
+        }
+        shadowed.resize(shadowed.size() - n->args.size());
+      }
+
+      void define(std::string const& name, node* literal) {
+        auto& it = names[name];
+        it.defs++;
+        it.literal = literal;
+      }
+
+      void block(block_node* n, bool nested) {
+        for (auto const& stmt: n->exprs) {
+          // the last statement of a block may be its value
+          if (!nested && stmt->type == node_type::var_def &&
+              stmt != n->exprs.back()) {
+            auto it = static_cast<var_def_node*>(stmt.get());
+            auto type = it->value->type;
+            define(it->name,
+                   type == node_type::object || type == node_type::array
+                   ? it->value.get() : nullptr);
+            walk(it->value.get(), nested);
+            continue;
+          }
+
+          walk(stmt.get(), nested);
+        }
+      }
+
+      void walk(node* n, bool nested) {
+        if (access(n, nested)) return;
+
+        switch (n->type) {
+          case node_type::block: {
+            block(static_cast<block_node*>(n), nested);
+            return;
+          }
+          case node_type::var_def: {
+            auto it = static_cast<var_def_node*>(n);
+            if (!nested) define(it->name, nullptr);
+            break;
+          }
+          case node_type::for_loop: {
+            if (!nested) define(static_cast<for_node*>(n)->id, nullptr);
+            break;
+          }
+          case node_type::fn_def: {
+            auto it = static_cast<fn_def_node*>(n);
+            if (!nested) define(it->name, nullptr);
+            nested_fn(it);
+            return;
+          }
+          case node_type::anon_fn_def: {
+            nested_fn(static_cast<fn_def_node*>(n));
+            return;
+          }
+          case node_type::bin_op: {
+            auto it = static_cast<bin_op_node*>(n);
+            if (it->op == tok_type::assign && access(it->lhs.get(), nested)) {
+              walk(it->rhs.get(), nested);
+              return;
+            }
+            break;
+          }
+          case node_type::field_get: {
+            if (auto name = bare_name(n)) {
+              escape(*name);
+              return;
+            }
+            break;
+          }
+          default:;
+        }
+
+        for_each_child(n, [&](node* child) { walk(child, nested); });
+      }
+    };
+
+    bool mentions(node* n, std::string const& name) {
+      auto it = escape_walker::bare_name(n);
+      if (it && *it == name) return true;
+
+      if (n->type == node_type::fn_def || n->type == node_type::anon_fn_def) {
+        auto fn = static_cast<fn_def_node*>(n);
+        if (fn->deferred) return fn->deferred->names.contains(name);
+      }
+
+      bool found = false;
+      for_each_child(n, [&](node* child) {
+        found = found || mentions(child, name);
+      });
+      return found;
+    }
+
+    std::optional<std::unordered_set<std::string>> literal_keys(node* n) {
+      std::unordered_set<std::string> keys;
+      if (n->type == node_type::object) {
+        for (auto const& [k, v]: static_cast<object_node*>(n)->fields) {
+          if (!keys.emplace("." + k).second) return std::nullopt;
+        }
+      } else {
+        auto size = static_cast<array_node*>(n)->exprs.size();
+        for (size_t i = 0; i < size; i++) {
+          keys.emplace("[" + std::to_string(i) + "]");
+        }
+      }
+
+      return keys;
+    }
+  }
+
+  void compiler::find_scalar_locals(node* body, fn_def_node* fn) {
+    escape_walker walker;
+    if (fn) {
+      for (auto const& arg: fn->args) walker.define(arg.first, nullptr);
+    }
+
+    walker.walk(body, false);
+
+    std::unordered_map<std::string, std::unordered_set<std::string>> keys;
+    for (auto const& [name, it]: walker.names) {
+      if (!it.literal || it.defs != 1 || it.escapes) continue;
+      if (mentions(it.literal, name)) continue;
+
+      auto lit_keys = literal_keys(it.literal);
+      if (lit_keys) keys.emplace(name, std::move(*lit_keys));
+    }
+
+    for (auto const& [name, key]: walker.accesses) {
+      auto it = keys.find(name);
+      if (it != keys.end() && !it->second.contains(key)) keys.erase(it);
+    }
+
+    for (auto const& it: keys) scalar_locals.emplace(it.first);
+  }
+
+  std::optional<u16> compiler::resolve_scalar(node* target, std::string const& key) {
+    if (scalar_locals.empty()) return std::nullopt;
+    if (target->type != node_type::field_get) return std::nullopt;
+
+    auto it = static_cast<field_get_node*>(target);
+    if (it->target || !scalar_locals.contains(it->field)) return std::nullopt;
+
+    return resolve_local(it->field + key);
+  }
+
+  std::expected<void, std::string> compiler::scalar_def(var_def_node* n) {
+    if (n->value->type == node_type::object) {
+      auto obj = ami_dyn_cast(object_node*, n->value.get());
+      auto r = next_suffix++;
+      for (auto const& [k, v]: obj->fields) {
+        if (v->type == node_type::anon_fn_def) {
+          auto fn_def = ami_dyn_cast(fn_def_node*, v.get());
+          fn_def->name = k + "@" + std::format("{:04x}", r);
+        }
+
+        ami_discard(compile(v.get()));
+        ami_discard(add_local(n->name + "." + k));
+        set_type(locals.size() - 1, last_type);
+      }
+
+      return {};
+    }
+
+    auto arr = ami_dyn_cast(array_node*, n->value.get());
+    for (size_t i = 0; i < arr->exprs.size(); i++) {
+      ami_discard(compile(arr->exprs[i].get()));
+      ami_discard(add_local(n->name + "[" + std::to_string(i) + "]"));
+      set_type(locals.size() - 1, last_type);
+    }
+
+    return {};
+  }
+}
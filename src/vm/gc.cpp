@@ -0,0 +1,350 @@
+#include "gc.h"
+#include "vm.h"
+#include "loop.h"
+#include "tasks.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+namespace tosuto::vm {
+  namespace {
+    using clock = std::chrono::steady_clock;
+
+    // more gray than this is marked on the pool
+    constexpr size_t parallel_min = 4096;
+    // a parallel marker shares half its work once it has this much
+    constexpr size_t share_at = 1024;
+
+    struct marker {
+      u32 epoch;
+      // whether other markers run at the same time
+      bool parallel;
+      std::vector<value>& gray;
+      u64 marked = 0;
+
+      bool claim(u32& mark) {
+        if (parallel) {
+          return std::atomic_ref<u32>{mark}.exchange(
+            epoch, std::memory_order_relaxed) != epoch;
+        }
+
+        if (mark == epoch) return false;
+        mark = epoch;
+        return true;
+      }
+
+      // functions have nothing to mark, their upvals do, so they're
+      // traced every time they come up
+      void shade(value const& val) {
+        switch (val.val.index()) {
+          case index_of<value::object>: {
+            auto& obj = *val.get<value::object>();
+            if (obj.frozen || !claim(obj.gc_mark)) return;
+            break;
+          }
+          // refs only come from copies and snapshots, never from run()
+          case index_of<value::ref>: shade(*val.get<value::ref>());
+            return;
+          case index_of<value::function>: {
+            if (!val.get<value::function>().upvals) return;
+            break;
+          }
+          case index_of<value::array>: {
+            auto& arr = *val.get<value::array>();
+            if (arr.frozen || !claim(arr.gc_mark)) return;
+            break;
+          }
+          case index_of<value::coro>: {
+            if (!claim(val.get<value::coro>()->gc_mark)) return;
+            break;
+          }
+          default: return;
+        }
+
+        marked++;
+        gray.push_back(val);
+      }
+
+      void trace(value const& val) {
+        switch (val.val.index()) {
+          case index_of<value::object>: {
+            for (auto const& [k, v]: *val.get<value::object>()) shade(v);
+            break;
+          }
+          case index_of<value::function>: {
+            auto const& fn = val.get<value::function>();
+            for (u16 i = 0; i < fn.desc->num_upvals; i++) {
+              auto* upval = fn.upvals[i];
+              if (upval && claim(upval->gc_mark)) shade(*upval->loc);
+            }
+            break;
+          }
+          case index_of<value::array>: {
+            for (auto const& v: *val.get<value::array>()) shade(v);
+            break;
+          }
+          case index_of<value::coro>: {
+            auto const& co = *val.get<value::coro>();
+            shade(value{co.fn});
+            for (auto const& v: co.stack) shade(v);
+            for (auto const& it: co.frames) shade(value{it.fn});
+            break;
+          }
+          default:;
+        }
+      }
+    };
+
+    // what run() doesn't go through the barrier for: the stack, the
+    // running coroutines, the loop's queues. globals do, so they're only
+    // needed when a cycle starts
+    void shade_roots(vm& vm, value* top, marker& m, bool globals) {
+      for (value* it = vm.stack.data(); it <= top; it++) m.shade(*it);
+      if (globals) {
+        for (auto const& [name, val]: vm.globals) m.shade(val);
+      }
+      for (auto const& it: vm.coros) m.shade(value{it.co});
+      m.shade(vm.returned);
+      trace_loop(vm, [&](value const& val) { m.shade(val); });
+    }
+
+    struct shared_gray {
+      std::mutex mutex;
+      std::condition_variable more;
+      std::vector<std::vector<value>> batches;
+      // markers holding work, the marking's done once that's none and
+      // there are no batches left
+      size_t busy = 0;
+      std::atomic<u64> marked = 0;
+    };
+
+    void mark_shared(shared_gray& shared, u32 epoch) {
+      std::vector<value> local;
+      marker m{epoch, true, local};
+      std::unique_lock lock{shared.mutex};
+      for (;;) {
+        while (shared.batches.empty() && shared.busy > 0) shared.more.wait(lock);
+        if (shared.batches.empty()) break;
+
+        local = std::move(shared.batches.back());
+        shared.batches.pop_back();
+        shared.busy++;
+        lock.unlock();
+
+        while (!local.empty()) {
+          auto val = std::move(local.back());
+          local.pop_back();
+          m.trace(val);
+
+          if (local.size() >= share_at) {
+            std::vector<value> half(std::make_move_iterator(local.begin() + local.size() / 2),
+                                    std::make_move_iterator(local.end()));
+            local.resize(local.size() / 2);
+            std::scoped_lock share{shared.mutex};
+            shared.batches.push_back(std::move(half));
+            shared.more.notify_one();
+          }
+        }
+
+        lock.lock();
+        shared.busy--;
+      }
+
+      shared.more.notify_all();
+      shared.marked += m.marked;
+    }
+
+    // marks everything gray and whatever that reaches, on the pool once
+    // there's enough of it to split up
+    void drain(heap& gc) {
+      marker m{gc.epoch, false, gc.gray};
+      bool parallel = workers() > 1;
+      while (!gc.gray.empty() && !(parallel && gc.gray.size() >= parallel_min)) {
+        auto val = std::move(gc.gray.back());
+        gc.gray.pop_back();
+        m.trace(val);
+      }
+      gc.stats.last_marked += m.marked;
+      if (gc.gray.empty()) return;
+
+      shared_gray shared;
+      shared.batches.push_back(std::move(gc.gray));
+      gc.gray.clear();
+
+      // one marker per worker plus us
+      auto helpers = workers();
+      std::atomic<size_t> running = helpers;
+      for (size_t i = 0; i < helpers; i++) {
+        post([&] {
+          mark_shared(shared, gc.epoch);
+          running--;
+          running.notify_all();
+        });
+      }
+      mark_shared(shared, gc.epoch);
+
+      // they point at our locals
+      for (auto left = running.load(); left > 0; left = running.load()) {
+        if (!help()) running.wait(left);
+      }
+      gc.stats.last_marked += shared.marked;
+    }
+
+    template<typename T>
+    u64 sweep(std::vector<std::weak_ptr<T>>& tracked, size_t at_start, u32 epoch) {
+      u64 freed = 0;
+      for (size_t i = 0; i < at_start; i++) {
+        auto it = tracked[i].lock();
+        if (!it || it->frozen || it->gc_mark == epoch) continue;
+
+        // whatever's in it goes, and it goes once the cycle is broken
+        it->clear();
+        freed++;
+      }
+
+      std::erase_if(tracked, [](auto const& it) { return it.expired(); });
+      return freed;
+    }
+
+    void start(vm& vm, value* top) {
+      auto& gc = vm.gc;
+      if (++gc.epoch == 0) gc.epoch = 1;
+      gc.marking = true;
+      gc.objects_at_start = gc.objects.size();
+      gc.arrays_at_start = gc.arrays.size();
+      gc.stats.last_marked = 0;
+      gc.stats.last_freed = 0;
+      gc.stats.last_slices = 0;
+      gc.stats.last_max_pause_ms = 0;
+      gc.stats.last_total_pause_ms = 0;
+
+      marker m{gc.epoch, false, gc.gray};
+      shade_roots(vm, top, m, true);
+      gc.stats.last_marked += m.marked;
+    }
+
+    void finish(vm& vm, value* top) {
+      auto& gc = vm.gc;
+      marker m{gc.epoch, false, gc.gray};
+      shade_roots(vm, top, m, false);
+      gc.stats.last_marked += m.marked;
+      drain(gc);
+
+      gc.marking = false;
+      auto freed = sweep(gc.objects, gc.objects_at_start, gc.epoch) +
+                   sweep(gc.arrays, gc.arrays_at_start, gc.epoch);
+      gc.stats.cycles++;
+      gc.stats.freed += freed;
+      gc.stats.last_freed = freed;
+      gc.allocated = 0;
+      gc.budget = std::max(heap::min_budget, gc.objects.size() + gc.arrays.size());
+    }
+
+    void count_pause(heap& gc, clock::time_point since) {
+      double ms = std::chrono::duration<double, std::milli>(clock::now() - since).count();
+      gc.stats.last_slices++;
+      gc.stats.last_max_pause_ms = std::max(gc.stats.last_max_pause_ms, ms);
+      gc.stats.last_total_pause_ms += ms;
+      gc.stats.max_pause_ms = std::max(gc.stats.max_pause_ms, ms);
+      gc.stats.total_pause_ms += ms;
+    }
+  }
+
+  void heap::shade(value const& val) {
+    marker m{epoch, false, gray};
+    m.shade(val);
+    stats.last_marked += m.marked;
+  }
+
+  void heap::cancel() {
+    marking = false;
+    gray.clear();
+    allocated = 0;
+  }
+
+  void gc_step(vm& vm, value* top) {
+    auto& gc = vm.gc;
+    auto began = clock::now();
+    gc.allocated = 0;
+    if (!gc.marking) {
+      start(vm, top);
+      if (gc.pause.count() == 0) {
+        finish(vm, top);
+        count_pause(gc, began);
+        return;
+      }
+    }
+
+    // checking the clock costs more than tracing a value
+    marker m{gc.epoch, false, gc.gray};
+    for (size_t i = 0; !gc.gray.empty(); i++) {
+      if (i % 64 == 0 && clock::now() - began >= gc.pause) break;
+
+      auto val = std::move(gc.gray.back());
+      gc.gray.pop_back();
+      m.trace(val);
+    }
+    gc.stats.last_marked += m.marked;
+
+    if (gc.gray.empty()) finish(vm, top);
+    count_pause(gc, began);
+  }
+
+  void gc_collect(vm& vm, value* top) {
+    auto& gc = vm.gc;
+    if (!gc.enabled) return;
+
+    auto began = clock::now();
+    if (!gc.marking) start(vm, top);
+    finish(vm, top);
+    count_pause(gc, began);
+  }
+
+  void gc_release(vm& vm) {
+    auto& gc = vm.gc;
+    gc.cancel();
+    // nothing's marked with an epoch that hasn't come yet
+    auto unreached = gc.epoch + 1 == 0 ? 1 : gc.epoch + 1;
+    sweep(gc.objects, gc.objects.size(), unreached);
+    sweep(gc.arrays, gc.arrays.size(), unreached);
+    gc.objects.clear();
+    gc.arrays.clear();
+  }
+
+  std::expected<value, std::string> gc(std::span<value> args) {
+    // like snapshot(), nothing above our arguments is alive
+    gc_collect(*vm::current, args.data() - 1);
+    return value{value::nil{}};
+  }
+
+  std::expected<value, std::string> gc_stats(std::span<value> args) {
+    auto const& stats = vm::current->gc.stats;
+    auto out = std::make_shared<value::object::element_type>();
+    auto put = [&](char const* name, double val) {
+      (*out)[value::str{name}] = value{val};
+    };
+
+    put("cycles", double(stats.cycles));
+    put("freed", double(stats.freed));
+    put("max_pause_ms", stats.max_pause_ms);
+    put("total_pause_ms", stats.total_pause_ms);
+    put("last_marked", double(stats.last_marked));
+    put("last_freed", double(stats.last_freed));
+    put("last_slices", double(stats.last_slices));
+    put("last_max_pause_ms", stats.last_max_pause_ms);
+    put("last_total_pause_ms", stats.last_total_pause_ms);
+    put("tracked", double(vm::current->gc.objects.size() + vm::current->gc.arrays.size()));
+    return value{out};
+  }
+
+  std::expected<value, std::string> gc_pause(std::span<value> args) {
+    if (!args[0].is<value::num>() || args[0].get<value::num>() < 0) {
+      return std::unexpected{"gc_pause() needs a number of milliseconds!"};
+    }
+
+    vm::current->gc.pause = std::chrono::microseconds{
+      u64(args[0].get<value::num>() * 1000)};
+    return value{value::nil{}};
+  }
+}
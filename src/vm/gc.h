@@ -0,0 +1,107 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "value.h"
+
+namespace tosuto::vm {
+  // values are refcounted, which frees everything but cycles. the gc is only
+  // there for those: it traces what a vm's roots reach and clears the
+  // objects and arrays that vm made which are still alive but unreachable,
+  // which breaks whatever cycle kept them alive.
+  //
+  // marking is incremental. once a vm allocated as much as survived the
+  // last cycle, the next allocation starts one, and from then on every few
+  // allocations mark for up to a pause. writes into the heap go through a
+  // barrier that shades what's written while marking, so nothing unmarked
+  // hides behind something already traced. once there's nothing left to
+  // mark, the stack and the event loop are scanned again and whatever that
+  // turns up is marked in one go, on the task pool if there's a lot of it,
+  // before the sweep.
+  //
+  // a vm only knows its own roots, so it only ever clears what it made
+  // itself. frozen values are shared between vms and never marked or
+  // cleared, and the vms running parallel for chunks share their caller's
+  // values, so they don't collect at all.
+
+  struct vm;
+
+  struct gc_counters {
+    u64 cycles = 0;
+    u64 freed = 0;
+    double max_pause_ms = 0;
+    double total_pause_ms = 0;
+
+    // of the last cycle
+    u64 last_marked = 0;
+    u64 last_freed = 0;
+    u64 last_slices = 0;
+    double last_max_pause_ms = 0;
+    double last_total_pause_ms = 0;
+  };
+
+  struct heap {
+    // weak, so whatever refcounting frees on its own just expires
+    std::vector<std::weak_ptr<object_fields>> objects;
+    std::vector<std::weak_ptr<array_items>> arrays;
+    bool enabled = true;
+    bool marking = false;
+    // what counts as marked this cycle
+    u32 epoch = 0;
+    // a cycle only clears what was tracked when it started
+    size_t objects_at_start = 0, arrays_at_start = 0;
+    std::vector<value> gray;
+    // allocations since the last cycle or slice and how many start the next
+    size_t allocated = 0;
+    size_t budget = min_budget;
+    // how long a slice of marking may take, zero runs each cycle in one go
+    std::chrono::microseconds pause{1000};
+    gc_counters stats;
+
+    static constexpr size_t min_budget = 10000;
+    static constexpr size_t slice_every = 256;
+
+    // for everything run() allocates, true when gc_step is due
+    inline bool track(value const& val) {
+      if (!enabled) return false;
+
+      if (val.is<value::object>()) objects.emplace_back(val.get<value::object>());
+      else arrays.emplace_back(val.get<value::array>());
+      if (marking) {
+        shade(val);
+        return ++allocated >= slice_every;
+      }
+      return ++allocated >= budget;
+    }
+
+    // the write barrier, val was just stored somewhere in the heap
+    inline void written(value const& val) {
+      if (marking) [[unlikely]] shade(val);
+    }
+
+    void shade(value const& val);
+
+    // drops the cycle in progress, for when others write into the heap
+    // behind the barrier's back
+    void cancel();
+  };
+
+  // marks for a slice or starts a cycle, top is the highest live slot
+  void gc_step(vm& vm, value* top);
+
+  // finishes the cycle in progress or runs a whole one
+  void gc_collect(vm& vm, value* top);
+
+  // clears everything vm made that's still around, for vms that are done
+  // and whose results were copied out
+  void gc_release(vm& vm);
+
+  std::expected<value, std::string> gc(std::span<value> args);
+
+  // an object with gc_counters' fields
+  std::expected<value, std::string> gc_stats(std::span<value> args);
+
+  // sets the pause in milliseconds, 0 for no incremental marking
+  std::expected<value, std::string> gc_pause(std::span<value> args);
+}
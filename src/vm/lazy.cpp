@@ -0,0 +1,163 @@
+#include "compile.h"
+#include "tasks.h"
+
+#include <mutex>
+#include <set>
+
+namespace tosuto::vm {
+  // lazy compilation. defining a function only records its AST and what it
+  // captures, the body is compiled into the function's chunk by the vm on the
+  // first call. since the enclosing compiler is gone by then, captures are
+  // decided up front from every name the body (nested functions included)
+  // mentions: any of them that resolves to an enclosing local or upval
+  // becomes an upval, which may capture a bit more than compiling eagerly.
+
+  namespace {
+    void free_names(node* n, std::set<std::string>& out) {
+      if (n->type == node_type::field_get) {
+        auto it = static_cast<field_get_node*>(n);
+        if (!it->target) out.emplace(it->field);
+      }
+
+      if (n->type == node_type::fn_def || n->type == node_type::anon_fn_def) {
+        auto it = static_cast<fn_def_node*>(n);
+        if (it->deferred) out.insert(it->deferred->names.begin(),
+                                     it->deferred->names.end());
+      }
+
+      for_each_child(n, [&](node* child) { free_names(child, out); });
+    }
+  }
+
+  void compiler::capture_free_names(fn_def_node* n) {
+    std::set<std::string> names;
+    free_names(n, names);
+    // args always shadow whatever is outside
+    for (auto const& arg: n->args) names.erase(arg.first);
+
+    for (auto const& name: names) {
+      if (!resolve_upval(name)) continue;
+      upval_names.push_back(name);
+      upval_annotations.push_back(upval_annotation(name));
+    }
+  }
+
+  namespace {
+    // compiles desc's deferred body into its chunk, the caller makes sure
+    // nobody else touches desc or its AST meanwhile
+    std::expected<void, std::string>
+    compile_body(std::shared_ptr<fn_desc> const& desc) {
+      auto lazy = desc->lazy;
+
+      compiler comp{lazy->type};
+      comp.fun.desc = desc;
+      comp.upval_names = lazy->upval_names;
+      comp.upval_annotations = lazy->upval_annotations;
+      comp.program_effects = lazy->program_effects;
+      comp.global_annotations = lazy->global_annotations;
+
+      auto res = comp.function_body(static_cast<fn_def_node*>(lazy->def.get()));
+      if (!res.has_value()) {
+        desc->chunk.data.clear();
+        desc->chunk.literals.clear();
+        return std::unexpected{
+          "In " + std::string(desc->chunk.name) + ": " + res.error()};
+      }
+
+      desc->lazy = nullptr;
+      desc->compiled.store(true, std::memory_order_release);
+      return {};
+    }
+
+    // parses every deferred body under n, nested ones included
+    std::expected<void, std::string> parse_all(node* n) {
+      if (n->type == node_type::fn_def || n->type == node_type::anon_fn_def) {
+        ami_discard(static_cast<fn_def_node*>(n)->parse_body());
+      }
+
+      std::expected<void, std::string> res;
+      for_each_child(n, [&](node* child) {
+        if (res.has_value()) res = parse_all(child);
+      });
+      return res;
+    }
+
+    struct body_jobs {
+      std::mutex mutex;
+      std::unordered_set<fn_desc*> claimed;
+      // the error of the body that comes first in the literal pools, so
+      // which one's reported doesn't depend on the schedule
+      std::vector<u32> error_at;
+      std::string error;
+      std::atomic<size_t> pending = 0;
+    };
+
+    void compile_nested(body_jobs& jobs, chunk const& ch,
+                        std::vector<u32> const& at);
+
+    void compile_job(body_jobs& jobs, std::shared_ptr<fn_desc> const& desc,
+                     std::vector<u32> at) {
+      auto res = compile_body(desc);
+      if (res.has_value()) {
+        compile_nested(jobs, desc->chunk, at);
+      } else {
+        std::scoped_lock lock{jobs.mutex};
+        if (jobs.error.empty() || at < jobs.error_at) {
+          jobs.error_at = std::move(at);
+          jobs.error = std::move(res.error());
+        }
+      }
+
+      jobs.pending--;
+      jobs.pending.notify_all();
+    }
+
+    // queues a job for every body still deferred in ch's literals
+    void compile_nested(body_jobs& jobs, chunk const& ch,
+                        std::vector<u32> const& at) {
+      for (u32 i = 0; i < ch.literals.size(); i++) {
+        if (!ch.literals[i].is<value::function>()) continue;
+
+        auto desc = ch.literals[i].get<value::function>().desc;
+        if (desc->is_compiled()) continue;
+        {
+          std::scoped_lock lock{jobs.mutex};
+          if (!jobs.claimed.emplace(desc.get()).second) continue;
+        }
+
+        auto next = at;
+        next.push_back(i);
+        jobs.pending++;
+        post([&jobs, desc, next = std::move(next)] {
+          compile_job(jobs, desc, std::move(next));
+        });
+      }
+    }
+  }
+
+  std::expected<void, std::string> compile_lazy(value::function& fn) {
+    // vms on other threads may be calling it too, and compiling also parses
+    // deferred bodies in the shared AST. one at a time, whoever's first wins
+    static std::mutex mutex;
+    std::scoped_lock lock{mutex};
+    if (fn.desc->is_compiled()) return {};
+
+    return compile_body(fn.desc);
+  }
+
+  std::expected<void, std::string> compile_all(value::function& fn, node* ast) {
+    // parsing is the only thing compiling writes into the AST, and
+    // @parallel for reaches into other functions' bodies. parsing it all
+    // up front leaves the bodies nothing shared to race on
+    ami_discard(parse_all(ast));
+
+    body_jobs jobs;
+    compile_nested(jobs, fn.desc->chunk, {});
+    for (auto left = jobs.pending.load(); left > 0; left = jobs.pending.load()) {
+      if (!help()) jobs.pending.wait(left);
+    }
+
+    if (!jobs.error.empty()) return std::unexpected{std::move(jobs.error)};
+    return {};
+  }
+}
@@ -0,0 +1,212 @@
+#include "compile.h"
+
+namespace tosuto::vm {
+  // loop-invariant code motion for `for` bodies. an expression is invariant
+  // when nothing it reads can change while the loop runs: locals that the body
+  // never assigns or redefines, and globals and properties that are never
+  // assigned anywhere in the program (natives are assumed not to mutate the
+  // values passed to them).
+  //
+  // each invariant expression gets a hidden local that the loop preheader sets
+  // to nil. the first evaluation in the body fills it and later ones only load
+  // it, so the expression is still first evaluated exactly where it used to be
+  // and errors and evaluation order don't change.
+
+  void compiler::collect_effects(node* n, effects& out) {
+    switch (n->type) {
+      case node_type::bin_op: {
+        auto it = static_cast<bin_op_node*>(n);
+        if (it->op != tok_type::assign) break;
+
+        // p.x and a[0] also name the locals a scalar-replaced p or a keeps
+        // its fields in, see escape.cpp
+        if (it->lhs->type == node_type::field_get) {
+          auto lhs = static_cast<field_get_node*>(it->lhs.get());
+          if (!lhs->target) {
+            out.assigned.emplace(lhs->field);
+            break;
+          }
+
+          out.props.emplace(lhs->field);
+          auto target = lhs->target.get();
+          if (target->type == node_type::field_get &&
+              !static_cast<field_get_node*>(target)->target) {
+            auto const& name = static_cast<field_get_node*>(target)->field;
+            out.assigned.emplace(name + "." + lhs->field);
+          }
+        } else if (it->lhs->type == node_type::bin_op) {
+          auto lhs = static_cast<bin_op_node*>(it->lhs.get());
+          if (lhs->op == tok_type::l_square &&
+              lhs->lhs->type == node_type::field_get &&
+              !static_cast<field_get_node*>(lhs->lhs.get())->target &&
+              lhs->rhs->type == node_type::number) {
+            auto const& name = static_cast<field_get_node*>(lhs->lhs.get())->field;
+            auto idx = static_cast<number_node*>(lhs->rhs.get())->value;
+            out.assigned.emplace(name + "[" + std::to_string(size_t(idx)) + "]");
+          }
+        }
+        break;
+      }
+      case node_type::call: {
+        auto callee = static_cast<call_node*>(n)->callee.get();
+        if (callee->type == node_type::field_get &&
+            !static_cast<field_get_node*>(callee)->target &&
+            static_cast<field_get_node*>(callee)->field == "hot_reload") {
+          out.reloaded = true;
+        }
+        break;
+      }
+      case node_type::import_stmt: out.imports = true;
+        break;
+      case node_type::var_def: {
+        auto const& name = static_cast<var_def_node*>(n)->name;
+        out.defined.emplace(name);
+        out.fns[name] = nullptr;
+        break;
+      }
+      case node_type::for_loop: {
+        out.defined.emplace(static_cast<for_node*>(n)->id);
+        break;
+      }
+      case node_type::fn_def:
+      case node_type::anon_fn_def: {
+        auto it = static_cast<fn_def_node*>(n);
+        if (!it->name.empty()) {
+          out.defined.emplace(it->name);
+          auto [fn, fresh] = out.fns.emplace(it->name, it);
+          if (!fresh) fn->second = nullptr;
+        }
+        for (auto const& arg: it->args) out.defined.emplace(arg.first);
+        if (auto const& body = it->deferred) {
+          out.assigned.insert(body->assigned.begin(), body->assigned.end());
+          out.props.insert(body->props.begin(), body->props.end());
+          out.defined.insert(body->defined.begin(), body->defined.end());
+          if (body->names.contains("hot_reload")) out.reloaded = true;
+          if (body->imports) out.imports = true;
+        }
+        break;
+      }
+      default:;
+    }
+
+    for_each_child(n, [&](node* child) { collect_effects(child, out); });
+  }
+
+  bool compiler::is_invariant(node* n, effects const& loop) {
+    switch (n->type) {
+      case node_type::number:
+      case node_type::string:
+      case node_type::kw_literal: return true;
+      case node_type::field_get: {
+        auto it = static_cast<field_get_node*>(n);
+        if (it->target) {
+          return program_effects && !program_effects->props.contains(it->field)
+                 && is_invariant(it->target.get(), loop);
+        }
+
+        auto const& name = it->field;
+        if (loop.assigned.contains(name) || loop.defined.contains(name)) {
+          return false;
+        }
+
+        // only closures can write a local behind our back
+        auto local = resolve_local(name);
+        if (local && !locals[*local].is_captured) return true;
+        return program_effects && !program_effects->assigned.contains(name);
+      }
+      case node_type::un_op: {
+        auto it = static_cast<un_op_node*>(n);
+        if (it->op != tok_type::sub && it->op != tok_type::exclaim) return false;
+        return is_invariant(it->target.get(), loop);
+      }
+      case node_type::bin_op: {
+        // anything else may dispatch to an overloaded operator, unless the
+        // types of both sides are known
+        auto it = static_cast<bin_op_node*>(n);
+        if (it->op != tok_type::eq && it->op != tok_type::neq &&
+            type_of(n) == static_type::any) {
+          return false;
+        }
+
+        return is_invariant(it->lhs.get(), loop) &&
+               is_invariant(it->rhs.get(), loop);
+      }
+      default: return false;
+    }
+  }
+
+  // only worth a slot if it saves a hash lookup
+  bool compiler::does_lookup(node* n) {
+    if (n->type == node_type::field_get) {
+      auto it = static_cast<field_get_node*>(n);
+      if (it->target || !resolve_local(it->field)) return true;
+    }
+
+    bool found = false;
+    for_each_child(n, [&](node* child) {
+      found = found || does_lookup(child);
+    });
+    return found;
+  }
+
+  void compiler::find_invariants(node* n, effects const& loop,
+                                 std::vector<node*>& out) {
+    if (hoisted.contains(n)) return;
+
+    switch (n->type) {
+      case node_type::fn_def:
+      case node_type::anon_fn_def:
+      case node_type::decorated: return;
+      case node_type::field_get: {
+        auto it = static_cast<field_get_node*>(n);
+        // plain locals are already as cheap as it gets
+        if (!it->target && resolve_local(it->field)) return;
+        break;
+      }
+      case node_type::bin_op: {
+        auto it = static_cast<bin_op_node*>(n);
+        if (it->op == tok_type::assign) {
+          for_each_child(it->lhs.get(), [&](node* child) {
+            find_invariants(child, loop, out);
+          });
+          find_invariants(it->rhs.get(), loop, out);
+          return;
+        }
+        break;
+      }
+      default:;
+    }
+
+    if (is_invariant(n, loop) && does_lookup(n)) {
+      out.push_back(n);
+      return;
+    }
+
+    for_each_child(n, [&](node* child) { find_invariants(child, loop, out); });
+  }
+
+  std::expected<std::vector<node*>, std::string>
+  compiler::hoist_invariants(for_node* n, effects const& loop) {
+    std::vector<node*> found;
+    find_invariants(n->body.get(), loop, found);
+
+    // the same expression written twice shares a slot
+    std::unordered_map<std::string, u16> slots;
+    for (auto* it: found) {
+      auto key = it->pretty(0);
+      auto slot = slots.find(key);
+      if (slot != slots.end()) {
+        hoisted.emplace(it, slot->second);
+        continue;
+      }
+
+      cur_ch().add(op_code::key_nil);
+      ami_discard(add_local("@licm" + std::to_string(slots.size())));
+      auto local = u16(locals.size() - 1);
+      slots.emplace(key, local);
+      hoisted.emplace(it, local);
+    }
+
+    return found;
+  }
+}
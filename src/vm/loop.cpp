@@ -0,0 +1,704 @@
+#include "loop.h"
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+
+#ifdef __linux__
+#include <condition_variable>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace tosuto::vm {
+  namespace {
+    using clock = std::chrono::steady_clock;
+
+    std::optional<std::string> read_whole(std::string const& path) {
+      std::ifstream in(path, std::ios::binary);
+      if (!in) return std::nullopt;
+
+      std::stringstream out;
+      out << in.rdbuf();
+      return std::move(out).str();
+    }
+
+    // what i/o hands scripts, interning it would keep every payload forever
+    value bytes_of(std::string data) {
+      return value{std::make_shared<std::string const>(std::move(data))};
+    }
+
+#ifdef __linux__
+    // fds the tcp_* natives made and haven't closed, with the loops that
+    // have each registered with their epoll. scripts pass sockets around as
+    // numbers, across vms too, so anything else they name could be stdin or
+    // some loop's own epoll fd. never destroyed, loops forget their fds
+    // here on the way out
+    struct socket_registry {
+      std::mutex mutex;
+      std::unordered_map<int, std::unordered_set<event_loop*>> fds;
+    };
+
+    socket_registry& sockets() {
+      static auto* it = new socket_registry;
+      return *it;
+    }
+#endif
+  }
+
+  struct event_loop {
+    struct timer {
+      clock::time_point at;
+      // keeps timers with the same deadline in order
+      u64 seq;
+      value::coro co;
+
+      bool operator>(timer const& other) const {
+        return std::tie(at, seq) > std::tie(other.at, other.seq);
+      }
+    };
+
+    std::deque<wakeup> ready;
+    std::priority_queue<timer, std::vector<timer>, std::greater<>> timers;
+    u64 next_seq = 0;
+
+#ifdef __linux__
+    // tries an operation again once its fd is ready, nullopt while it'd
+    // still block
+    using attempt_fn =
+      std::function<std::expected<std::optional<value>, std::string>()>;
+
+    struct fd_wait {
+      value::coro co;
+      u32 events;
+      attempt_fn attempt;
+    };
+
+    struct file_read {
+      std::string path;
+      value::coro co;
+      std::optional<std::string> contents;
+    };
+
+    int epoll_fd = -1;
+    std::unordered_map<int, fd_wait> waits;
+    // fds that just run something whenever they're readable, see
+    // on_readable
+    std::unordered_map<int, std::function<void()>> handlers;
+    // fds epoll knows about, they stay registered between waits
+    std::unordered_set<int> watched;
+
+    // the reader bumps done_fd when it finished some reads, close_socket
+    // when it closed something this loop watched
+    std::thread reader;
+    int done_fd = -1;
+    std::mutex reads_mutex;
+    std::condition_variable reads_queued;
+    std::deque<file_read> queued_reads;
+    std::vector<file_read> finished_reads;
+    bool stopping = false;
+    // only touched by the loop's thread
+    size_t pending_reads = 0;
+    // sockets closed since the loop last looked, by any vm. their numbers
+    // may already be reused, so they're only dropped from watched and waits
+    std::mutex closed_mutex;
+    std::vector<int> closed;
+
+    event_loop() {
+      epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      epoll_event ev{};
+      ev.events = EPOLLIN;
+      ev.data.fd = done_fd;
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_fd, &ev);
+    }
+
+    ~event_loop() {
+      {
+        auto& reg = sockets();
+        std::scoped_lock lock{reg.mutex};
+        for (int fd: watched) {
+          if (auto it = reg.fds.find(fd); it != reg.fds.end()) it->second.erase(this);
+        }
+      }
+
+      if (reader.joinable()) {
+        {
+          std::scoped_lock lock{reads_mutex};
+          stopping = true;
+        }
+        reads_queued.notify_all();
+        reader.join();
+      }
+      close(done_fd);
+      close(epoll_fd);
+    }
+
+    std::expected<void, std::string>
+    watch(int fd, u32 events, value::coro co, attempt_fn attempt) {
+      // a stale entry for a reused number would make this a MOD
+      drop_closed();
+      if (waits.contains(fd)) {
+        return std::unexpected{
+          "Something's already waiting on socket " + std::to_string(fd)};
+      }
+
+      epoll_event ev{};
+      ev.events = events | EPOLLONESHOT;
+      ev.data.fd = fd;
+      auto op = watched.contains(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+      if (epoll_ctl(epoll_fd, op, fd, &ev) != 0) {
+        return std::unexpected{
+          "Can't wait on socket " + std::to_string(fd) + ": "
+          + std::strerror(errno)};
+      }
+
+      if (watched.insert(fd).second) {
+        auto& reg = sockets();
+        std::scoped_lock lock{reg.mutex};
+        if (auto it = reg.fds.find(fd); it != reg.fds.end()) it->second.insert(this);
+      }
+      waits.emplace(fd, fd_wait{std::move(co), events, std::move(attempt)});
+      return {};
+    }
+
+    std::expected<void, std::string> forget(int fd) {
+      if (waits.contains(fd)) {
+        return std::unexpected{
+          "Can't close socket " + std::to_string(fd)
+          + " while something's waiting on it!"};
+      }
+
+      if (watched.erase(fd)) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        auto& reg = sockets();
+        std::scoped_lock lock{reg.mutex};
+        if (auto it = reg.fds.find(fd); it != reg.fds.end()) it->second.erase(this);
+      }
+      return {};
+    }
+
+    // the kernel already took closed fds out of epoll, whatever still
+    // waited on one fails
+    void drop_closed() {
+      std::vector<int> fds;
+      {
+        std::scoped_lock lock{closed_mutex};
+        fds.swap(closed);
+      }
+
+      for (int fd: fds) {
+        watched.erase(fd);
+        auto it = waits.find(fd);
+        if (it == waits.end()) continue;
+
+        ready.push_back({std::move(it->second.co), value{value::nil{}},
+                         "Socket " + std::to_string(fd) + " was closed!"});
+        waits.erase(it);
+      }
+    }
+
+    void read(std::string path, value::coro co) {
+      if (!reader.joinable()) reader = std::thread{[this] { read_files(); }};
+
+      {
+        std::scoped_lock lock{reads_mutex};
+        queued_reads.push_back({std::move(path), std::move(co), std::nullopt});
+      }
+      pending_reads++;
+      reads_queued.notify_one();
+    }
+
+    // the read being done stays queued, so its coroutine is always
+    // somewhere the gc can find it
+    void read_files() {
+      for (;;) {
+        std::string path;
+        {
+          std::unique_lock lock{reads_mutex};
+          reads_queued.wait(lock, [this] {
+            return stopping || !queued_reads.empty();
+          });
+          if (stopping) return;
+
+          path = queued_reads.front().path;
+        }
+
+        auto contents = read_whole(path);
+        {
+          std::scoped_lock lock{reads_mutex};
+          auto it = std::move(queued_reads.front());
+          queued_reads.pop_front();
+          it.contents = std::move(contents);
+          finished_reads.push_back(std::move(it));
+        }
+        u64 one = 1;
+        ::write(done_fd, &one, sizeof(one));
+      }
+    }
+
+    // a failed read only fails the coroutine waiting on it
+    void finish_reads() {
+      u64 count;
+      ::read(done_fd, &count, sizeof(count));
+
+      std::vector<file_read> finished;
+      {
+        std::scoped_lock lock{reads_mutex};
+        finished.swap(finished_reads);
+      }
+
+      for (auto& it: finished) {
+        pending_reads--;
+        if (!it.contents) {
+          ready.push_back({std::move(it.co), value{value::nil{}},
+                           "Couldn't read " + it.path});
+          continue;
+        }
+        ready.push_back({std::move(it.co), bytes_of(std::move(*it.contents))});
+      }
+    }
+
+    std::expected<void, std::string> poll(int timeout) {
+      epoll_event events[64];
+      int count = epoll_wait(epoll_fd, events, std::size(events), timeout);
+      if (count < 0) {
+        if (errno == EINTR) return {};
+        return std::unexpected{std::string{"epoll_wait failed: "}
+                               + std::strerror(errno)};
+      }
+
+      for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        if (fd == done_fd) {
+          finish_reads();
+          drop_closed();
+          continue;
+        }
+        if (auto it = handlers.find(fd); it != handlers.end()) {
+          it->second();
+          continue;
+        }
+
+        auto it = waits.find(fd);
+        if (it == waits.end()) continue;
+
+        auto res = it->second.attempt();
+        if (!res.has_value()) {
+          ready.push_back({std::move(it->second.co), value{value::nil{}},
+                           std::move(res.error())});
+          waits.erase(it);
+          continue;
+        }
+        if (!*res) {
+          // woken up for nothing, wait for the next one
+          epoll_event ev{};
+          ev.events = it->second.events | EPOLLONESHOT;
+          ev.data.fd = fd;
+          epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+          continue;
+        }
+
+        ready.push_back({std::move(it->second.co), std::move(**res)});
+        waits.erase(it);
+      }
+
+      return {};
+    }
+#endif
+  };
+
+  namespace {
+    event_loop& loop_of(vm& vm) {
+      if (!vm.loop) vm.loop = std::make_shared<event_loop>();
+      return *vm.loop;
+    }
+
+    // the coroutine the calling native can park, if the loop is running it
+    value::coro parkable(vm& vm) {
+      if (vm.coros.empty() || !vm.coros.back().from_loop) return nullptr;
+      return vm.coros.back().co;
+    }
+
+#ifdef __linux__
+    value add_socket(int fd) {
+      auto& reg = sockets();
+      std::scoped_lock lock{reg.mutex};
+      reg.fds.emplace(fd, std::unordered_set<event_loop*>{});
+      return value{double(fd)};
+    }
+
+    // closes a socket the tcp_* natives made. every loop that watched it
+    // drops it the next time it looks, see drop_closed
+    std::expected<void, std::string> close_socket(int fd) {
+      auto& reg = sockets();
+      std::scoped_lock lock{reg.mutex};
+      auto it = reg.fds.find(fd);
+      // someone else closed it in the meantime
+      if (it == reg.fds.end()) {
+        return std::unexpected{"Socket " + std::to_string(fd) + " is closed!"};
+      }
+
+      for (auto* loop: it->second) {
+        {
+          std::scoped_lock closed_lock{loop->closed_mutex};
+          loop->closed.push_back(fd);
+        }
+        u64 one = 1;
+        ::write(loop->done_fd, &one, sizeof(one));
+      }
+      reg.fds.erase(it);
+      close(fd);
+      return {};
+    }
+
+    std::expected<int, std::string>
+    socket_arg(value const& val, std::string const& fn) {
+      auto error = fn + "() needs a socket, got " + val.to_string();
+      if (!val.is<value::num>()) return std::unexpected{error};
+
+      auto num = val.get<value::num>();
+      auto& reg = sockets();
+      std::scoped_lock lock{reg.mutex};
+      if (num != std::floor(num) || !reg.fds.contains(int(num))) {
+        return std::unexpected{error};
+      }
+      return int(num);
+    }
+
+    std::string error_text(std::string const& what) {
+      return what + ": " + std::strerror(errno);
+    }
+
+    bool would_block() {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    sockaddr_in loopback(value const& port) {
+      sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(u16(port.get<value::num>()));
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      return addr;
+    }
+
+    // runs attempt once fd is ready. a coroutine the loop runs is parked
+    // until then, anything else blocks in poll
+    std::expected<value, std::string>
+    when_ready(int fd, u32 events, event_loop::attempt_fn attempt) {
+      auto& vm = *vm::current;
+      if (auto co = parkable(vm)) {
+        ami_discard(loop_of(vm).watch(fd, events, co, std::move(attempt)));
+        vm.park = true;
+        return value{value::nil{}};
+      }
+
+      for (;;) {
+        pollfd it{fd, short(events), 0};
+        if (::poll(&it, 1, -1) < 0 && errno != EINTR) {
+          return std::unexpected{error_text("poll failed")};
+        }
+
+        auto res = ami_unwrap(attempt());
+        if (res) return std::move(*res);
+      }
+    }
+
+    // tries right away and only waits if that would block
+    std::expected<value, std::string>
+    try_or_wait(int fd, u32 events, event_loop::attempt_fn attempt) {
+      auto res = ami_unwrap(attempt());
+      if (res) return std::move(*res);
+      return when_ready(fd, events, std::move(attempt));
+    }
+#endif
+  }
+
+  std::expected<std::optional<wakeup>, std::string> next_wakeup(vm& vm) {
+    auto& loop = loop_of(vm);
+    for (;;) {
+      if (!loop.ready.empty()) {
+        auto it = std::move(loop.ready.front());
+        loop.ready.pop_front();
+        return it;
+      }
+
+      auto now = clock::now();
+      if (!loop.timers.empty() && loop.timers.top().at <= now) {
+        loop.ready.push_back({loop.timers.top().co, value{value::nil{}}});
+        loop.timers.pop();
+        continue;
+      }
+
+#ifdef __linux__
+      if (loop.timers.empty() && loop.waits.empty() && loop.pending_reads == 0) {
+        return std::nullopt;
+      }
+
+      int timeout = -1;
+      if (!loop.timers.empty()) {
+        using namespace std::chrono;
+        timeout = int(ceil<milliseconds>(loop.timers.top().at - now).count());
+      }
+      ami_discard(loop.poll(timeout));
+#else
+      if (loop.timers.empty()) return std::nullopt;
+      std::this_thread::sleep_until(loop.timers.top().at);
+#endif
+    }
+  }
+
+  void schedule(vm& vm, value::coro co, value sent) {
+    loop_of(vm).ready.push_back({std::move(co), std::move(sent)});
+  }
+
+#ifdef __linux__
+  std::expected<void, std::string>
+  on_readable(vm& vm, int fd, std::function<void()> handler) {
+    auto& loop = loop_of(vm);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      return std::unexpected{error_text("Can't watch " + std::to_string(fd))};
+    }
+
+    loop.handlers.emplace(fd, std::move(handler));
+    return {};
+  }
+#endif
+
+  void trace_loop(vm& vm, std::function<void(value const&)> const& visit) {
+    if (!vm.loop) return;
+
+    auto& loop = *vm.loop;
+    for (auto const& it: loop.ready) {
+      visit(value{it.co});
+      visit(it.sent);
+    }
+    // no way to look into a priority_queue but popping
+    auto timers = loop.timers;
+    for (; !timers.empty(); timers.pop()) visit(value{timers.top().co});
+#ifdef __linux__
+    for (auto const& [fd, it]: loop.waits) visit(value{it.co});
+
+    std::scoped_lock lock{loop.reads_mutex};
+    for (auto const& it: loop.queued_reads) visit(value{it.co});
+    for (auto const& it: loop.finished_reads) visit(value{it.co});
+#endif
+  }
+
+  std::expected<value, std::string> go(std::span<value> args) {
+    value::coro co;
+    if (args[0].is<value::function>() &&
+        args[0].get<value::function>().desc->arity == 0) {
+      co = std::make_shared<coroutine>();
+      co->fn = args[0].get<value::function>();
+    } else if (args[0].is<value::coro>()) {
+      co = args[0].get<value::coro>();
+      if (co->state != coroutine::status::fresh &&
+          co->state != coroutine::status::suspended) {
+        return std::unexpected{"Can't go " + args[0].to_string()};
+      }
+    } else {
+      return std::unexpected{
+        "go() needs a function without arguments or a coroutine!"};
+    }
+
+    co->state = coroutine::status::waiting;
+    schedule(*vm::current, co, value{value::nil{}});
+    return value{co};
+  }
+
+  std::expected<value, std::string> run_loop(std::span<value> args) {
+    return std::unexpected{"Can't run the event loop from here!"};
+  }
+
+  std::expected<value, std::string> sleep(std::span<value> args) {
+    if (!args[0].is<value::num>()) {
+      return std::unexpected{"sleep() needs a number of milliseconds!"};
+    }
+
+    std::chrono::duration<double, std::milli> time{args[0].get<value::num>()};
+    auto& vm = *vm::current;
+    if (auto co = parkable(vm)) {
+      auto& loop = loop_of(vm);
+      auto at = clock::now() + std::chrono::duration_cast<clock::duration>(time);
+      loop.timers.push({at, loop.next_seq++, co});
+      vm.park = true;
+      return value{value::nil{}};
+    }
+
+    std::this_thread::sleep_for(time);
+    return value{value::nil{}};
+  }
+
+  std::expected<value, std::string> read_file_async(std::span<value> args) {
+    if (!args[0].is<value::str>()) {
+      return std::unexpected{"read_file_async() needs a path!"};
+    }
+
+    std::string const& path = args[0].get<value::str>();
+#ifdef __linux__
+    auto& vm = *vm::current;
+    if (auto co = parkable(vm)) {
+      loop_of(vm).read(path, co);
+      vm.park = true;
+      return value{value::nil{}};
+    }
+#endif
+
+    auto contents = read_whole(path);
+    if (!contents) return std::unexpected{"Couldn't read " + path};
+    return bytes_of(std::move(*contents));
+  }
+
+#ifdef __linux__
+  std::expected<value, std::string> tcp_listen(std::span<value> args) {
+    if (!args[0].is<value::num>()) {
+      return std::unexpected{"tcp_listen() needs a port!"};
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return std::unexpected{error_text("Couldn't make a socket")};
+
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    auto addr = loopback(args[0]);
+    if (bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+      auto err = error_text("Couldn't listen on " + args[0].to_string());
+      close(fd);
+      return std::unexpected{err};
+    }
+
+    return add_socket(fd);
+  }
+
+  std::expected<value, std::string> tcp_accept(std::span<value> args) {
+    auto fd = ami_unwrap(socket_arg(args[0], "tcp_accept"));
+    return try_or_wait(fd, EPOLLIN, [fd]()
+      -> std::expected<std::optional<value>, std::string> {
+      int conn = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (conn >= 0) return add_socket(conn);
+      if (would_block()) return std::nullopt;
+      return std::unexpected{error_text("Couldn't accept")};
+    });
+  }
+
+  std::expected<value, std::string> tcp_connect(std::span<value> args) {
+    if (!args[0].is<value::num>()) {
+      return std::unexpected{"tcp_connect() needs a port!"};
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return std::unexpected{error_text("Couldn't make a socket")};
+
+    // registered right away, so a failed connect closes it like any other
+    auto sock = add_socket(fd);
+    auto addr = loopback(args[0]);
+    if (connect(fd, (sockaddr*) &addr, sizeof(addr)) == 0) return sock;
+    if (errno != EINPROGRESS) {
+      auto err = error_text("Couldn't connect to " + args[0].to_string());
+      ami_discard(close_socket(fd));
+      return std::unexpected{err};
+    }
+
+    // writable once the connection went through or failed
+    return when_ready(fd, EPOLLOUT, [fd, sock]()
+      -> std::expected<std::optional<value>, std::string> {
+      int err = 0;
+      socklen_t size = sizeof(err);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &size);
+      if (err == 0) return sock;
+
+      ami_discard(close_socket(fd));
+      return std::unexpected{
+        std::string{"Couldn't connect: "} + std::strerror(err)};
+    });
+  }
+
+  std::expected<value, std::string> tcp_recv(std::span<value> args) {
+    auto fd = ami_unwrap(socket_arg(args[0], "tcp_recv"));
+    return try_or_wait(fd, EPOLLIN, [fd]()
+      -> std::expected<std::optional<value>, std::string> {
+      char buf[1 << 16];
+      auto size = recv(fd, buf, sizeof(buf), 0);
+      if (size >= 0) return bytes_of(std::string(buf, size));
+      if (would_block()) return std::nullopt;
+      return std::unexpected{error_text("Couldn't receive")};
+    });
+  }
+
+  std::expected<value, std::string> tcp_send(std::span<value> args) {
+    auto fd = ami_unwrap(socket_arg(args[0], "tcp_send"));
+    if (!args[1].text()) {
+      return std::unexpected{"tcp_send() needs a string!"};
+    }
+
+    // the payload is held on to while the wait's parked, interned strings
+    // and bytes never move, so only how much went out has to be kept
+    auto sent = std::make_shared<size_t>(0);
+    return try_or_wait(fd, EPOLLOUT, [fd, payload = args[1], sent]()
+      -> std::expected<std::optional<value>, std::string> {
+      auto const& data = *payload.text();
+      while (*sent < data.size()) {
+        auto size = send(fd, data.data() + *sent, data.size() - *sent,
+                         MSG_NOSIGNAL);
+        if (size < 0) {
+          if (would_block()) return std::nullopt;
+          return std::unexpected{error_text("Couldn't send")};
+        }
+        *sent += size;
+      }
+      return value{double(data.size())};
+    });
+  }
+
+  std::expected<value, std::string> tcp_close(std::span<value> args) {
+    auto fd = ami_unwrap(socket_arg(args[0], "tcp_close"));
+    auto& vm = *vm::current;
+    if (vm.loop) {
+      ami_discard(vm.loop->forget(fd));
+    }
+
+    ami_discard(close_socket(fd));
+    return value{value::nil{}};
+  }
+#else
+  std::expected<value, std::string> tcp_listen(std::span<value> args) {
+    return std::unexpected{"Sockets need linux for now!"};
+  }
+
+  std::expected<value, std::string> tcp_accept(std::span<value> args) {
+    return std::unexpected{"Sockets need linux for now!"};
+  }
+
+  std::expected<value, std::string> tcp_connect(std::span<value> args) {
+    return std::unexpected{"Sockets need linux for now!"};
+  }
+
+  std::expected<value, std::string> tcp_recv(std::span<value> args) {
+    return std::unexpected{"Sockets need linux for now!"};
+  }
+
+  std::expected<value, std::string> tcp_send(std::span<value> args) {
+    return std::unexpected{"Sockets need linux for now!"};
+  }
+
+  std::expected<value, std::string> tcp_close(std::span<value> args) {
+    return std::unexpected{"Sockets need linux for now!"};
+  }
+#endif
+}
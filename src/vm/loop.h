@@ -0,0 +1,72 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include "vm.h"
+
+namespace tosuto::vm {
+  // an event loop for i/o. `go(f)` queues a function without arguments (or
+  // a coroutine) on the vm's loop and `run_loop()` runs what's queued until
+  // nothing's left to wait for. natives like sleep, read_file_async and the
+  // tcp_* ones park a coroutine the loop runs until their i/o is done and
+  // evaluate to its result once it carries on, so one vm overlaps any
+  // number of waits. called from anywhere else they just block.
+  //
+  // waits on sockets and timers go through epoll, file reads through a
+  // thread since epoll says regular files are always ready. the vm resumes
+  // what the loop hands back itself, see vm::run. outside of linux there's
+  // only the queue and timers, everything else blocks.
+
+  // what the loop has ready next and what its wait evaluates to, or the
+  // error the call that parked it fails with once it carries on
+  struct wakeup {
+    value::coro co;
+    value sent;
+    std::optional<std::string> error = std::nullopt;
+  };
+
+  // blocks until some coroutine can carry on, nullopt once nothing's queued
+  // or waiting
+  std::expected<std::optional<wakeup>, std::string> next_wakeup(vm& vm);
+
+  // queues co to carry on with sent, for coroutines that just yielded
+  void schedule(vm& vm, value::coro co, value sent);
+
+#ifdef __linux__
+  // runs handler on the loop's thread whenever fd is readable, for as long
+  // as the loop's around. unlike waits these don't keep run_loop() going
+  std::expected<void, std::string>
+  on_readable(vm& vm, int fd, std::function<void()> handler);
+#endif
+
+  // calls visit with everything the loop holds on to, see gc.h
+  void trace_loop(vm& vm, std::function<void(value const&)> const& visit);
+
+  std::expected<value, std::string> go(std::span<value> args);
+
+  // the vm handles calls to this itself, like resume
+  std::expected<value, std::string> run_loop(std::span<value> args);
+
+  std::expected<value, std::string> sleep(std::span<value> args);
+
+  // the file's contents as bytes, like tcp_recv's
+  std::expected<value, std::string> read_file_async(std::span<value> args);
+
+  // loopback only, sockets are numbers like task handles. the tcp_* natives
+  // only take ones they made themselves and haven't closed yet
+  std::expected<value, std::string> tcp_listen(std::span<value> args);
+
+  std::expected<value, std::string> tcp_accept(std::span<value> args);
+
+  std::expected<value, std::string> tcp_connect(std::span<value> args);
+
+  // bytes with whatever arrived, empty once the other end closed. bytes
+  // print, compare and concatenate like strings but aren't interned, see
+  // value::bytes
+  std::expected<value, std::string> tcp_recv(std::span<value> args);
+
+  // evaluates to the number of bytes once all of them went out
+  std::expected<value, std::string> tcp_send(std::span<value> args);
+
+  std::expected<value, std::string> tcp_close(std::span<value> args);
+}
@@ -0,0 +1,150 @@
+#include "modules.h"
+
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include "cache.h"
+#include "compile.h"
+#include "tasks.h"
+#include "../lex.h"
+
+namespace tosuto::vm {
+  namespace {
+    struct module {
+      std::once_flag once;
+      std::expected<value::function, std::string> fn;
+      // what it imports, unknown when it came from the cache
+      std::vector<std::string> imports;
+    };
+
+    struct registry {
+      std::mutex mutex;
+      // by normalized path
+      std::unordered_map<std::string, std::shared_ptr<module>> modules;
+    };
+
+    registry& modules() {
+      static registry it;
+      return it;
+    }
+
+    // the same file, however it's spelled
+    std::string normalize(std::string const& path) {
+      return std::filesystem::absolute(path).lexically_normal().string();
+    }
+
+    std::expected<value::function, std::string>
+    compile_module(std::string const& path, std::vector<std::string>& imports) {
+      std::stringstream src;
+      if (!(src << std::ifstream(path).rdbuf())) {
+        return std::unexpected{"Can't read " + path};
+      }
+
+      auto hash = fnv1a(src.str());
+      auto cache = cache_path(path);
+      if (auto cached = read_cache(cache, hash)) return *cached;
+
+      std::vector<token> toks;
+      try {
+        toks = lexer{to_utf32(src.str()), 1}.lex();
+      } catch (std::runtime_error const& err) {
+        return std::unexpected{err.what()};
+      }
+
+      auto ast = ami_unwrap(parser{std::move(toks)}.global());
+      compiler comp{value::function::type::script};
+      comp.module = true;
+      auto fn = ami_unwrap(comp.global(ast.get()));
+      ami_discard(compile_all(fn, ast.get()));
+      // it runs as a call from the importer
+      fn.desc->arity = 0;
+      imports = imports_of(ast.get());
+
+      auto written = write_cache(cache, hash, fn);
+      if (!written.has_value()) std::cerr << written.error() << '\n';
+      return fn;
+    }
+
+    // compiles it the first time, whoever asks
+    std::shared_ptr<module> load(std::string const& path) {
+      std::shared_ptr<module> it;
+      {
+        auto& reg = modules();
+        std::scoped_lock lock{reg.mutex};
+        auto& slot = reg.modules[path];
+        if (!slot) slot = std::make_shared<module>();
+        it = slot;
+      }
+
+      std::call_once(it->once, [&] { it->fn = compile_module(path, it->imports); });
+      return it;
+    }
+
+    struct prefetch {
+      std::mutex mutex;
+      std::unordered_set<std::string> claimed;
+      std::atomic<size_t> pending = 0;
+    };
+
+    // queues a job for every path nobody claimed yet, so cycles end
+    void fetch(prefetch& jobs, std::vector<std::string> const& paths) {
+      for (auto const& path: paths) {
+        auto full = normalize(path);
+        {
+          std::scoped_lock lock{jobs.mutex};
+          if (!jobs.claimed.emplace(full).second) continue;
+        }
+
+        jobs.pending++;
+        post([&jobs, full = std::move(full)] {
+          fetch(jobs, load(full)->imports);
+          jobs.pending--;
+          jobs.pending.notify_all();
+        });
+      }
+    }
+
+    std::expected<value, std::string> nothing(std::span<value> args) {
+      return value{value::nil{}};
+    }
+  }
+
+  std::vector<std::string> imports_of(node* ast) {
+    std::vector<std::string> out;
+    std::function<void(node*)> walk = [&](node* n) {
+      if (n->type == node_type::import_stmt) {
+        out.push_back(static_cast<import_node*>(n)->path);
+      }
+      for_each_child(n, walk);
+    };
+    walk(ast);
+    return out;
+  }
+
+  void load_modules(std::vector<std::string> const& paths) {
+    prefetch jobs;
+    fetch(jobs, paths);
+    for (auto left = jobs.pending.load(); left > 0; left = jobs.pending.load()) {
+      if (!help()) jobs.pending.wait(left);
+    }
+  }
+
+  std::expected<value, std::string> import(std::span<value> args) {
+    if (!args[0].is<value::str>()) {
+      return std::unexpected{"import needs a path!"};
+    }
+
+    std::string path{args[0].get<value::str>()};
+    auto full = normalize(path);
+    if (!vm::current->imported.insert(full).second) {
+      return value{std::make_pair(&nothing, u8(0))};
+    }
+
+    auto it = load(full);
+    if (!it->fn.has_value()) {
+      return std::unexpected{"Can't import " + path + ": " + it->fn.error()};
+    }
+    return value{*it->fn};
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "vm.h"
+#include "../parse.h"
+
+namespace tosuto::vm {
+  // modules. `import "lib.tosuto"` runs another file's top level the first
+  // time a vm gets to it and does nothing after that, so what it defines
+  // ends up in the same globals as the importer's and cycles just stop
+  // where they close. paths are relative to the working directory.
+  //
+  // a module is compiled once per process, whole, and shared by every vm
+  // that imports it, and its bytecode goes to a .tsc next to it like the
+  // script's, see cache.h. imports reachable from the script's AST are
+  // loaded up front, independent ones in parallel on the task pool, the
+  // rest whenever a vm first gets to them.
+  //
+  // since any module can assign any global, the compiler gives up on what
+  // it would otherwise prove about globals in programs that import, and
+  // in modules themselves.
+
+  // paths of the imports in ast, which has to be parsed all the way
+  std::vector<std::string> imports_of(node* ast);
+
+  // compiles the modules at paths and what they import, in parallel, ahead
+  // of any vm getting to them. errors wait for the import that runs into
+  // them, so a module that's never reached can't fail the script
+  void load_modules(std::vector<std::string> const& paths);
+
+  // what `import` compiles to, see compiler::import
+  std::expected<value, std::string> import(std::span<value> args);
+}
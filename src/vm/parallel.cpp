@@ -0,0 +1,345 @@
+#include "compile.h"
+
+#include <algorithm>
+
+namespace tosuto::vm {
+  // `@parallel for i : a..b { .. }` splits the range into chunks that run on
+  // the task pool, see parallel_for in tasks.h. the body has to be safe to
+  // run out of order: it may write locals it defines, `xs[i] = ..` with i the
+  // counter into arrays it only reads as `xs[i]`, arrays or objects it made
+  // itself, and `s += ..` or `s *= ..` into outer variables neither it nor
+  // anything it calls reads otherwise. it can only call functions defined
+  // once and never reassigned whose bodies write nothing but their own
+  // locals. anything else, natives included, compiles to a plain loop.
+  // names can alias, `ys := xs` makes reading ys a read of what's written,
+  // so the loop also hands over the arrays it writes and what it reads
+  // through names, locals as values and globals by name. @parallel_for runs
+  // it in order if anything read reaches a written array.
+  //
+  //   @parallel for i : a..b { xs[i] = ys[i] + s }
+  //
+  // becomes
+  //
+  //   {
+  //     @r := @parallel_for(: @lo @hi @seed {
+  //       s := @seed[0]
+  //       for i : @lo..@hi { body }
+  //       ret [s]
+  //     }, a, b, [s], "+", [], [], ["xs"], ["ys"])
+  //     s = @r[0]
+  //   }
+  //
+  // with xs and ys globals, locals would go in the arrays before them.
+
+  namespace {
+    bool is_literal(node* n) {
+      return n->type == node_type::array || n->type == node_type::sized_array ||
+             n->type == node_type::object;
+    }
+
+    // the name if n is a bare one, empty otherwise
+    std::string bare_name(node* n) {
+      if (n->type != node_type::field_get) return "";
+      auto it = static_cast<field_get_node*>(n);
+      return it->target ? "" : it->field;
+    }
+
+    struct checker {
+      compiler& comp;
+      compiler::effects const& program;
+      // the loop counter, empty when checking a called function
+      std::string counter;
+      // functions already checked, or being checked further up, and the
+      // names each reads, including through what it calls
+      std::unordered_map<fn_def_node*, std::unordered_set<std::string>>& checked;
+
+      std::unordered_set<std::string> own{}, fresh{}, assigned{}, reads{}, written{};
+      std::vector<std::pair<std::string, tok_type>> reductions{};
+      // loops nested in the checked code, next and break are fine in those
+      u32 loops = 0;
+      bool ok = true;
+
+      void check(node* body) {
+        compiler::effects effects;
+        compiler::collect_effects(body, effects);
+        assigned = std::move(effects.assigned);
+        walk(body);
+
+        for (auto const& [name, op]: reductions) {
+          if (reads.contains(name) || written.contains(name)) ok = false;
+        }
+        for (auto const& name: written) {
+          if (reads.contains(name)) ok = false;
+        }
+      }
+
+      void walk(node* n) {
+        if (!ok) return;
+
+        switch (n->type) {
+          case node_type::fn_def:
+          case node_type::anon_fn_def:
+          case node_type::decorated:
+          case node_type::member_call:
+          case node_type::yield: ok = false;
+            return;
+          case node_type::ret: {
+            if (!counter.empty()) ok = false;
+            break;
+          }
+          case node_type::next:
+          case node_type::brk: {
+            if (!counter.empty() && loops == 0) ok = false;
+            break;
+          }
+          case node_type::var_def: {
+            auto it = static_cast<var_def_node*>(n);
+            walk(it->value.get());
+            own.emplace(it->name);
+            if (is_literal(it->value.get()) && !assigned.contains(it->name)) {
+              fresh.emplace(it->name);
+            }
+            return;
+          }
+          case node_type::for_loop: {
+            auto it = static_cast<for_node*>(n);
+            walk(it->iterable.get());
+            own.emplace(it->id);
+            loops++;
+            walk(it->body.get());
+            loops--;
+            return;
+          }
+          case node_type::field_get: {
+            auto it = static_cast<field_get_node*>(n);
+            if (it->target) break;
+
+            if (!own.contains(it->field)) {
+              reads.emplace(it->field);
+              // those don't exist as values, the closure couldn't see them
+              if (comp.scalar_locals.contains(it->field)) ok = false;
+            }
+            return;
+          }
+          case node_type::call: {
+            auto it = static_cast<call_node*>(n);
+            if (!pure_callee(it->callee.get())) {
+              ok = false;
+              return;
+            }
+
+            for (auto const& arg: it->args) walk(arg.get());
+            return;
+          }
+          case node_type::bin_op: {
+            auto it = static_cast<bin_op_node*>(n);
+            if (it->op == tok_type::assign) {
+              assign(it);
+              return;
+            }
+
+            // xs[i], which is the only way to read what's written
+            if (it->op == tok_type::l_square && !counter.empty() &&
+                bare_name(it->rhs.get()) == counter) {
+              auto name = bare_name(it->lhs.get());
+              if (!name.empty() && !own.contains(name)) return;
+            }
+            break;
+          }
+          default:;
+        }
+
+        for_each_child(n, [&](node* child) { walk(child); });
+      }
+
+      void assign(bin_op_node* n) {
+        auto name = bare_name(n->lhs.get());
+        if (!name.empty()) {
+          if (own.contains(name)) {
+            walk(n->rhs.get());
+            return;
+          }
+
+          // s = s + .., what `s += ..` parses to
+          auto rhs = n->rhs.get();
+          if (!counter.empty() && rhs->type == node_type::bin_op) {
+            auto op = static_cast<bin_op_node*>(rhs);
+            if ((op->op == tok_type::add || op->op == tok_type::mul) &&
+                bare_name(op->lhs.get()) == name) {
+              auto found = std::ranges::find_if(reductions, [&](auto& it) {
+                return it.first == name;
+              });
+              if (found == reductions.end()) {
+                reductions.emplace_back(name, op->op);
+              } else if (found->second != op->op) {
+                ok = false;
+                return;
+              }
+
+              walk(op->rhs.get());
+              return;
+            }
+          }
+
+          ok = false;
+          return;
+        }
+
+        if (n->lhs->type == node_type::bin_op) {
+          auto idx = static_cast<bin_op_node*>(n->lhs.get());
+          auto target = bare_name(idx->lhs.get());
+          if (idx->op == tok_type::l_square && !target.empty()) {
+            if (fresh.contains(target)) {
+              walk(idx->rhs.get());
+              walk(n->rhs.get());
+              return;
+            }
+
+            if (!counter.empty() && !own.contains(target) &&
+                bare_name(idx->rhs.get()) == counter) {
+              written.emplace(target);
+              walk(n->rhs.get());
+              return;
+            }
+          }
+
+          ok = false;
+          return;
+        }
+
+        auto prop = static_cast<field_get_node*>(n->lhs.get());
+        if (prop->target && fresh.contains(bare_name(prop->target.get()))) {
+          walk(n->rhs.get());
+          return;
+        }
+
+        ok = false;
+      }
+
+      bool pure_callee(node* callee) {
+        auto name = bare_name(callee);
+        if (name.empty() || own.contains(name) || comp.is_lexical(name) ||
+            program.assigned.contains(name)) {
+          return false;
+        }
+
+        auto found = program.fns.find(name);
+        if (found == program.fns.end() || !found->second) return false;
+
+        // what the callee reads counts as read by the loop, so it can't read
+        // a reduction or anything the loop writes. a function being checked
+        // further up adds its reads once that finishes
+        auto fn = found->second;
+        auto [known, first] = checked.try_emplace(fn);
+        if (!first) {
+          reads.insert(known->second.begin(), known->second.end());
+          return true;
+        }
+        if (!fn->parse_body().has_value()) return false;
+
+        checker inner{comp, program, "", checked};
+        for (auto const& arg: fn->args) inner.own.emplace(arg.first);
+        inner.check(fn->body.get());
+        // the callee reads globals, which the loop hands over by name. a
+        // local of the loop's with the same name would be the wrong value
+        for (auto const& name: inner.reads) {
+          if (comp.is_lexical(name)) return false;
+        }
+        reads.insert(inner.reads.begin(), inner.reads.end());
+        checked[fn] = std::move(inner.reads);
+        return inner.ok;
+      }
+    };
+  }
+
+  bool compiler::is_lexical(std::string const& name) {
+    if (resolve_local(name)) return true;
+    if (enclosing) return enclosing->is_lexical(name);
+    return std::ranges::find(upval_names, name) != upval_names.end();
+  }
+
+  std::expected<void, std::string>
+  compiler::parallel_for(decorated_node* decor, for_node* n) {
+    auto deco = ami_dyn_cast(deco_node*, decor->decos.front().get());
+    if (decor->decos.size() != 1 || bare_name(deco->deco.get()) != "parallel" ||
+        !deco->fields.empty()) {
+      return std::unexpected{"Can't decorate a for loop with " + deco->pretty(0)};
+    }
+
+    if (!program_effects || n->iterable->type != node_type::range) {
+      return for_loop(n);
+    }
+
+    std::unordered_map<fn_def_node*, std::unordered_set<std::string>> checked;
+    checker check{*this, *program_effects, n->id, checked};
+    check.check(n->body.get());
+    if (!check.ok) return for_loop(n);
+
+    auto at = pos::synthesized;
+    auto name = [&](std::string const& it) {
+      return std::make_shared<field_get_node>(nullptr, it, at, at);
+    };
+    auto index = [&](std::shared_ptr<node> target, size_t idx) {
+      return std::make_shared<bin_op_node>(
+        std::move(target), std::make_shared<number_node>(double(idx), at, at),
+        tok_type::l_square, at, at);
+    };
+
+    std::vector<std::shared_ptr<node>> chunk_body, seeds, results;
+    std::string ops;
+    for (size_t i = 0; i < check.reductions.size(); i++) {
+      auto const& [var, op] = check.reductions[i];
+      chunk_body.push_back(
+        std::make_shared<var_def_node>(var, "", index(name("@seed"), i), at, at));
+      seeds.push_back(name(var));
+      results.push_back(name(var));
+      ops += op == tok_type::add ? '+' : '*';
+    }
+
+    auto range = std::make_shared<range_node>(name("@lo"), name("@hi"), at, at);
+    chunk_body.push_back(std::make_shared<for_node>(n->id, range, n->body, at, at));
+    chunk_body.push_back(std::make_shared<ret_node>(
+      std::make_shared<array_node>(results, at, at), at, at));
+    auto chunk = std::make_shared<fn_def_node>(
+      "", std::vector<std::pair<std::string, bool>>{
+        {"@lo", false}, {"@hi", false}, {"@seed", false}},
+      std::vector<std::string>{},
+      std::make_shared<block_node>(chunk_body, at, at), false, at, at);
+
+    // locals as values, globals by name since they may not exist yet
+    std::vector<std::shared_ptr<node>> shared[4];
+    auto hand_over = [&](std::unordered_set<std::string> const& names, int idx) {
+      for (auto const& it: names) {
+        if (is_lexical(it)) {
+          shared[idx].push_back(name(it));
+        } else {
+          shared[idx + 2].push_back(std::make_shared<string_node>(it, at, at));
+        }
+      }
+    };
+    hand_over(check.written, 0);
+    hand_over(check.reads, 1);
+
+    auto iter = static_cast<range_node*>(n->iterable.get());
+    auto result = "@" + std::to_string(next_suffix++);
+    std::vector<std::shared_ptr<node>> args{
+      chunk, iter->start, iter->finish,
+      std::make_shared<array_node>(seeds, at, at),
+      std::make_shared<string_node>(ops, at, at)};
+    for (auto& it: shared) {
+      args.push_back(std::make_shared<array_node>(std::move(it), at, at));
+    }
+    std::vector<std::shared_ptr<node>> lowered{
+      std::make_shared<var_def_node>(
+        result, "", std::make_shared<call_node>(name("@parallel_for"), args, at, at),
+        at, at)};
+    for (size_t i = 0; i < check.reductions.size(); i++) {
+      lowered.push_back(std::make_shared<bin_op_node>(
+        name(check.reductions[i].first), index(name(result), i),
+        tok_type::assign, at, at));
+    }
+
+    auto it = std::make_shared<block_node>(lowered, at, at);
+    return block(it.get());
+  }
+}
@@ -0,0 +1,106 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+namespace tosuto::vm {
+  std::atomic<u64> profile_ticks = 0;
+
+  namespace {
+    struct profiler {
+      std::mutex mutex;
+      std::jthread ticker;
+      // ticks before this one belong to an earlier profile
+      std::atomic<u64> started = 0;
+      std::unordered_map<std::string, u64> stacks;
+    };
+
+    profiler& prof() {
+      static profiler it;
+      return it;
+    }
+  }
+
+  void record_sample(vm& vm, u8* const* ips, u8 const* ip) {
+    auto& it = prof();
+    auto now = profile_ticks.load(std::memory_order_relaxed);
+    auto weight = now - std::max(vm.profile_seen,
+                                 it.started.load(std::memory_order_relaxed));
+    vm.profile_seen = now;
+    if (weight == 0) return;
+
+    std::string stack;
+    for (size_t i = 0; i < vm.frames.size(); i++) {
+      auto const& ch = vm.frames[i].fn.desc->chunk;
+      auto at = i + 1 < vm.frames.size() ? ips[i] : ip;
+      if (i > 0) stack += ';';
+      stack += std::string(ch.name);
+      stack += '+';
+      stack += std::to_string(at - ch.data.data());
+    }
+
+    std::scoped_lock lock{it.mutex};
+    it.stacks[stack] += weight;
+  }
+
+  std::expected<value, std::string> profile_start(std::span<value> args) {
+    if (!args[0].is<value::num>() || args[0].get<value::num>() < 1 ||
+        args[0].get<value::num>() > 100000) {
+      return std::unexpected{"profile_start() needs a rate between 1 and 100000 hz!"};
+    }
+
+    auto& it = prof();
+    std::scoped_lock lock{it.mutex};
+    if (it.ticker.joinable()) {
+      return std::unexpected{"Already profiling!"};
+    }
+
+    it.stacks.clear();
+    it.started = profile_ticks.load();
+    // whatever ran before now isn't part of it
+    vm::current->profile_seen = it.started;
+    auto period = std::chrono::duration<double>(1 / args[0].get<value::num>());
+    it.ticker = std::jthread{[period](std::stop_token stop) {
+      auto next = std::chrono::steady_clock::now();
+      while (!stop.stop_requested()) {
+        next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+        std::this_thread::sleep_until(next);
+        profile_ticks.fetch_add(1, std::memory_order_relaxed);
+      }
+    }};
+    return value{value::nil{}};
+  }
+
+  std::expected<value, std::string> profile_stop(std::span<value> args) {
+    if (!args[0].is<value::str>()) {
+      return std::unexpected{"profile_stop() needs a path!"};
+    }
+
+    auto& it = prof();
+    std::vector<std::pair<std::string, u64>> stacks;
+    {
+      std::scoped_lock lock{it.mutex};
+      if (!it.ticker.joinable()) return std::unexpected{"Not profiling!"};
+
+      it.ticker.request_stop();
+      it.ticker.join();
+      stacks.assign(it.stacks.begin(), it.stacks.end());
+      it.stacks.clear();
+    }
+    // ticks from here on aren't this profile's either
+    it.started = profile_ticks.load();
+
+    std::ranges::sort(stacks);
+    std::string path{args[0].get<value::str>()};
+    std::ofstream out{path};
+    u64 total = 0;
+    for (auto const& [stack, count]: stacks) {
+      out << stack << ' ' << count << '\n';
+      total += count;
+    }
+    if (!out) return std::unexpected{"Can't write " + path};
+    return value{double(total)};
+  }
+}
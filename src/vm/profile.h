@@ -0,0 +1,32 @@
+#pragma once
+
+#include <atomic>
+#include "vm.h"
+
+namespace tosuto::vm {
+  // sampling profiler. `profile_start(hz)` starts a thread that ticks hz
+  // times a second and `profile_stop(path)` stops it and writes what it saw
+  // to path as collapsed stacks, one `outer;...;inner count` line each,
+  // which flamegraph.pl and speedscope read as is. every vm on every thread
+  // gets sampled.
+  //
+  // the vm checks for a tick on calls, returns and loop back edges, and
+  // records its frames when there was one, each as the chunk's name and
+  // where its ip is: just past the call for the callers. a sample's weight
+  // is the ticks since the vm's last one, so time spent in a native or in
+  // straight-line code is charged to where the vm next gets to check.
+  // when nothing's profiling the ticks don't move and the check is a load
+  // and a compare that's never taken.
+
+  // bumped by the profiler's thread, see vm::run
+  extern std::atomic<u64> profile_ticks;
+
+  // adds the stack of frames to the profile. ips are where every frame but
+  // the innermost is at, ip where that one is
+  void record_sample(vm& vm, u8* const* ips, u8 const* ip);
+
+  std::expected<value, std::string> profile_start(std::span<value> args);
+
+  // evaluates to the number of samples written
+  std::expected<value, std::string> profile_stop(std::span<value> args);
+}
@@ -0,0 +1,259 @@
+#include "reload.h"
+
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <unordered_set>
+#include "compile.h"
+#include "loop.h"
+#include "../lex.h"
+#include "../parse.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace tosuto::vm {
+  namespace {
+    struct definition {
+      std::string text;
+      size_t row;
+    };
+
+    // cuts src into top-level definitions. one starts on every line that
+    // begins at depth 0, unless it only carries on the last one: closing
+    // brackets, else and elif, or whatever follows a decorator
+    std::vector<definition> split(std::string const& src) {
+      enum class in { code, string, quoted, comment } state = in::code;
+      std::vector<definition> out;
+      size_t begin = 0, begin_row = 1, row = 1;
+      int depth = 0;
+      char line_first = src.empty() ? '\0' : src[0];
+      for (size_t i = 0; i < src.size(); i++) {
+        char ch = src[i];
+        switch (state) {
+          case in::code:
+            if (ch == '"') state = in::string;
+            else if (ch == '`') state = in::quoted;
+            else if (ch == '/' && i + 1 < src.size() && src[i + 1] == '/') {
+              state = in::comment;
+            } else if (ch == '{' || ch == '[' || ch == '(') depth++;
+            else if (ch == '}' || ch == ']' || ch == ')') depth--;
+            break;
+          case in::string:
+            if (ch == '\\') i++;
+            else if (ch == '"') state = in::code;
+            break;
+          case in::quoted:
+            if (ch == '`') state = in::code;
+            break;
+          case in::comment:
+            if (ch == '\n') state = in::code;
+            break;
+        }
+
+        if (i >= src.size() || src[i] != '\n') continue;
+        row++;
+        bool decorator = line_first == '@';
+        line_first = i + 1 < src.size() ? src[i + 1] : '\0';
+        if (state != in::code || depth > 0 || decorator ||
+            i + 1 == src.size()) {
+          continue;
+        }
+
+        std::string_view next{src.data() + i + 1, src.size() - i - 1};
+        if (std::string_view{" \t\r\n}])"}.find(next.front()) != std::string_view::npos ||
+            next.starts_with("else") || next.starts_with("elif")) {
+          continue;
+        }
+
+        out.push_back({src.substr(begin, i + 1 - begin), begin_row});
+        begin = i + 1;
+        begin_row = row;
+      }
+
+      if (begin < src.size()) out.push_back({src.substr(begin), begin_row});
+      return out;
+    }
+
+    // the name a definition gives a function, if that's what it is
+    std::optional<std::string> defined_fn(node* root) {
+      auto const& exprs = static_cast<block_node*>(root)->exprs;
+      if (exprs.size() != 1) return std::nullopt;
+
+      auto* it = exprs.front().get();
+      if (it->type == node_type::decorated) {
+        it = static_cast<decorated_node*>(it)->target.get();
+      }
+      if (it->type != node_type::fn_def) return std::nullopt;
+
+      auto const& name = static_cast<fn_def_node*>(it)->name;
+      if (name.empty()) return std::nullopt;
+      return name;
+    }
+
+    std::expected<std::shared_ptr<node>, std::string>
+    parse(std::string const& text, size_t row) {
+      std::vector<token> toks;
+      try {
+        toks = lexer{to_utf32(text), row}.lex();
+      } catch (std::runtime_error const& err) {
+        return std::unexpected{err.what()};
+      }
+      return parser{std::move(toks)}.global();
+    }
+
+    // adds what ast assigns to into, which has to have its fns forgotten
+    void add_effects(compiler::effects& into, node* ast) {
+      compiler::effects it;
+      compiler::collect_effects(ast, it);
+      compiler::forget_fns(it);
+      into.assigned.insert(it.assigned.begin(), it.assigned.end());
+      into.props.insert(it.props.begin(), it.props.end());
+      into.defined.insert(it.defined.begin(), it.defined.end());
+      into.imports |= it.imports;
+    }
+
+    // runs ast, a definition, on a scratch vm against vm's globals and
+    // returns the function it defines, nullopt if it's data. what the
+    // compiler proves about globals comes from program, the whole file
+    std::expected<std::optional<std::pair<value::str, value>>, std::string>
+    recompile(vm& vm, node* ast, compiler::effects const& program) {
+      auto name = defined_fn(ast);
+      if (!name) return std::nullopt;
+
+      compiler comp{value::function::type::script};
+      comp.program_effects = std::make_shared<compiler::effects>(program);
+      auto fn = ami_unwrap(comp.global(ast));
+
+      // whatever a decorator makes ends up in our globals, so nothing of
+      // it is the scratch vm's to collect
+      struct vm scratch{fn};
+      scratch.gc.enabled = false;
+      scratch.globals = vm.globals;
+      ami_discard(scratch.run(std::cout));
+
+      value::str key{*name};
+      return std::pair{key, scratch.globals.at(key)};
+    }
+
+    struct reloader {
+      std::string path, file;
+      int fd = -1;
+      // text of every definition as of the last reload
+      std::unordered_set<std::string> current;
+      // what every definition loaded so far assigns. removed ones count
+      // too, what they defined stays in the globals
+      compiler::effects program;
+
+      ~reloader() {
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+#endif
+      }
+
+      void reload(vm& vm) {
+        std::stringstream src;
+        src << std::ifstream(path).rdbuf();
+        auto defs = split(src.str());
+
+        // all of them first, a function can be changed along with what
+        // assigns the globals it reads
+        std::unordered_set<std::string> next;
+        std::vector<std::pair<definition, std::shared_ptr<node>>> changed;
+        for (auto& def: defs) {
+          if (current.contains(def.text)) {
+            next.insert(std::move(def.text));
+            continue;
+          }
+
+          auto ast = parse(def.text, def.row);
+          if (!ast.has_value()) {
+            // stays changed, so the next save tries again
+            std::cerr << "Can't reload line " << def.row << ": " << ast.error() << '\n';
+            continue;
+          }
+          add_effects(program, ast->get());
+          changed.emplace_back(std::move(def), std::move(*ast));
+        }
+
+        std::vector<std::pair<value::str, value>> swaps;
+        for (auto& [def, ast]: changed) {
+          auto res = recompile(vm, ast.get(), program);
+          if (!res.has_value()) {
+            std::cerr << "Can't reload line " << def.row << ": " << res.error() << '\n';
+            continue;
+          }
+          if (*res) swaps.push_back(std::move(**res));
+          next.insert(std::move(def.text));
+        }
+
+        // all at once, so the script never sees only some of them
+        for (auto& [name, fn]: swaps) {
+          auto& it = vm.globals[name];
+          it = std::move(fn);
+          vm.gc.written(it);
+        }
+        current = std::move(next);
+      }
+
+#ifdef __linux__
+      // whether any of what's queued up is about our file
+      bool saved() {
+        alignas(inotify_event) char buf[4096];
+        bool ours = false;
+        for (;;) {
+          auto len = ::read(fd, buf, sizeof buf);
+          if (len <= 0) return ours;
+
+          for (char* at = buf; at < buf + len;) {
+            auto* ev = reinterpret_cast<inotify_event*>(at);
+            if (ev->len > 0 && file == ev->name) ours = true;
+            at += sizeof(inotify_event) + ev->len;
+          }
+        }
+      }
+#endif
+    };
+  }
+
+  std::expected<value, std::string> hot_reload(std::span<value> args) {
+    if (!args[0].is<value::str>()) {
+      return std::unexpected{"hot_reload() needs a path!"};
+    }
+
+#ifdef __linux__
+    std::filesystem::path path{std::string(args[0].get<value::str>())};
+    auto it = std::make_shared<reloader>();
+    it->path = path.string();
+    it->file = path.filename().string();
+
+    std::stringstream src;
+    if (!(src << std::ifstream(it->path).rdbuf())) {
+      return std::unexpected{"Can't read " + it->path};
+    }
+    auto script = parse(src.str(), 1);
+    if (!script.has_value()) return std::unexpected{script.error()};
+    add_effects(it->program, script->get());
+    for (auto& def: split(src.str())) it->current.insert(std::move(def.text));
+
+    it->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    auto dir = path.parent_path().empty() ? "." : path.parent_path().string();
+    if (it->fd < 0 ||
+        inotify_add_watch(it->fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      return std::unexpected{"Can't watch " + it->path + ": " + std::strerror(errno)};
+    }
+
+    auto& vm = *vm::current;
+    ami_discard(on_readable(vm, it->fd, [it, &vm] {
+      if (it->saved()) it->reload(vm);
+    }));
+    return value{value::nil{}};
+#else
+    return std::unexpected{"hot_reload() needs inotify, which is linux only"};
+#endif
+  }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "vm.h"
+
+namespace tosuto::vm {
+  // hot reload. `hot_reload(path)` watches path, the running script, and
+  // whenever it's saved swaps the top-level functions that changed into
+  // the calling vm's globals. everything else in globals stays as it is, so
+  // a long-lived service keeps its state while its code changes.
+  //
+  // the file is cut into top-level definitions, each one starting on a line
+  // that begins at nesting depth 0. only the ones whose text changed since
+  // the last reload get lexed, parsed and compiled, so a reload costs about
+  // as much as the edit plus a pass over the file. changed function
+  // definitions, decorated ones too, are run on a scratch vm against the
+  // current globals and what they define is swapped in. anything else that
+  // changed is data and is left alone. they're compiled knowing what every
+  // definition loaded so far assigns, not just their own, so a loop never
+  // hoists a global some other function writes.
+  //
+  // reloads happen while the vm waits in run_loop(), between two
+  // coroutine steps, so nothing ever sees half of one. calls already
+  // running carry on with the code they started with. the watch goes
+  // through inotify, on the directory since editors tend to replace files
+  // rather than write them.
+
+  std::expected<value, std::string> hot_reload(std::span<value> args);
+}
@@ -0,0 +1,521 @@
+#include "snapshot.h"
+#include "cache.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+
+namespace tosuto::vm {
+  // layout, on top of the cache's (see cache.cpp):
+  //   header   "tss\0", u32 version, u16 opcode count, u64 source hash
+  //   strings  as in the cache
+  //   nodes    u32 count, then per node a u8 kind, descs also their
+  //            function, closures also u32 desc node, u16 upval count and a
+  //            u32 upval node each
+  //   contents per node in order, descs and closures have none:
+  //              object  u8 flags, u32 count, then u32 key + value each
+  //              array   u8 flags, u32 count, then values
+  //              ref     value
+  //              upval   u8 open, then u32 stack slot if open, else value
+  //   globals  u32 count, then u32 name + value each
+  //   stack    script closure node, u32 count + values from slot 1 up
+  //   resume   u32 offset into the script's code
+  //
+  // flags: 1 if frozen, 2 if it holds functions, see object_fields.
+  //
+  // value: u8 tag, then f64 for num, u8 for bool, u32 string index for str
+  //        and native (by name), u32 length + characters for bytes, u32
+  //        node for anything on the heap.
+  //
+  // every shared object, closure and upvalue is a node, so sharing and
+  // cycles come back as they were. closures only point at desc and upval
+  // nodes, which makes them complete before any value gets to copy one, and
+  // descs are read whole since they can't be filled in after the fact.
+
+  namespace {
+    constexpr char magic[4] = {'t', 's', 's', '\0'};
+
+    enum class val_tag : u8 {
+      num,
+      boolean,
+      nil,
+      str,
+      native,
+      object,
+      array,
+      ref,
+      function,
+      bytes
+    };
+
+    enum class node_kind : u8 {
+      object,
+      array,
+      ref,
+      closure,
+      desc,
+      upval
+    };
+
+    struct heap_writer {
+      struct pending {
+        node_kind kind;
+        value val;
+        upvalue const* upval = nullptr;
+      };
+
+      writer out;
+      // the node table, which shares out's strings, see to_table
+      std::vector<u8> table;
+      u32 node_count = 0;
+      std::vector<pending> nodes;
+      std::unordered_map<void const*, u32> ids;
+      std::map<std::pair<void const*, void const*>, u32> closures;
+      std::unordered_map<value::native_fn::first_type, std::string> natives;
+
+      template<typename Fn>
+      auto to_table(Fn const& write) {
+        struct swap_back {
+          heap_writer& self;
+
+          ~swap_back() { std::swap(self.out.out, self.table); }
+        } guard{*this};
+
+        std::swap(out.out, table);
+        return write();
+      }
+
+      u32 node(node_kind kind, void const* key, value const& val,
+               upvalue const* upval = nullptr) {
+        auto [it, inserted] = ids.emplace(key, node_count);
+        if (inserted) {
+          node_count++;
+          to_table([&] { out.put(kind); });
+          nodes.push_back({kind, val, upval});
+        }
+        return it->second;
+      }
+
+      std::expected<u32, std::string> desc(value::function const& fn) {
+        auto found = ids.find(fn.desc.get());
+        if (found != ids.end()) return found->second;
+
+        ami_discard(to_table([&]() -> std::expected<void, std::string> {
+          out.put(node_kind::desc);
+          return out.function(fn);
+        }));
+        ids.emplace(fn.desc.get(), node_count);
+        nodes.push_back({node_kind::desc, value{value::nil{}}});
+        return node_count++;
+      }
+
+      std::expected<u32, std::string> closure(value::function const& fn) {
+        auto key = std::pair{(void const*) fn.desc.get(), (void const*) fn.upvals.get()};
+        auto found = closures.find(key);
+        if (found != closures.end()) return found->second;
+
+        auto desc_id = ami_unwrap(desc(fn));
+        u16 count = fn.upvals ? fn.desc->num_upvals : 0;
+        std::vector<u32> upvals;
+        for (u16 i = 0; i < count; i++) {
+          upvals.push_back(node(node_kind::upval, fn.upvals[i], value{value::nil{}},
+                                fn.upvals[i]));
+        }
+
+        to_table([&] {
+          out.put(node_kind::closure);
+          out.put(desc_id);
+          out.put(count);
+          for (auto it: upvals) out.put(it);
+        });
+        closures.emplace(key, node_count);
+        nodes.push_back({node_kind::closure, value{value::nil{}}});
+        return node_count++;
+      }
+
+      std::expected<void, std::string> put(value const& val) {
+        switch (val.val.index()) {
+          case index_of<value::num>: out.put(val_tag::num);
+            out.put(val.get<value::num>());
+            break;
+          case index_of<bool>: out.put(val_tag::boolean);
+            out.put(u8(val.get<bool>()));
+            break;
+          case index_of<value::object>: out.put(val_tag::object);
+            out.put(node(node_kind::object, val.get<value::object>().get(), val));
+            break;
+          case index_of<value::ref>: out.put(val_tag::ref);
+            out.put(node(node_kind::ref, val.get<value::ref>().get(), val));
+            break;
+          case index_of<value::nil>: out.put(val_tag::nil);
+            break;
+          case index_of<value::str>: out.put(val_tag::str);
+            out.put(out.intern(val.get<value::str>()));
+            break;
+          case index_of<value::function>: {
+            auto id = ami_unwrap(closure(val.get<value::function>()));
+            out.put(val_tag::function);
+            out.put(id);
+            break;
+          }
+          case index_of<value::native_fn>: {
+            auto name = natives.find(val.get<value::native_fn>().first);
+            if (name == natives.end()) {
+              return std::unexpected{"Can't snapshot a native that isn't a global!"};
+            }
+            out.put(val_tag::native);
+            out.put(out.intern(name->second));
+            break;
+          }
+          case index_of<value::array>: out.put(val_tag::array);
+            out.put(node(node_kind::array, val.get<value::array>().get(), val));
+            break;
+          case index_of<value::bytes>: {
+            auto const& it = *val.get<value::bytes>();
+            out.put(val_tag::bytes);
+            out.put(u32(it.size()));
+            out.out.insert(out.out.end(), it.begin(), it.end());
+            break;
+          }
+          default: return std::unexpected{"Can't snapshot " + val.to_string()};
+        }
+
+        return {};
+      }
+
+      std::expected<void, std::string> contents(pending const& it, vm const& vm) {
+        switch (it.kind) {
+          case node_kind::object: {
+            auto const& obj = *it.val.get<value::object>();
+            out.put(u8(obj.frozen | obj.holds_fns << 1));
+            out.put(u32(obj.size()));
+            for (auto const& [k, v]: obj) {
+              out.put(out.intern(k));
+              ami_discard(put(v));
+            }
+            break;
+          }
+          case node_kind::array: {
+            auto const& arr = *it.val.get<value::array>();
+            out.put(u8(arr.frozen | arr.holds_fns << 1));
+            out.put(u32(arr.size()));
+            for (auto const& v: arr) ami_discard(put(v));
+            break;
+          }
+          case node_kind::ref: {
+            ami_discard(put(*it.val.get<value::ref>()));
+            break;
+          }
+          case node_kind::upval: {
+            bool open = it.upval->loc != &it.upval->closed;
+            out.put(u8(open));
+            if (open) out.put(u32(it.upval->loc - vm.stack.data()));
+            else ami_discard(put(it.upval->closed));
+            break;
+          }
+          case node_kind::desc:
+          case node_kind::closure: break;
+        }
+
+        return {};
+      }
+    };
+
+    struct heap_reader {
+      struct node {
+        node_kind kind;
+        value val = value{value::nil{}};
+        std::shared_ptr<fn_desc> desc{};
+        upvalue* upval = nullptr;
+      };
+
+      reader in;
+      vm& target;
+      std::vector<node> nodes{};
+
+      std::expected<u32, std::string> node_id(node_kind kind) {
+        auto id = ami_unwrap(in.get<u32>());
+        if (id >= nodes.size() || nodes[id].kind != kind) {
+          return std::unexpected{"Bad node in snapshot!"};
+        }
+        return id;
+      }
+
+      std::expected<value, std::string> get() {
+        auto tag = ami_unwrap(in.get<val_tag>());
+        switch (tag) {
+          case val_tag::num: {
+            auto it = ami_unwrap(in.get<value::num>());
+            return value{it};
+          }
+          case val_tag::boolean: {
+            auto it = ami_unwrap(in.get<u8>());
+            return value{bool(it)};
+          }
+          case val_tag::nil: return value{value::nil{}};
+          case val_tag::str: {
+            auto it = ami_unwrap(in.string());
+            return value{in.strings[it]};
+          }
+          case val_tag::native: {
+            auto name = ami_unwrap(in.string());
+            auto it = target.globals.find(in.strings[name]);
+            if (it == target.globals.end() || !it->second.is<value::native_fn>()) {
+              return std::unexpected{
+                "Native " + std::string(in.strings[name]) + " isn't defined!"};
+            }
+            return it->second;
+          }
+          case val_tag::object: {
+            auto id = ami_unwrap(node_id(node_kind::object));
+            return nodes[id].val;
+          }
+          case val_tag::array: {
+            auto id = ami_unwrap(node_id(node_kind::array));
+            return nodes[id].val;
+          }
+          case val_tag::ref: {
+            auto id = ami_unwrap(node_id(node_kind::ref));
+            return nodes[id].val;
+          }
+          case val_tag::function: {
+            auto id = ami_unwrap(node_id(node_kind::closure));
+            return nodes[id].val;
+          }
+          case val_tag::bytes: {
+            auto size = ami_unwrap(in.get<u32>());
+            auto it = ami_unwrap(in.bytes(size));
+            return value{std::make_shared<std::string const>(it.begin(), it.end())};
+          }
+          default: return std::unexpected{"Bad value tag in snapshot!"};
+        }
+      }
+
+      std::expected<void, std::string> contents(node& it) {
+        switch (it.kind) {
+          case node_kind::object: {
+            auto& obj = *it.val.get<value::object>();
+            auto flags = ami_unwrap(in.get<u8>());
+            obj.frozen = flags & 1;
+            obj.holds_fns = flags & 2;
+            auto count = ami_unwrap(in.get<u32>());
+            for (u32 i = 0; i < count; i++) {
+              auto k = ami_unwrap(in.string());
+              auto v = ami_unwrap(get());
+              obj[in.strings[k]] = std::move(v);
+            }
+            break;
+          }
+          case node_kind::array: {
+            auto& arr = *it.val.get<value::array>();
+            auto flags = ami_unwrap(in.get<u8>());
+            arr.frozen = flags & 1;
+            arr.holds_fns = flags & 2;
+            auto count = ami_unwrap(in.get<u32>());
+            arr.reserve(count);
+            for (u32 i = 0; i < count; i++) {
+              auto v = ami_unwrap(get());
+              arr.push_back(std::move(v));
+            }
+            break;
+          }
+          case node_kind::ref: {
+            auto v = ami_unwrap(get());
+            *it.val.get<value::ref>() = std::move(v);
+            break;
+          }
+          case node_kind::upval: {
+            auto open = ami_unwrap(in.get<u8>());
+            if (open) {
+              auto slot = ami_unwrap(in.get<u32>());
+              it.upval->loc = &target.stack[slot];
+            } else {
+              auto v = ami_unwrap(get());
+              it.upval->closed = std::move(v);
+              it.upval->loc = &it.upval->closed;
+            }
+            break;
+          }
+          case node_kind::desc:
+          case node_kind::closure: break;
+        }
+
+        return {};
+      }
+    };
+  }
+
+  std::string snapshot_path(std::string const& source_path) {
+    return std::filesystem::path(source_path).replace_extension(".tss").string();
+  }
+
+  std::expected<value, std::string> snapshot(std::span<value> args) {
+    auto& vm = *vm::current;
+    if (vm.frames.size() != 1) {
+      return std::unexpected{"snapshot() only works at the top level!"};
+    }
+    if (vm.snapshot_path.empty()) return std::unexpected{"Nowhere to snapshot to!"};
+
+    heap_writer heap;
+    for (auto const& [name, val]: vm.globals) {
+      if (val.is<value::native_fn>()) {
+        heap.natives.emplace(val.get<value::native_fn>().first, name);
+      }
+    }
+
+    // our own callee slot is where the result goes on resume
+    auto top = size_t(args.data() - vm.stack.data() - 1);
+
+    heap.out.put(u32(vm.globals.size()));
+    for (auto const& [name, val]: vm.globals) {
+      heap.out.put(heap.out.intern(name));
+      ami_discard(heap.put(val));
+    }
+
+    auto script = ami_unwrap(heap.closure(vm.frames.back().fn));
+    heap.out.put(script);
+    heap.out.put(u32(top - 1));
+    for (size_t i = 1; i < top; i++) ami_discard(heap.put(vm.stack[i]));
+    heap.out.put(u32(vm.frames.back().ip));
+
+    // writing contents finds more nodes as it goes
+    auto roots = std::exchange(heap.out.out, {});
+    for (size_t i = 0; i < heap.nodes.size(); i++) {
+      auto it = heap.nodes[i];
+      ami_discard(heap.contents(it, vm));
+    }
+    auto contents = std::exchange(heap.out.out, {});
+
+    heap.out.put(heap.node_count);
+    auto& table = heap.table;
+    heap.out.out.insert(heap.out.out.end(), table.begin(), table.end());
+    heap.out.out.insert(heap.out.out.end(), contents.begin(), contents.end());
+    heap.out.out.insert(heap.out.out.end(), roots.begin(), roots.end());
+
+    ami_discard(write_file(vm.snapshot_path,
+                           heap.out.file(magic, snapshot_version, vm.snapshot_key)));
+    return value{false};
+  }
+
+  std::expected<void, std::string> restore_snapshot(vm& vm) {
+    mapped_file file;
+    if (!file.open(vm.snapshot_path)) {
+      return std::unexpected{"No snapshot at " + vm.snapshot_path};
+    }
+
+    heap_reader heap{reader{file.data}, vm};
+    auto& in = heap.in;
+    ami_discard(in.header(magic, snapshot_version, vm.snapshot_key, vm.snapshot_path));
+
+    auto count = ami_unwrap(in.get<u32>());
+    std::vector<std::pair<u32, std::vector<u32>>> shapes(count);
+    heap.nodes.reserve(count);
+    for (u32 i = 0; i < count; i++) {
+      auto kind = ami_unwrap(in.get<node_kind>());
+      heap.nodes.push_back({kind});
+      if (kind == node_kind::desc) {
+        auto fn = ami_unwrap(in.function());
+        heap.nodes.back().desc = fn.desc;
+      }
+      if (kind != node_kind::closure) continue;
+
+      shapes[i].first = ami_unwrap(in.get<u32>());
+      auto upvals = ami_unwrap(in.get<u16>());
+      for (u16 j = 0; j < upvals; j++) {
+        auto it = ami_unwrap(in.get<u32>());
+        shapes[i].second.push_back(it);
+      }
+    }
+
+    // upvals belong to the closures from here on, like capture_upval's
+    for (auto& it: heap.nodes) {
+      switch (it.kind) {
+        case node_kind::object:
+          it.val = value{std::make_shared<value::object::element_type>()};
+          break;
+        case node_kind::array:
+          it.val = value{std::make_shared<value::array::element_type>()};
+          break;
+        case node_kind::ref:
+          it.val = value{std::make_shared<value>(value{value::nil{}})};
+          break;
+        case node_kind::upval: it.upval = new upvalue{nullptr};
+          break;
+        case node_kind::desc:
+        case node_kind::closure: break;
+        default: return std::unexpected{"Bad node kind in snapshot!"};
+      }
+    }
+
+    for (u32 i = 0; i < count; i++) {
+      if (heap.nodes[i].kind != node_kind::closure) continue;
+
+      auto const& [desc, upvals] = shapes[i];
+      if (desc >= count || heap.nodes[desc].kind != node_kind::desc) {
+        return std::unexpected{"Bad node in snapshot!"};
+      }
+
+      value::function fn;
+      fn.desc = heap.nodes[desc].desc;
+      if (!upvals.empty()) vm.make_closure(fn, upvals.size());
+      for (size_t j = 0; j < upvals.size(); j++) {
+        if (upvals[j] >= count || heap.nodes[upvals[j]].kind != node_kind::upval) {
+          return std::unexpected{"Bad node in snapshot!"};
+        }
+        fn.upvals[j] = heap.nodes[upvals[j]].upval;
+      }
+      heap.nodes[i].val = value{std::move(fn)};
+    }
+
+    for (auto& it: heap.nodes) ami_discard(heap.contents(it));
+
+    std::vector<std::pair<value::str, value>> globals;
+    auto global_count = ami_unwrap(in.get<u32>());
+    for (u32 i = 0; i < global_count; i++) {
+      auto name = ami_unwrap(in.string());
+      auto val = ami_unwrap(heap.get());
+      globals.emplace_back(in.strings[name], std::move(val));
+    }
+
+    auto script = ami_unwrap(heap.node_id(node_kind::closure));
+    auto stack_count = ami_unwrap(in.get<u32>());
+    std::vector<value> stack;
+    for (u32 i = 0; i < stack_count; i++) {
+      auto val = ami_unwrap(heap.get());
+      stack.push_back(std::move(val));
+    }
+
+    auto ip = ami_unwrap(in.get<u32>());
+    auto& code = heap.nodes[script].val.get<value::function>().desc->chunk.data;
+    if (ip > code.size()) return std::unexpected{"Bad resume offset in snapshot!"};
+
+    std::vector<upvalue*> open;
+    for (auto const& it: heap.nodes) {
+      if (it.upval && it.upval->loc != &it.upval->closed) {
+        if (it.upval->loc > vm.stack.data() + stack_count) {
+          return std::unexpected{"Bad upval slot in snapshot!"};
+        }
+        open.push_back(it.upval);
+      }
+    }
+
+    // nothing can fail from here on
+    for (auto& [name, val]: globals) vm.globals[name] = std::move(val);
+
+    vm.stack[0] = heap.nodes[script].val;
+    for (u32 i = 0; i < stack_count; i++) vm.stack[i + 1] = std::move(stack[i]);
+    vm.resume_top = stack_count + 1;
+    vm.stack[vm.resume_top] = value{true};
+
+    // the open list is sorted from the top of the stack down
+    std::ranges::sort(open, [](auto* a, auto* b) { return a->loc > b->loc; });
+    for (size_t i = 0; i < open.size(); i++) {
+      open[i]->next = i + 1 < open.size() ? open[i + 1] : nullptr;
+    }
+    vm.open_upvals = open.empty() ? nullptr : open.front();
+
+    vm.frames.clear();
+    vm.frames.emplace_back(vm.stack[0].get<value::function>(), ip, 0);
+    return {};
+  }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "vm.h"
+
+namespace tosuto::vm {
+  // heap snapshots. a script calls the `snapshot` native once its top level
+  // is done setting things up, which writes the globals, the stack and
+  // everything reachable from them to vm::snapshot_path. a later process
+  // restores that instead of running the script and carries on right after
+  // the call, so `snapshot()` is false where it was taken and true where it
+  // was restored. snapshots are keyed like the bytecode cache, so any edit to
+  // the source throws them away.
+  constexpr u32 snapshot_version = 4;
+
+  // foo.tosuto -> foo.tss
+  std::string snapshot_path(std::string const& source_path);
+
+  // the `snapshot` native, only works at the top level
+  std::expected<value, std::string> snapshot(std::span<value> args);
+
+  // natives are stored by name, so define them on vm before restoring. fails
+  // if the file is missing, stale or from another version, which leaves vm
+  // untouched
+  std::expected<void, std::string> restore_snapshot(vm& vm);
+}
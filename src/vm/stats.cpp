@@ -0,0 +1,82 @@
+#include "stats.h"
+
+#ifdef AMI_OPCODE_STATS
+#include <algorithm>
+#include <iomanip>
+#include <mutex>
+#include <numeric>
+
+namespace tosuto::vm {
+  namespace {
+    struct all_totals {
+      std::mutex mutex;
+      op_totals totals;
+    };
+
+    all_totals& all() {
+      static all_totals it;
+      return it;
+    }
+  }
+
+  u64* site_counts::get(size_t size) {
+    auto* it = counts.load(std::memory_order_acquire);
+    if (it) [[likely]] return it;
+
+    // whoever's first wins, the others count into theirs
+    auto* fresh = new u64[size]();
+    if (counts.compare_exchange_strong(it, fresh)) return fresh;
+    delete[] fresh;
+    return it;
+  }
+
+  u64 site_counts::at(size_t offset) const {
+    auto* it = counts.load(std::memory_order_acquire);
+    if (!it) return 0;
+    return std::atomic_ref{it[offset]}.load(std::memory_order_relaxed);
+  }
+
+  op_timer::~op_timer() {
+    if (last < op_count) totals.cycles[last] += read_cycles() - since;
+
+    auto& it = all();
+    std::scoped_lock lock{it.mutex};
+    for (size_t i = 0; i < op_count; i++) {
+      it.totals.count[i] += totals.count[i];
+      it.totals.cycles[i] += totals.cycles[i];
+    }
+  }
+
+  void print_op_stats(std::ostream& out) {
+    op_totals totals;
+    {
+      auto& it = all();
+      std::scoped_lock lock{it.mutex};
+      totals = it.totals;
+    }
+
+    std::vector<u16> ops(op_count);
+    std::iota(ops.begin(), ops.end(), 0);
+    std::ranges::sort(ops, std::greater{}, [&](u16 op) { return totals.cycles[op]; });
+    auto total = std::accumulate(std::begin(totals.cycles), std::end(totals.cycles), u64(0));
+    auto flags = out.flags();
+    auto precision = out.precision();
+
+    out << std::left << std::setw(10) << "op" << std::right
+        << std::setw(14) << "count" << std::setw(16) << "cycles"
+        << std::setw(10) << "per op" << std::setw(8) << "%" << '\n';
+    for (auto op: ops) {
+      if (totals.count[op] == 0) continue;
+      out << std::left << std::setw(10) << to_string(op_code(op)) << std::right
+          << std::setw(14) << totals.count[op]
+          << std::setw(16) << totals.cycles[op]
+          << std::setw(10) << std::fixed << std::setprecision(1)
+          << double(totals.cycles[op]) / double(totals.count[op])
+          << std::setw(8) << 100.0 * double(totals.cycles[op]) / double(std::max(total, u64(1)))
+          << '\n';
+    }
+    out.flags(flags);
+    out.precision(precision);
+  }
+}
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "vm.h"
+
+#ifdef AMI_OPCODE_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64)
+#include <intrin.h>
+#else
+#include <chrono>
+#endif
+#endif
+
+namespace tosuto::vm {
+  // opcode statistics, for builds with AMI_OPCODE_STATS defined (cmake
+  // -DAMI_OPCODE_STATS=ON). every instruction run() executes is counted,
+  // per opcode and per offset in its chunk, and timed with the cycle
+  // counter. an instruction's time runs until the next one starts, so it
+  // includes dispatch and, for calls, whatever natives do. chunk::disasm
+  // then prints how often each instruction ran next to it and
+  // print_op_stats() where the time went by opcode.
+  //
+  // the totals are kept per run() and added up when it returns. offsets
+  // are counted in the chunk, without a lock, so vms on other threads
+  // running the same code at once can lose a few counts. builds without
+  // it don't have any of this.
+
+#ifdef AMI_OPCODE_STATS
+  inline u64 read_cycles() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  }
+
+  struct op_totals {
+    u64 count[op_count]{};
+    u64 cycles[op_count]{};
+  };
+
+  // counts and times what one run() executes and hands it over when done
+  struct op_timer {
+    op_totals totals;
+    // what's running, op_count before the first instruction
+    u16 last = op_count;
+    u64 since = 0;
+
+    inline void next(chunk& ch, u8 const* ip) {
+      auto now = read_cycles();
+      if (last < op_count) totals.cycles[last] += now - since;
+
+      auto& site = ch.sites.get(ch.data.size())[ip - ch.data.data()];
+      std::atomic_ref it{site};
+      it.store(it.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+      last = *ip;
+      totals.count[last]++;
+      since = read_cycles();
+    }
+
+    ~op_timer();
+  };
+
+  // every opcode that ran so far, the most time first
+  void print_op_stats(std::ostream& out);
+#endif
+}
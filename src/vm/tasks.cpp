@@ -0,0 +1,541 @@
+#include "tasks.h"
+#include "actors.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+namespace tosuto::vm {
+  namespace {
+    struct task {
+      value::function fn;
+      std::vector<value> args;
+      std::unordered_map<value::str, value> globals;
+      std::unordered_set<std::string> imported;
+      std::expected<value, std::string> result;
+      std::atomic<bool> done = false;
+      // parallel for chunks, which share the caller's values
+      bool shares = false;
+    };
+
+    // every thread keeps the vms it ran tasks on, a vm is only ever used
+    // by one task at a time since joining runs other tasks on top of ours
+    thread_local std::vector<std::unique_ptr<vm>> spare_vms;
+
+    void run_task(task& it) {
+      std::unique_ptr<vm> runner;
+      if (spare_vms.empty()) {
+        runner = std::make_unique<vm>(it.fn);
+      } else {
+        runner = std::move(spare_vms.back());
+        spare_vms.pop_back();
+      }
+
+      runner->globals = std::move(it.globals);
+      runner->imported = std::move(it.imported);
+      // what's ours gets cleared below, which what's shared isn't
+      runner->gc.enabled = !it.shares;
+      auto res = runner->run_fn(it.fn, std::cout, it.args);
+      if (res.has_value()) {
+        it.result = copier{}.copy(*res);
+      } else {
+        it.result = std::unexpected{"In task: " + res.error()};
+      }
+      // nothing of the task may outlive it on this thread
+      runner->globals.clear();
+      runner->imported.clear();
+      runner->self = nullptr;
+      runner->returned = value{value::nil{}};
+      gc_release(*runner);
+      spare_vms.push_back(std::move(runner));
+
+      it.done.store(true, std::memory_order_release);
+      it.done.notify_all();
+    }
+
+    // one deque per worker, the owner works on the newest end and thieves
+    // take the oldest tasks from the other
+    struct pool {
+      struct queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+      };
+
+      std::vector<std::unique_ptr<queue>> queues;
+      std::vector<std::thread> workers;
+      std::atomic<size_t> next_queue = 0;
+      // guards queued, which idle's waiters check
+      std::mutex idle_mutex;
+      size_t queued = 0;
+      std::condition_variable idle;
+      bool stopping = false;
+
+      std::mutex handles_mutex;
+      // spawned tasks until they're joined, finished or not
+      std::unordered_map<u64, std::shared_ptr<task>> handles;
+      u64 next_handle = 0;
+
+      // index of this thread's queue, if it's one of our workers
+      static inline thread_local std::optional<size_t> worker_idx;
+
+      pool() {
+        auto count = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < count; i++) {
+          queues.push_back(std::make_unique<queue>());
+        }
+        for (size_t i = 0; i < count; i++) {
+          workers.emplace_back([this, i] { work(i); });
+        }
+      }
+
+      ~pool() {
+        {
+          std::scoped_lock lock{idle_mutex};
+          stopping = true;
+        }
+        idle.notify_all();
+        for (auto& it: workers) it.join();
+      }
+
+      // counts the job before anyone can take it, so take's decrement
+      // never gets there first
+      void push(std::function<void()> job) {
+        auto idx = worker_idx.value_or(next_queue++ % queues.size());
+        {
+          std::scoped_lock lock{idle_mutex};
+          {
+            std::scoped_lock queue_lock{queues[idx]->mutex};
+            queues[idx]->jobs.push_back(std::move(job));
+          }
+          queued++;
+        }
+        idle.notify_one();
+      }
+
+      // never holds a queue's lock while taking idle_mutex, push takes
+      // them the other way around
+      std::function<void()> take() {
+        auto own = worker_idx.value_or(0);
+        for (size_t i = 0; i < queues.size(); i++) {
+          auto& q = *queues[(own + i) % queues.size()];
+          std::function<void()> it;
+          {
+            std::scoped_lock lock{q.mutex};
+            if (q.jobs.empty()) continue;
+
+            if (i == 0 && worker_idx) {
+              it = std::move(q.jobs.back());
+              q.jobs.pop_back();
+            } else {
+              it = std::move(q.jobs.front());
+              q.jobs.pop_front();
+            }
+          }
+
+          std::scoped_lock lock{idle_mutex};
+          queued--;
+          return it;
+        }
+
+        return nullptr;
+      }
+
+      void work(size_t idx) {
+        worker_idx = idx;
+        for (;;) {
+          if (auto job = take()) {
+            job();
+            continue;
+          }
+
+          std::unique_lock lock{idle_mutex};
+          idle.wait(lock, [this] { return stopping || queued > 0; });
+          if (stopping) return;
+        }
+      }
+    };
+
+    pool& tasks() {
+      static pool it;
+      return it;
+    }
+
+    // runs whatever's queued while we wait, which is how a task waiting on
+    // its own subtasks doesn't tie up a worker. once nothing's left, ours is
+    // running somewhere else and all we can do is wait for it
+    void wait_for(task& it) {
+      while (!it.done.load(std::memory_order_acquire)) {
+        if (!help()) {
+          it.done.wait(false, std::memory_order_acquire);
+        }
+      }
+    }
+  }
+
+  void post(std::function<void()> job) {
+    tasks().push(std::move(job));
+  }
+
+  size_t workers() {
+    return tasks().queues.size();
+  }
+
+  bool help() {
+    auto job = tasks().take();
+    if (!job) return false;
+
+    job();
+    return true;
+  }
+
+  value copier::copy(value const& val) {
+    switch (val.val.index()) {
+      case index_of<value::object>: {
+        auto const& obj = val.get<value::object>();
+        if (obj->frozen) return val;
+        if (auto it = seen.find(obj.get()); it != seen.end()) return it->second;
+
+        auto out = std::make_shared<value::object::element_type>();
+        seen.emplace(obj.get(), value{out});
+        for (auto const& [k, v]: *obj) (*out)[k] = copy(v);
+        return value{out};
+      }
+      case index_of<value::ref>: {
+        auto const& ref = val.get<value::ref>();
+        if (auto it = seen.find(ref.get()); it != seen.end()) return it->second;
+
+        auto out = std::make_shared<value>(value{value::nil{}});
+        seen.emplace(ref.get(), value{out});
+        *out = copy(*ref);
+        return value{out};
+      }
+      case index_of<value::function>: {
+        auto const& fn = val.get<value::function>();
+        if (!fn.upvals) return val;
+
+        auto key = std::pair{(void const*) fn.desc.get(), (void const*) fn.upvals.get()};
+        if (auto it = closures.find(key); it != closures.end()) return it->second;
+
+        // the array's deleter keeps the upvals alive as long as the closure
+        auto owned = std::make_shared<std::vector<std::shared_ptr<upvalue>>>();
+        value::function out;
+        out.desc = fn.desc;
+        out.upvals = std::shared_ptr<upvalue*[]>(
+          new upvalue*[fn.desc->num_upvals](),
+          [owned](upvalue** it) { delete[] it; });
+        closures.emplace(key, value{out});
+        for (u16 i = 0; i < fn.desc->num_upvals; i++) {
+          auto* upval = fn.upvals[i];
+          auto found = upvals.find(upval);
+          if (found != upvals.end()) {
+            owned->push_back(found->second);
+            out.upvals[i] = found->second.get();
+            continue;
+          }
+
+          // copies are always closed, the stack they pointed into stays here
+          auto copied = std::make_shared<upvalue>(nullptr);
+          copied->loc = &copied->closed;
+          upvals.emplace(upval, copied);
+          owned->push_back(copied);
+          out.upvals[i] = copied.get();
+          copied->closed = copy(*upval->loc);
+        }
+        return value{out};
+      }
+      case index_of<value::array>: {
+        auto const& arr = val.get<value::array>();
+        if (arr->frozen) return val;
+        if (auto it = seen.find(arr.get()); it != seen.end()) return it->second;
+
+        auto out = std::make_shared<value::array::element_type>();
+        seen.emplace(arr.get(), value{out});
+        out->reserve(arr->size());
+        for (auto const& v: *arr) out->push_back(copy(v));
+        return value{out};
+      }
+      case index_of<value::coro>: {
+        auto const& co = val.get<value::coro>();
+        if (auto it = seen.find(co.get()); it != seen.end()) return it->second;
+
+        auto out = std::make_shared<coroutine>();
+        seen.emplace(co.get(), value{out});
+        out->fn = copy(value{co->fn}).get<value::function>();
+        // a running one's segment is on some vm's stack, nothing to copy
+        if (co->state == coroutine::status::running) {
+          out->state = coroutine::status::done;
+          return value{out};
+        }
+
+        // open upvals point into the segment, so closures copied from it
+        // have to find the new ones before anything else
+        // the copy isn't in any event loop, so it's just suspended
+        out->state = co->state == coroutine::status::waiting
+                     ? coroutine::status::suspended : co->state;
+        out->stack.resize(co->stack.size());
+        for (auto* upval: co->upvals) {
+          auto copied = std::make_shared<upvalue>(
+            out->stack.data() + (upval->loc - co->stack.data()));
+          upvals.emplace(upval, copied);
+          out->upvals.push_back(copied.get());
+          out->owned_upvals.push_back(std::move(copied));
+        }
+        for (size_t i = 0; i < co->stack.size(); i++) {
+          out->stack[i] = copy(co->stack[i]);
+        }
+        for (auto const& it: co->frames) {
+          out->frames.push_back(
+            {copy(value{it.fn}).get<value::function>(), it.ip, it.offset});
+        }
+        return value{out};
+      }
+      default: return val;
+    }
+  }
+
+  namespace {
+    // finds the functions in what copy_globals copied
+    struct reacher {
+      std::vector<std::shared_ptr<fn_desc>> descs;
+      std::unordered_set<void const*> seen;
+
+      void reach(value const& val) {
+        switch (val.val.index()) {
+          case index_of<value::object>: {
+            auto const& obj = val.get<value::object>();
+            if (obj->frozen && !obj->holds_fns) return;
+            if (!seen.emplace(obj.get()).second) return;
+            for (auto const& [k, v]: *obj) reach(v);
+            return;
+          }
+          case index_of<value::ref>: {
+            auto const& ref = val.get<value::ref>();
+            if (seen.emplace(ref.get()).second) reach(*ref);
+            return;
+          }
+          case index_of<value::function>: {
+            auto const& fn = val.get<value::function>();
+            if (seen.emplace(fn.desc.get()).second) descs.push_back(fn.desc);
+            if (!fn.upvals || !seen.emplace(fn.upvals.get()).second) return;
+            for (u16 i = 0; i < fn.desc->num_upvals; i++) {
+              reach(*fn.upvals[i]->loc);
+            }
+            return;
+          }
+          case index_of<value::array>: {
+            auto const& arr = val.get<value::array>();
+            if (arr->frozen && !arr->holds_fns) return;
+            if (!seen.emplace(arr.get()).second) return;
+            for (auto const& v: *arr) reach(v);
+            return;
+          }
+          case index_of<value::coro>: {
+            auto const& co = val.get<value::coro>();
+            if (!seen.emplace(co.get()).second) return;
+            reach(value{co->fn});
+            for (auto const& v: co->stack) reach(v);
+            for (auto const& it: co->frames) reach(value{it.fn});
+            return;
+          }
+          default:;
+        }
+      }
+    };
+  }
+
+  void copy_globals(copier& copy, value::function const& fn,
+                    std::unordered_map<value::str, value>& out) {
+    auto const& globals = vm::current->globals;
+    reacher found;
+    found.reach(value{fn});
+    while (!found.descs.empty()) {
+      auto desc = std::move(found.descs.back());
+      found.descs.pop_back();
+
+      // its names are only known once it's compiled. if that fails, so does
+      // calling it, which the task reports
+      if (!desc->is_compiled()) {
+        value::function lazy;
+        lazy.desc = desc;
+        if (!compile_lazy(lazy).has_value()) continue;
+      }
+
+      for (auto const& lit: desc->chunk.literals) {
+        if (!lit.is<value::str>()) {
+          found.reach(lit);
+          continue;
+        }
+
+        auto const& name = lit.get<value::str>();
+        if (out.contains(name)) continue;
+        auto global = globals.find(name);
+        if (global == globals.end()) continue;
+        found.reach(out.emplace(name, copy.copy(global->second)).first->second);
+      }
+    }
+  }
+
+  std::expected<value, std::string> spawn(std::span<value> args) {
+    if (!args[0].is<value::function>() ||
+        args[0].get<value::function>().desc->arity != 0) {
+      return std::unexpected{"spawn() needs a function without arguments!"};
+    }
+
+    auto it = std::make_shared<task>();
+    copier copy;
+    it->fn = copy.copy(args[0]).get<value::function>();
+    copy_globals(copy, it->fn, it->globals);
+    it->imported = vm::current->imported;
+
+    auto& pool = tasks();
+    u64 handle;
+    {
+      std::scoped_lock lock{pool.handles_mutex};
+      handle = pool.next_handle++;
+      pool.handles.emplace(handle, it);
+    }
+    pool.push([it] { run_task(*it); });
+    return value{double(handle)};
+  }
+
+  std::expected<value, std::string> join(std::span<value> args) {
+    auto& pool = tasks();
+    std::shared_ptr<task> it;
+    if (args[0].is<value::num>()) {
+      std::scoped_lock lock{pool.handles_mutex};
+      auto found = pool.handles.find(u64(args[0].get<value::num>()));
+      if (found != pool.handles.end()) {
+        it = std::move(found->second);
+        pool.handles.erase(found);
+      }
+    }
+    if (!it) return std::unexpected{"Can't join " + args[0].to_string()};
+
+    wait_for(*it);
+    return std::move(it->result);
+  }
+
+  namespace {
+    // whether val is or holds any of arrays
+    bool reaches(value const& val, std::unordered_set<void const*> const& arrays,
+                 std::unordered_set<void const*>& seen) {
+      switch (val.val.index()) {
+        case index_of<value::array>: {
+          auto const& arr = val.get<value::array>();
+          if (arrays.contains(arr.get())) return true;
+          if (!seen.emplace(arr.get()).second) return false;
+          return std::ranges::any_of(*arr, [&](value const& it) {
+            return reaches(it, arrays, seen);
+          });
+        }
+        case index_of<value::object>: {
+          auto const& obj = val.get<value::object>();
+          if (!seen.emplace(obj.get()).second) return false;
+          return std::ranges::any_of(*obj, [&](auto const& it) {
+            return reaches(it.second, arrays, seen);
+          });
+        }
+        case index_of<value::ref>: return reaches(*val.get<value::ref>(), arrays, seen);
+        default: return false;
+      }
+    }
+
+    // what parallel_for's locals and global names stand for
+    std::vector<value> shared_values(value const& locals, value const& names) {
+      std::vector<value> out = *locals.get<value::array>();
+      auto const& globals = vm::current->globals;
+      for (auto const& it: *names.get<value::array>()) {
+        auto found = globals.find(it.get<value::str>());
+        if (found != globals.end()) out.push_back(found->second);
+      }
+      return out;
+    }
+
+    // whether something the loop reads is, or holds, an array it writes
+    bool aliased(std::span<value> args) {
+      std::unordered_set<void const*> written;
+      for (auto const& it: shared_values(args[5], args[7])) {
+        if (it.is<value::array>()) written.insert(it.get<value::array>().get());
+      }
+      if (written.empty()) return false;
+
+      std::unordered_set<void const*> seen;
+      return std::ranges::any_of(shared_values(args[6], args[8]), [&](value const& it) {
+        return reaches(it, written, seen);
+      });
+    }
+  }
+
+  std::expected<value, std::string> parallel_for(std::span<value> args) {
+    if (!args[1].is<value::num>() || !args[2].is<value::num>()) {
+      return std::unexpected{"Parallel for needs a range of numbers!"};
+    }
+
+    auto start = args[1].get<value::num>(), finish = args[2].get<value::num>();
+    auto const& seeds = *args[3].get<value::array>();
+    std::string const& ops = args[4].get<value::str>();
+    size_t count = finish > start ? size_t(std::ceil(finish - start)) : 0;
+    if (count == 0) return value{std::make_shared<value::array::element_type>(seeds)};
+
+    // a few chunks per worker so one slow chunk doesn't hold up the rest
+    auto& pool = tasks();
+    bool nums = std::ranges::all_of(seeds, [](value const& it) {
+      return it.is<value::num>();
+    });
+    size_t chunks = nums && !aliased(args) ? std::min(count, pool.queues.size() * 4) : 1;
+    // chunks write into our heap without any barrier
+    vm::current->gc.cancel();
+
+    std::vector<std::shared_ptr<task>> parts;
+    for (size_t i = 0; i < chunks; i++) {
+      auto lo = start + double(count * i / chunks);
+      auto hi = i + 1 == chunks ? finish : start + double(count * (i + 1) / chunks);
+
+      // only the first chunk starts from the actual values
+      auto seed = std::make_shared<value::array::element_type>(seeds);
+      if (i > 0) {
+        for (size_t j = 0; j < ops.size(); j++) {
+          (*seed)[j] = value{ops[j] == '+' ? 0.0 : 1.0};
+        }
+      }
+
+      auto it = std::make_shared<task>();
+      it->fn = args[0].get<value::function>();
+      it->args = {value{lo}, value{hi}, value{seed}};
+      it->globals = vm::current->globals;
+      it->imported = vm::current->imported;
+      it->shares = true;
+      parts.push_back(it);
+      pool.push([it] { run_task(*it); });
+    }
+
+    // wait for all of them even if one failed, they share our values
+    for (auto& it: parts) wait_for(*it);
+
+    std::vector<value> out;
+    for (auto& it: parts) {
+      if (!it->result.has_value()) return std::unexpected{it->result.error()};
+
+      auto const& part = *it->result->get<value::array>();
+      if (out.empty()) {
+        out = part;
+        continue;
+      }
+
+      for (size_t j = 0; j < ops.size(); j++) {
+        if (!out[j].is<value::num>() || !part[j].is<value::num>()) {
+          return std::unexpected{"Parallel for reductions have to stay numbers!"};
+        }
+
+        auto a = out[j].get<value::num>(), b = part[j].get<value::num>();
+        out[j] = value{ops[j] == '+' ? a + b : a * b};
+      }
+    }
+
+    return value{std::make_shared<value::array::element_type>(std::move(out))};
+  }
+}
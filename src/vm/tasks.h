@@ -0,0 +1,68 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include "vm.h"
+
+namespace tosuto::vm {
+  // fork/join for scripts. `t := spawn(: -> work(i))` queues the function on a
+  // work-stealing pool with one worker per core and returns a handle,
+  // `join(t)` waits for it and returns its result, helping with other tasks
+  // in the meantime. a task runs on a vm of the thread it lands on, against
+  // copies of the function and of the spawner's globals it can reach, and
+  // what it returns is copied back, so tasks never share anything mutable
+  // with their spawner.
+  //
+  // every spawn has to be joined. handles are plain numbers, so there's no
+  // telling when nobody holds one anymore, and a task that's never joined
+  // keeps its result and everything that holds alive until the process
+  // exits.
+
+  // deep copy that shares nothing mutable with the original, for handing
+  // values to another thread. fn_descs, strings and frozen values are
+  // immutable and stay shared, sharing and cycles within what's copied are
+  // kept. the upvals it makes belong to the closures and coroutines using
+  // them
+  struct copier {
+    std::unordered_map<void const*, value> seen;
+    std::map<std::pair<void const*, void const*>, value> closures;
+    std::unordered_map<upvalue const*, std::shared_ptr<upvalue>> upvals;
+
+    value copy(value const& val);
+  };
+
+  // copies the running vm's globals that fn can get at into out. those are
+  // the ones named by a string literal of any function it reaches, through
+  // its code or through what's copied, which may be a few more than it uses.
+  // frozen values are shared and only looked into if they hold functions
+  void copy_globals(copier& copy, value::function const& fn,
+                    std::unordered_map<value::str, value>& out);
+
+  // queues job on the pool
+  void post(std::function<void()> job);
+
+  // runs one queued job on this thread, if there is one. for anything that
+  // waits on the pool, so waiting never ties up a worker
+  bool help();
+
+  // how many threads the pool runs jobs on
+  size_t workers();
+
+  std::expected<value, std::string> spawn(std::span<value> args);
+
+  std::expected<value, std::string> join(std::span<value> args);
+
+  // what `@parallel for` compiles to, see parallel.cpp. runs
+  // chunk(lo, hi, seeds) over pieces of the range on the pool and folds the
+  // reductions each returns with ops, one '+' or '*' per reduction. unlike
+  // spawn nothing is copied, chunks share the caller's values and only read
+  // them or write what the compiler proved nobody else touches. seeds that
+  // aren't all numbers run the whole range as one chunk, since there's no
+  // telling what 0 and 1 are for them. so does a loop where something it
+  // reads, the locals in reads or the globals named in read_names, is or
+  // holds an array it writes, given the same way
+  //
+  //   @parallel_for(chunk, lo, hi, seeds, ops, writes, reads, write_names,
+  //                 read_names)
+  std::expected<value, std::string> parallel_for(std::span<value> args);
+}
@@ -0,0 +1,138 @@
+#include "compile.h"
+
+namespace tosuto::vm {
+  // flow-sensitive type inference for locals. the compiler tracks the static
+  // type of every local as it emits code and records the type of each value it
+  // leaves on the stack in last_type. where both operands of an arithmetic op
+  // are proven numbers it emits the unchecked *_nn opcodes instead.
+  //
+  // annotations (`x: num`, `s: str := ..`) are checked with chk where the
+  // value enters the local and on every later assignment that doesn't already
+  // prove the type, so an annotated local keeps its type for its whole life,
+  // loops included. annotated globals are checked the same way by every
+  // assignment this file compiles, code in imported modules and natives
+  // aren't.
+  //
+  // control flow merges join the types of every incoming path, locals a loop
+  // body assigns are forgotten for the whole loop, and locals written by a
+  // closure are never trusted, since any call may run that closure.
+
+  static_type join(static_type a, static_type b) {
+    return a == b ? a : static_type::any;
+  }
+
+  void compiler::find_closure_writes(node* n) {
+    if (n->type == node_type::fn_def || n->type == node_type::anon_fn_def) {
+      effects writes;
+      collect_effects(n, writes);
+      closure_writes.insert(writes.assigned.begin(), writes.assigned.end());
+      return;
+    }
+
+    for_each_child(n, [&](node* child) { find_closure_writes(child); });
+  }
+
+  void compiler::set_type(u16 slot, static_type type) {
+    auto& it = locals[slot];
+    if (!it.annotation.empty()) return;
+    it.type = closure_writes.contains(it.name) ? static_type::any : type;
+  }
+
+  void compiler::forget_types(std::unordered_set<std::string> const& names) {
+    for (auto& it: locals) {
+      if (names.contains(it.name) && it.annotation.empty()) {
+        it.type = static_type::any;
+      }
+    }
+  }
+
+  std::vector<static_type> compiler::save_types() const {
+    std::vector<static_type> out;
+    out.reserve(locals.size());
+    for (auto const& it: locals) out.push_back(it.type);
+    return out;
+  }
+
+  void compiler::restore_types(std::vector<static_type> const& types) {
+    for (size_t i = 0; i < locals.size(); i++) {
+      locals[i].type = i < types.size() ? types[i] : static_type::any;
+    }
+  }
+
+  std::vector<static_type>
+  compiler::join_types(std::vector<std::vector<static_type>> const& paths) {
+    std::vector<static_type> out = paths.front();
+    for (auto const& path: paths) {
+      out.resize(std::min(out.size(), path.size()));
+      for (size_t i = 0; i < out.size(); i++) out[i] = join(out[i], path[i]);
+    }
+
+    return out;
+  }
+
+  static_type compiler::type_of(node* n) {
+    switch (n->type) {
+      case node_type::number: return static_type::num;
+      case node_type::string: return static_type::str;
+      case node_type::field_get: {
+        auto it = static_cast<field_get_node*>(n);
+        if (it->target) return static_type::any;
+        auto local = resolve_local(it->field);
+        return local ? locals[*local].type : static_type::any;
+      }
+      case node_type::un_op: {
+        // neg either throws or gives a number
+        auto it = static_cast<un_op_node*>(n);
+        return it->op == tok_type::sub ? static_type::num : static_type::any;
+      }
+      case node_type::bin_op: {
+        auto it = static_cast<bin_op_node*>(n);
+        auto lhs = type_of(it->lhs.get()), rhs = type_of(it->rhs.get());
+        switch (it->op) {
+          case tok_type::add:
+            if (lhs == static_type::str && rhs == static_type::str) return lhs;
+            [[fallthrough]];
+          case tok_type::sub:
+          case tok_type::mul:
+          case tok_type::div:
+          case tok_type::mod:
+            return lhs == static_type::num && rhs == static_type::num
+                   ? static_type::num : static_type::any;
+          default: return static_type::any;
+        }
+      }
+      default: return static_type::any;
+    }
+  }
+
+  std::expected<void, std::string>
+  compiler::check_annotation(std::string const& name,
+                             std::string const& type_name) {
+    // the value alternative each annotation asks for
+    static const std::unordered_map<std::string, std::pair<u8, static_type>>
+      annotations{
+      {"num",  {index_of<value::num>, static_type::num}},
+      {"bool", {index_of<bool>, static_type::any}},
+      {"obj",  {index_of<value::object>, static_type::any}},
+      {"str",  {index_of<value::str>, static_type::str}},
+      {"fn",   {index_of<value::function>, static_type::any}},
+      {"arr",  {index_of<value::array>, static_type::any}},
+    };
+
+    auto it = annotations.find(type_name);
+    if (it == annotations.end()) {
+      return std::unexpected{"Unknown type " + type_name + " on " + name};
+    }
+
+    // nothing to check if the value is already known to fit
+    auto type = it->second.second;
+    if (type != static_type::any && last_type == type) return {};
+
+    cur_ch().add(op_code::chk);
+    cur_ch().add(it->second.first);
+    cur_ch().add(cur_ch().add_lit_get(value{value::str{name + ": " + type_name}}));
+    last_type = type;
+
+    return {};
+  }
+}
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <unordered_set>
 #include <utility>
 #include "value.h"
 #include "vm.h"
@@ -5,9 +7,9 @@
 namespace tosuto::vm {
   std::string value::to_string() const {
     switch (val.index()) {
-      case 0: return std::to_string(get<num>());
-      case 1: return std::to_string(get<bool>());
-      case 2: {
+      case index_of<value::num>: return std::to_string(get<num>());
+      case index_of<bool>: return std::to_string(get<bool>());
+      case index_of<value::object>: {
         std::string s = "{";
         auto& obj = get<object>();
         for (auto const& [k, v]: *obj) {
@@ -20,14 +22,14 @@ namespace tosuto::vm {
         if (s.back() != '{') s = s.substr(0, s.length() - 2);
         return s + '}';
       }
-      case 3: {
+      case index_of<value::ref>: {
         return get<ref>()->to_string();
       }
-      case 4: return "nil";
-      case 5: return get<str>();
-      case 6: return "<function " + std::string(get<function>().desc->chunk.name) + ">";
-      case 7: return "<native function>";
-      case 8: {
+      case index_of<value::nil>: return "nil";
+      case index_of<value::str>: return get<str>();
+      case index_of<value::function>: return "<function " + std::string(get<function>().desc->chunk.name) + ">";
+      case index_of<value::native_fn>: return "<native function>";
+      case index_of<value::array>: {
         std::string s = "[";
         auto& obj = get<array>();
         for (auto const& v: *obj) {
@@ -38,33 +40,111 @@ namespace tosuto::vm {
         if (s.back() != '[') s = s.substr(0, s.length() - 2);
         return s + ']';
       }
-      case 9: {
-        return "upvalue";
+      case index_of<value::coro>: {
+        return "<coroutine " + std::string(get<coro>()->fn.desc->chunk.name) + ">";
       }
+      case index_of<value::bytes>: return *get<bytes>();
       default: std::unreachable();
     }
   }
 
   bool value::is_truthy() const {
     switch (val.index()) {
-      case 1: return get<bool>();
-      case 4: return false;
+      case index_of<bool>: return get<bool>();
+      case index_of<value::nil>: return false;
       default: return true;
     }
   }
 
   bool value::eq(const value& other) const {
+    // bytes equal strs with the same characters
+    if (is<bytes>() || other.is<bytes>()) {
+      auto a = text(), b = other.text();
+      return a && b && *a == *b;
+    }
+
     if (val.index() != other.val.index()) return false;
     switch (val.index()) {
-      case 0: return fabs(get<num>() - other.get<num>()) < epsilon;
-      case 1: return get<bool>() == other.get<bool>();
-      case 4: return true;
-      case 5: return get<str>() == other.get<str>();
+      case index_of<value::num>: return fabs(get<num>() - other.get<num>()) < epsilon;
+      case index_of<bool>: return get<bool>() == other.get<bool>();
+      case index_of<value::nil>: return true;
+      case index_of<value::str>: return get<str>() == other.get<str>();
       default: return false;
     }
   }
 
+  std::string const* value::text() const {
+    if (is<str>()) return &static_cast<std::string const&>(get<str>());
+    if (is<bytes>()) return get<bytes>().get();
+    return nullptr;
+  }
+
   value::function::function() : desc{std::make_shared<fn_desc>(chunk{}, 0xff, std::nullopt)}, upvals{nullptr} {
 
   }
+
+  namespace {
+    // checked before anything's marked, so a failed freeze leaves v as it was.
+    // fns is set if it holds any function
+    bool freezable(value const& val, std::unordered_set<void const*>& seen,
+                   bool& fns) {
+      switch (val.val.index()) {
+        case index_of<value::object>: {
+          auto const& obj = val.get<value::object>();
+          if (obj->frozen) fns = fns || obj->holds_fns;
+          if (obj->frozen || !seen.emplace(obj.get()).second) return true;
+          return std::ranges::all_of(*obj, [&](auto const& it) {
+            return freezable(it.second, seen, fns);
+          });
+        }
+        case index_of<value::ref>:
+        case index_of<value::coro>: return false;
+        case index_of<value::function>: {
+          auto const& fn = val.get<value::function>();
+          fns = true;
+          return !fn.upvals || fn.desc->num_upvals == 0;
+        }
+        case index_of<value::array>: {
+          auto const& arr = val.get<value::array>();
+          if (arr->frozen) fns = fns || arr->holds_fns;
+          if (arr->frozen || !seen.emplace(arr.get()).second) return true;
+          return std::ranges::all_of(*arr, [&](value const& it) {
+            return freezable(it, seen, fns);
+          });
+        }
+        default: return true;
+      }
+    }
+
+    // everything newly frozen gets the same holds_fns, which errs on the
+    // side of looking into too much
+    void mark(value const& val, bool fns) {
+      if (val.is<value::object>()) {
+        auto& obj = *val.get<value::object>();
+        if (obj.frozen) return;
+
+        obj.frozen = true;
+        obj.holds_fns = fns;
+        for (auto const& [k, v]: obj) mark(v, fns);
+      } else if (val.is<value::array>()) {
+        auto& arr = *val.get<value::array>();
+        if (arr.frozen) return;
+
+        arr.frozen = true;
+        arr.holds_fns = fns;
+        for (auto const& v: arr) mark(v, fns);
+      }
+    }
+  }
+
+  std::expected<value, std::string> freeze(std::span<value> args) {
+    std::unordered_set<void const*> seen;
+    bool fns = false;
+    if (!freezable(args[0], seen, fns)) {
+      return std::unexpected{"freeze() can't take closures, refs or coroutines!"};
+    }
+
+    mark(args[0], fns);
+    return args[0];
+  }
 }
@@ -7,21 +7,29 @@
 #include <cmath>
 #include <expected>
 #include <span>
+#include <type_traits>
+#include <utility>
 #include "../tosuto.h"
 
 namespace tosuto::vm {
   struct chunk;
   struct fn_desc;
+  struct object_fields;
+  struct array_items;
 
   struct value {
     using num = double;
     constexpr static num epsilon = std::numeric_limits<num>::epsilon();
 
     using str = interned_string;
-    using object = std::shared_ptr<std::unordered_map<str, value>>;
+    using object = std::shared_ptr<object_fields>;
     using ref = std::shared_ptr<value>;
     using native_fn = std::pair<std::expected<value, std::string>(*)(std::span<value> args), u8>;
-    using array = std::shared_ptr<std::vector<value>>;
+    using array = std::shared_ptr<array_items>;
+    using coro = std::shared_ptr<struct coroutine>;
+    // text that came in through i/o. unlike str it isn't interned, so it's
+    // freed once nothing holds it, and it never changes once made
+    using bytes = std::shared_ptr<std::string const>;
 
     struct nil {
     };
@@ -47,8 +55,12 @@ namespace tosuto::vm {
       str,
       function,
       native_fn,
-      array>;
+      array,
+      coro,
+      bytes>;
 
+    // chk's operand is an index into this, so reordering it needs a new
+    // cache_version, see cache.h
     value_type val;
 
     template<typename T>
@@ -71,12 +83,52 @@ namespace tosuto::vm {
     [[nodiscard]] bool is_truthy() const;
 
     [[nodiscard]] bool eq(value const& other) const;
+
+    // the characters of a str or bytes, null for anything else
+    [[nodiscard]] std::string const* text() const;
+  };
+
+  // the index of T in value_type, for switching on val.index() without
+  // depending on the order of the alternatives
+  template<typename T>
+  constexpr u8 index_of = []<size_t... I>(std::index_sequence<I...>) {
+    using alts = value::value_type;
+    static_assert((std::is_same_v<T, std::variant_alternative_t<I, alts>> + ...) == 1,
+                  "not a value alternative");
+    return u8(((std::is_same_v<T, std::variant_alternative_t<I, alts>> ? I : 0) + ...));
+  }(std::make_index_sequence<std::variant_size_v<value::value_type>>{});
+
+  // frozen objects and arrays reject writes and are shared as they are
+  // instead of copied, see freeze. holds_fns says whether a function is
+  // anywhere in what a frozen one reaches, see copy_globals in tasks.h
+  struct object_fields : std::unordered_map<value::str, value> {
+    using unordered_map::unordered_map;
+    bool frozen = false;
+    bool holds_fns = false;
+    // the gc's, see gc.h
+    u32 gc_mark = 0;
   };
 
+  struct array_items : std::vector<value> {
+    using vector::vector;
+    bool frozen = false;
+    bool holds_fns = false;
+    u32 gc_mark = 0;
+
+    explicit array_items(std::vector<value> items) : vector(std::move(items)) {}
+  };
+
+  // freezes v and everything it holds for good, so it can be shared
+  // between threads and isolates without copies or locks. closures with
+  // upvals, refs and coroutines stay mutable, so values holding any can't
+  // be frozen. strings are immutable anyway
+  std::expected<value, std::string> freeze(std::span<value> args);
+
   struct upvalue {
     value* loc;
     value closed = value{value::nil{}};
     upvalue* next = nullptr;
+    u32 gc_mark = 0;
 
     inline explicit upvalue(value* loc) : loc(loc) {}
   };
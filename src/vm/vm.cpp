@@ -1,4 +1,8 @@
 #include "vm.h"
+#include "coro.h"
+#include "loop.h"
+#include "profile.h"
+#include "stats.h"
 #include <iomanip>
 #include <iostream>
 
@@ -16,6 +20,10 @@ namespace tosuto::vm {
       if (!it.is<value::function>()) continue;
       auto& fn = it.get<value::function>();
       out << std::string(name) << "." << std::string(fn.desc->chunk.name) << ":\n";
+      if (!fn.desc->is_compiled()) {
+        out << "(compiled on first call)\n\n";
+        continue;
+      }
       fn.desc->chunk.disasm(out, false);
       out << "\n";
     }
@@ -24,6 +32,9 @@ namespace tosuto::vm {
   size_t chunk::disasm_instr(std::ostream& out, size_t idx) {
     auto off = std::to_string(idx);
     auto padding = std::string(4 - off.size(), '0');
+#ifdef AMI_OPCODE_STATS
+    out << std::right << std::setw(12) << sites.at(idx) << ' ';
+#endif
     out << padding << off << ' ';
 
 #define AMI_DISASM_SIMPLE_INSTR(op) case op_code::op: \
@@ -54,11 +65,20 @@ namespace tosuto::vm {
       AMI_DISASM_SIMPLE_INSTR(inv);
       AMI_DISASM_SIMPLE_INSTR(ld_0);
       AMI_DISASM_SIMPLE_INSTR(ld_1);
+      AMI_DISASM_SIMPLE_INSTR(yield);
       AMI_DISASM_SIMPLE_INSTR(new_obj);
       AMI_DISASM_SIMPLE_INSTR(szd_arr);
       AMI_DISASM_SIMPLE_INSTR(idx_g);
       AMI_DISASM_SIMPLE_INSTR(idx_s);
       AMI_DISASM_SIMPLE_INSTR(upval_c);
+      AMI_DISASM_SIMPLE_INSTR(add_nn);
+      AMI_DISASM_SIMPLE_INSTR(sub_nn);
+      AMI_DISASM_SIMPLE_INSTR(mul_nn);
+      AMI_DISASM_SIMPLE_INSTR(div_nn);
+      AMI_DISASM_SIMPLE_INSTR(mod_nn);
+      AMI_DISASM_SIMPLE_INSTR(lt_nn);
+      AMI_DISASM_SIMPLE_INSTR(gt_nn);
+      AMI_DISASM_SIMPLE_INSTR(add_ss);
       AMI_DISASM_SIMPLE_INSTR_2(key_true, true);
       AMI_DISASM_SIMPLE_INSTR_2(key_with, with);
       AMI_DISASM_SIMPLE_INSTR_2(key_false, false);
@@ -137,6 +157,12 @@ namespace tosuto::vm {
             << "(" << idx << "->" << idx + 3 + rd_u16(idx + 1) << ")" << '\n';
         return idx + 3;
       }
+      case op_code::jmpt: {
+        out << std::left << std::setw(9) << "jmpt"
+            << std::left << std::setw(10) << rd_u16(idx + 1)
+            << "(" << idx << "->" << idx + 3 + rd_u16(idx + 1) << ")" << '\n';
+        return idx + 3;
+      }
       case op_code::jmp: {
         out << std::left << std::setw(9) << "jmp"
             << std::left << std::setw(10) << rd_u16(idx + 1)
@@ -149,6 +175,10 @@ namespace tosuto::vm {
             << "(" << idx << "->" << idx + 3 + rd_u16(idx + 1) << ")" << '\n';
         return idx + 3;
       }
+      case op_code::chk: {
+        out << std::left << std::setw(9) << "chk" << lit_16(idx + 2) << '\n';
+        return idx + 4;
+      }
       case op_code::call: {
         out << std::left << std::setw(9) << "call"
             << std::to_string(rd_u8(idx + 1)) << '\n';
@@ -185,22 +215,51 @@ namespace tosuto::vm {
     if (a.is<value::num>() && b.is<value::num>()) { \
       push_top() = value{a.get<value::num>() op b.get<value::num>()}; \
     } else if (a.is<value::object>() && a.get<value::object>()->contains(op_name)) {    \
+      auto& fn = a.get<value::object>()->at(op_name).get<value::function>(); \
+      if (!fn.desc->is_compiled()) {ami_discard(compile_lazy(fn));} \
       push_top() = value{a.get<value::object>()->at(op_name)};        \
       push_top() = value{a};                        \
       push_top() = std::move(b);                        \
-      frames.emplace_back(a.get<value::object>()->at(op_name).get<value::function>(), 0, stack.size() - 2 - 1);\
+      frames.emplace_back(a.get<value::object>()->at(op_name).get<value::function>(), 0, stack_top - stack.data() - 2);\
+      update_stack_frame(false); \
     } else              \
       return std::unexpected{"Couldn't do " + a.to_string() + #op + b.to_string()}; \
   } while(false)
 
+// no type checks, the compiler proved both sides are numbers
+#define AMI_NUM_OP(op) \
+  do {                 \
+    auto b = *std::get_if<value::num>(&(stack_top--)->val); \
+    auto a = *std::get_if<value::num>(&stack_top->val);     \
+    peek_top() = value{a op b}; \
+  } while(false)
+
+    // natives can run other vms on this thread, see tasks.cpp
+    struct restore_current {
+      vm* outer;
+
+      ~restore_current() {
+        current = outer;
+        // nor is the time we took, which we sampled ourselves
+        if (outer) outer->profile_seen = profile_ticks.load(std::memory_order_relaxed);
+      }
+    } restore{std::exchange(current, this)};
+
+    // only time spent in here is ours to sample, see profile.h
+    profile_seen = profile_ticks.load(std::memory_order_relaxed);
+
     auto* frame = &frames.back();
-    u8* ip = frame->fn.desc->chunk.data.data();
+    u8* ip = frame->fn.desc->chunk.data.data() + frame->ip;
     u8** ip_stack;
     u8* internal[max_of<u8>];
     ip_stack = &internal[0];
+    // frames under the top one carry on from their last call
+    for (size_t i = 0; i + 1 < frames.size(); i++) {
+      *(ip_stack++) = frames[i].fn.desc->chunk.data.data() + frames[i].ip;
+    }
     value* lits = frame->fn.desc->chunk.literals.data();
-    size_t frame_offset = 0;
-    value* stack_top = stack.data();
+    size_t frame_offset = frame->offset;
+    value* stack_top = stack.data() + resume_top;
     auto update_stack_frame =
       [this, &ip, &frame, &lits, &frame_offset, &ip_stack](bool pop) {
         frame = &frames.back();
@@ -223,8 +282,165 @@ namespace tosuto::vm {
 #define rd_lit_16() (ip += 2, lits[*(u16*)(&ip[-2])])
 #define rd_lit_8() (lits[*ip++])
 #define rd_op() (op_code(*ip++))
+#define AMI_PROFILE_POINT() \
+  if (profile_ticks.load(std::memory_order_relaxed) != profile_seen) [[unlikely]] \
+    record_sample(*this, internal, ip)
+
+    // resume(co) with co on top. the segment goes where the call's callee
+    // was and the frames on top of ours, as if it had been called. sent is
+    // what the yield it stopped at evaluates to
+    auto resume_coro =
+      [&](value sent, bool from_loop) -> std::expected<void, std::string> {
+      if (!peek_top().is<value::coro>()) {
+        return std::unexpected{"Can't resume " + peek_top().to_string()};
+      }
+
+      auto co = peek_top().get<value::coro>();
+      if (co->state == coroutine::status::running) {
+        return std::unexpected{"Coroutine is already running!"};
+      }
+      if (co->state == coroutine::status::done) {
+        return std::unexpected{"Coroutine is done!"};
+      }
+      if (co->state == coroutine::status::waiting && !from_loop) {
+        return std::unexpected{"Coroutine is waiting on the event loop!"};
+      }
+      if (!co->fn.desc->is_compiled()) {
+        ami_discard(compile_lazy(co->fn));
+      }
+
+      size_t base = stack_top - 1 - stack.data();
+      coros.push_back({co, base, frames.size(), from_loop});
+      *(ip_stack++) = ip;
+
+      // the loop's ones may have been queued before they ever ran
+      if (co->frames.empty()) {
+        stack[base] = value{co->fn};
+        stack_top = &stack[base];
+        frames.emplace_back(co->fn, 0, base);
+        ip = co->fn.desc->chunk.data.data();
+      } else {
+        for (size_t i = 0; i < co->stack.size(); i++) {
+          stack[base + i] = std::move(co->stack[i]);
+        }
+        stack_top = &stack[base + co->stack.size() - 1];
+
+        for (size_t i = 0; i < co->frames.size(); i++) {
+          auto& saved = co->frames[i];
+          frames.emplace_back(saved.fn, 0, base + saved.offset);
+          u8* at = saved.fn.desc->chunk.data.data() + saved.ip;
+          if (i + 1 < co->frames.size()) *(ip_stack++) = at;
+          else ip = at;
+        }
+
+        // its open upvals are all above ours
+        for (size_t i = 0; i < co->upvals.size(); i++) {
+          auto* upval = co->upvals[i];
+          upval->loc = stack.data() + base + (upval->loc - co->stack.data());
+          upval->next = i + 1 < co->upvals.size() ? co->upvals[i + 1] : open_upvals;
+        }
+        if (!co->upvals.empty()) open_upvals = co->upvals.front();
+        co->upvals.clear();
+        co->stack.clear();
+
+        push_top() = std::move(sent);
+      }
+
+      co->state = coroutine::status::running;
+      frame = &frames.back();
+      lits = frame->fn.desc->chunk.literals.data();
+      frame_offset = frame->offset;
+      return {};
+    };
+
+    // moves the innermost coroutine's segment and frames out of the way and
+    // returns the yielded value from its resume()
+    auto yield_coro = [&]() -> std::expected<void, std::string> {
+      if (coros.empty()) {
+        return std::unexpected{"Can't yield outside of a coroutine!"};
+      }
+
+      auto [co, base, frame_base, from_loop] = std::move(coros.back());
+      coros.pop_back();
+      auto result = pop_top();
+
+      // before the segment moves, frames refer to their callee's slot. a
+      // frame's ip is what got pushed when the next one was entered, the
+      // innermost one's is ours
+      std::vector<coroutine::saved_frame> saved;
+      for (size_t i = frame_base; i < frames.size(); i++) {
+        u8* at = i + 1 < frames.size() ? internal[i] : ip;
+        auto& fn = frames[i].fn;
+        saved.push_back({fn, size_t(at - fn.desc->chunk.data.data()),
+                         frames[i].offset - base});
+      }
+      co->frames = std::move(saved);
+
+      co->stack.clear();
+      for (value* it = stack.data() + base; it <= stack_top; it++) {
+        co->stack.push_back(std::move(*it));
+      }
+      // same as close_upvals, the segment leaves the stack for something
+      // that may be traced already
+      if (gc.marking) [[unlikely]] gc.gray.push_back(value{co});
+
+      while (open_upvals && open_upvals->loc >= stack.data() + base) {
+        auto* upval = open_upvals;
+        upval->loc = co->stack.data() + (upval->loc - (stack.data() + base));
+        co->upvals.push_back(upval);
+        open_upvals = upval->next;
+      }
+
+      while (frames.size() > frame_base) frames.pop_back();
+      // the loop's ones go back in its queue unless a native parked them
+      if (from_loop) {
+        co->state = coroutine::status::waiting;
+        if (!park) schedule(*this, co, value{value::nil{}});
+      } else {
+        co->state = coroutine::status::suspended;
+      }
+      park = false;
+
+      ip_stack = &internal[frame_base];
+      update_stack_frame(true);
+      stack_top = stack.data() + base;
+      peek_top() = std::move(result);
+      if (from_loop) stack_top--;
+      return {};
+    };
+
+    // run_loop() resumes whatever the event loop has ready on top of its
+    // callee slot, with the return address pointing back at the call. so
+    // each time one yields or returns it gets called again, until nothing's
+    // left to wait for
+    auto drive_loop = [&]() -> std::expected<void, std::string> {
+      if (!coros.empty() && coros.back().from_loop) {
+        return std::unexpected{"Can't run the event loop from inside it!"};
+      }
+
+      auto next = ami_unwrap(next_wakeup(*this));
+      if (!next) {
+        peek_top() = value{value::nil{}};
+        return {};
+      }
+
+      ip -= 2;
+      push_top() = value{value::nil{}};
+      push_top() = value{next->co};
+      ami_discard(resume_coro(std::move(next->sent), true));
+      // fails the call that parked it, now that it's the one running
+      if (next->error) return std::unexpected{std::move(*next->error)};
+      return {};
+    };
+
+#ifdef AMI_OPCODE_STATS
+    op_timer ops;
+#endif
 
     for (;;) {
+#ifdef AMI_OPCODE_STATS
+      ops.next(frame->fn.desc->chunk, ip);
+#endif
 #ifndef NDEBUG
       out << "[ ";
       for (value* it = stack.data(); it <= stack_top; it++) {
@@ -237,17 +453,27 @@ namespace tosuto::vm {
 
       switch (rd_op()) {
         case op_code::ret: {
+          AMI_PROFILE_POINT();
           auto result = pop_top();
           close_upvals(stack.data() + frame_offset - 1);
           auto last_frame = frames.back();
           frames.pop_back();
+          bool drop = false;
+          if (!coros.empty() && frames.size() == coros.back().frame_base) {
+            // the coroutine returned, which resume() hands back like a yield
+            drop = coros.back().from_loop;
+            coros.back().co->state = coroutine::status::done;
+            coros.pop_back();
+          }
           if (frames.empty()) {
+            returned = std::move(result);
             return {};
           }
 
           update_stack_frame(true);
           stack_top = stack.data() + last_frame.offset - 1;
           push_top() = std::move(result);
+          if (drop) stack_top--;
           break;
         }
         case op_code::ld_0: {
@@ -289,15 +515,24 @@ namespace tosuto::vm {
             push_top() = value{a.get<value::num>() + b.get<value::num>()};
           } else if (a.is<value::str>() && b.is<value::str>()) {
             push_top() = value{a.get<value::str>() + b.get<value::str>()};
+          } else if ((a.is<value::bytes>() || b.is<value::bytes>()) &&
+                     a.text() && b.text()) {
+            // stays uninterned, a server appending what it receives would
+            // intern every prefix otherwise
+            push_top() = value{std::make_shared<std::string const>(*a.text() + *b.text())};
           } else if (a.is<value::object>() &&
                      a.get<value::object>()->contains(op_name)) {
-            \
+            auto& fn = a.get<value::object>()->at(op_name).get<value::function>();
+            if (!fn.desc->is_compiled()) {
+              ami_discard(compile_lazy(fn));
+            }
+
             push_top() = value{a.get<value::object>()->at(op_name)};        \
             push_top() = a;                        \
             push_top() = std::move(b);                        \
             frames.emplace_back(
               a.get<value::object>()->at(op_name).get<value::function>(), 0,
-              stack.size() - 2 - 1);\
+              stack_top - stack.data() - 2);\
             update_stack_frame(false);
           } else {
             return std::unexpected{
@@ -323,13 +558,17 @@ namespace tosuto::vm {
             push_top() = value{fmod(a.get<value::num>(), b.get<value::num>())};
           } else if (a.is<value::object>() &&
                      a.get<value::object>()->contains(op_name)) {
-            \
+            auto& fn = a.get<value::object>()->at(op_name).get<value::function>();
+            if (!fn.desc->is_compiled()) {
+              ami_discard(compile_lazy(fn));
+            }
+
             push_top() = value{a.get<value::object>()->at(op_name)};        \
             push_top() = a;                        \
             push_top() = std::move(b);                        \
             frames.emplace_back(
               a.get<value::object>()->at(op_name).get<value::function>(), 0,
-              stack.size() - 2 - 1);\
+              stack_top - stack.data() - 2);\
             update_stack_frame(false);
           } else {
             return std::unexpected{
@@ -359,6 +598,7 @@ namespace tosuto::vm {
           auto it = globals.find(name);
           if (it != globals.end()) {
             it->second = peek_top();
+            gc.written(it->second);
           } else {
             return std::unexpected{
               "Could not find " + std::string(name) + " in globals!"};
@@ -380,7 +620,9 @@ namespace tosuto::vm {
         }
         case op_code::glob_d: {
           auto name = rd_lit_16().get<value::str>();
-          globals[name] = pop_top();
+          auto& it = globals[name];
+          it = pop_top();
+          gc.written(it);
           break;
         }
         case op_code::loc_g: {
@@ -403,6 +645,48 @@ namespace tosuto::vm {
           ip += off;
           break;
         }
+        case op_code::jmpt: {
+          u16 off = rd_u16();
+          if (peek_top().is_truthy()) ip += off;
+          break;
+        }
+        case op_code::add_nn:AMI_NUM_OP(+);
+          break;
+        case op_code::sub_nn:AMI_NUM_OP(-);
+          break;
+        case op_code::mul_nn:AMI_NUM_OP(*);
+          break;
+        case op_code::div_nn:AMI_NUM_OP(/);
+          break;
+        case op_code::lt_nn:AMI_NUM_OP(<);
+          break;
+        case op_code::gt_nn:AMI_NUM_OP(>);
+          break;
+        case op_code::add_ss: {
+          auto b = *std::get_if<value::str>(&(stack_top--)->val);
+          auto& a = *std::get_if<value::str>(&stack_top->val);
+          peek_top() = value{a + b};
+          break;
+        }
+        case op_code::chk: {
+          u8 kind = rd_u8();
+          auto& name = rd_lit_16();
+          auto idx = peek_top().val.index();
+          // natives pass as fn too
+          if (idx != kind && !(kind == index_of<value::function> &&
+                               idx == index_of<value::native_fn>)) {
+            return std::unexpected{
+              "Expected " + name.to_string() + ", got " +
+              peek_top().to_string()};
+          }
+          break;
+        }
+        case op_code::mod_nn: {
+          auto b = *std::get_if<value::num>(&(stack_top--)->val);
+          auto a = *std::get_if<value::num>(&stack_top->val);
+          peek_top() = value{fmod(a, b)};
+          break;
+        }
         case op_code::jmpf_pop: {
           u16 off = rd_u16();
           value it = pop_top();
@@ -413,16 +697,49 @@ namespace tosuto::vm {
           u16 off = rd_u16();
           value it = pop_top();
           if (it.is_truthy()) ip -= off;
+          AMI_PROFILE_POINT();
           break;
         }
         case op_code::call: {
           u8 arity = rd_u8();
-          ami_discard_fast(
-            call(peek_off_top(arity), arity, stack_top, update_stack_frame));
+          AMI_PROFILE_POINT();
+          // natives may want to know where they were called from
+          frame->ip = ip - frame->fn.desc->chunk.data.data();
+          auto& callee = peek_off_top(arity);
+          if (callee.is<value::native_fn>()) {
+            auto native = callee.get<value::native_fn>().first;
+            if (arity == 1 && native == &resume) {
+              ami_discard(resume_coro(value{value::nil{}}, false));
+              break;
+            }
+            if (arity == 0 && native == &run_loop) {
+              ami_discard(drive_loop());
+              break;
+            }
+          }
+          // not _fast, a lazily compiled body can fail to compile here
+          ami_discard(call(callee, arity, stack_top, update_stack_frame));
+          if (park) {
+            ami_discard(yield_coro());
+          } else if (pause) [[unlikely]] {
+            pause = false;
+            paused = true;
+            for (size_t i = 0; i + 1 < frames.size(); i++) {
+              frames[i].ip = internal[i] - frames[i].fn.desc->chunk.data.data();
+            }
+            frame->ip = ip - frame->fn.desc->chunk.data.data();
+            resume_top = stack_top - stack.data();
+            return {};
+          }
+          break;
+        }
+        case op_code::yield: {
+          ami_discard(yield_coro());
           break;
         }
         case op_code::new_obj: {
           push_top() = value{std::make_unique<value::object::element_type>()};
+          if (gc.track(peek_top())) [[unlikely]] gc_step(*this, stack_top);
           break;
         }
         case op_code::prop_d: {
@@ -431,6 +748,7 @@ namespace tosuto::vm {
           value obj = peek_top();
           auto& obj_fields = obj.get<value::object>();
           obj_fields->operator[](name) = field_val;
+          gc.written(field_val);
           break;
         }
         case op_code::prop_g: {
@@ -451,8 +769,13 @@ namespace tosuto::vm {
           value val = pop_top();
           value obj = pop_top();
           auto& obj_fields = obj.get<value::object>();
+          if (obj_fields->frozen) [[unlikely]] {
+            return std::unexpected{
+              "Can't set " + std::string(name) + " on frozen " + obj.to_string()};
+          }
 
           obj_fields->operator[](name) = val;
+          gc.written(val);
           push_top() = std::move(val);
           break;
         }
@@ -480,6 +803,7 @@ namespace tosuto::vm {
 
           push_top() = value{std::make_shared<value::array::element_type>(
             size_t(size.get<value::num>()), val)};
+          if (gc.track(peek_top())) [[unlikely]] gc_step(*this, stack_top);
           break;
         }
         case op_code::key_with: {
@@ -493,6 +817,8 @@ namespace tosuto::vm {
 
           auto a_fields = *a.get<value::object>();
           auto& b_fields = *b.get<value::object>();
+          a_fields.frozen = false;
+          a_fields.gc_mark = 0;
 
           for (auto const& [k, v]: b_fields) {
             a_fields[k] = v;
@@ -500,7 +826,7 @@ namespace tosuto::vm {
 
           push_top() =
             value{std::make_shared<value::object::element_type>(a_fields)};
-
+          if (gc.track(peek_top())) [[unlikely]] gc_step(*this, stack_top);
           break;
         }
         case op_code::idx_s: {
@@ -513,9 +839,15 @@ namespace tosuto::vm {
               "Can't perform " + array.to_string() + "[" + index.to_string() +
               "]"};
           }
+          if (array.get<value::array>()->frozen) [[unlikely]] {
+            return std::unexpected{
+              "Can't set " + array.to_string() + "[" + index.to_string() +
+              "], it's frozen"};
+          }
 
           array.get<value::array>()->at(
             size_t(floor(index.get<value::num>()))) = val;
+          gc.written(val);
           push_top() = std::move(val);
           break;
         }
@@ -528,6 +860,7 @@ namespace tosuto::vm {
 
           stack_top -= size;
           push_top() = std::move(val);
+          if (gc.track(peek_top())) [[unlikely]] gc_step(*this, stack_top);
           break;
         }
         case op_code::upval_g: {
@@ -538,6 +871,7 @@ namespace tosuto::vm {
         case op_code::upval_s: {
           u16 slot = rd_u16();
           *frame->fn.upvals[slot]->loc = peek_top();
+          gc.written(peek_top());
           break;
         }
         case op_code::upval_c: {
@@ -566,11 +900,43 @@ namespace tosuto::vm {
     }
   }
 
+  thread_local vm* vm::current = nullptr;
+
+  std::expected<value, std::string>
+  vm::run_fn(value::function& fn, std::ostream& out,
+             std::span<value const> args) {
+    if (!fn.desc->is_compiled()) {
+      ami_discard(compile_lazy(fn));
+    }
+
+    frames.clear();
+    frames.emplace_back(fn, 0, 0);
+    stack[0] = value{fn};
+    for (size_t i = 0; i < args.size(); i++) stack[i + 1] = args[i];
+    resume_top = args.size();
+    open_upvals = nullptr;
+    returned = value{value::nil{}};
+    paused = false;
+
+    ami_discard(run(out));
+    return std::move(returned);
+  }
+
+  std::expected<void, std::string>
+  vm::resume_run(value sent, std::ostream& out) {
+    stack[resume_top] = std::move(sent);
+    paused = false;
+    return run(out);
+  }
+
   void vm::close_upvals(value* last) {
     while (open_upvals && open_upvals->loc >= last) {
       auto* upval = open_upvals;
       upval->closed = std::move(*upval->loc);
       upval->loc = &upval->closed;
+      // off the stack, where the gc looks again, and into an upval it may
+      // have traced already
+      gc.written(upval->closed);
       open_upvals = upval->next;
     }
   }
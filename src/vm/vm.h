@@ -1,8 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <stack>
+#include <unordered_set>
 #include "../tosuto.h"
 #include "value.h"
+#include "gc.h"
 #include <utility>
 #include <variant>
 
@@ -51,12 +54,109 @@ namespace tosuto::vm {
     upval_g,
     upval_s,
     upval_c,
+    jmpt,
+    // operands proven to be numbers at compile time
+    add_nn,
+    sub_nn,
+    mul_nn,
+    div_nn,
+    mod_nn,
+    lt_nn,
+    gt_nn,
+    add_ss,
+    chk,
+    yield,
   };
 
+  constexpr u16 op_count = std::to_underlying(op_code::yield) + 1;
+
+  static std::string to_string(op_code op) {
+    static const std::string op_code_to_string[]{
+      "ret",
+      "neg",
+      "add",
+      "mul",
+      "sub",
+      "div",
+      "mod",
+      "pop",
+      "pop_loc",
+      "eq",
+      "gt",
+      "lt",
+      "inv",
+      "key_nil",
+      "key_false",
+      "key_true",
+      "glob_g",
+      "glob_s",
+      "glob_d",
+      "loc_g",
+      "loc_s",
+      "jmpf",
+      "jmp",
+      "jmpf_pop",
+      "jmpb_pop",
+      "call",
+      "prop_d",
+      "prop_g",
+      "prop_s",
+      "idx_g",
+      "idx_s",
+      "array",
+      "szd_arr",
+      "key_with",
+      "new_obj",
+      "lit_8",
+      "lit_16",
+      "ld_0",
+      "ld_1",
+      "closure",
+      "upval_g",
+      "upval_s",
+      "upval_c",
+      "jmpt",
+      "add_nn",
+      "sub_nn",
+      "mul_nn",
+      "div_nn",
+      "mod_nn",
+      "lt_nn",
+      "gt_nn",
+      "add_ss",
+      "chk",
+      "yield",
+    };
+    static_assert(std::size(op_code_to_string) == op_count);
+
+    return op_code_to_string[std::to_underlying(op)];
+  }
+
+#ifdef AMI_OPCODE_STATS
+  // how often each instruction of a chunk ran, by offset, see stats.h
+  struct site_counts {
+    // made on the first run, the code doesn't change after that
+    std::atomic<u64*> counts = nullptr;
+
+    site_counts() = default;
+    // a copy is new code as far as counting goes
+    site_counts(site_counts const&) {}
+    site_counts& operator=(site_counts const&) { return *this; }
+    ~site_counts() { delete[] counts.load(); }
+
+    u64* get(size_t size);
+
+    [[nodiscard]] u64 at(size_t offset) const;
+  };
+#endif
+
   struct chunk {
     std::vector<u8> data;
     std::vector<value> literals;
     value::str name;
+#ifdef AMI_OPCODE_STATS
+    site_counts sites;
+#endif
 
     inline explicit chunk(value::str&& name) : name(name) {}
 
@@ -128,6 +228,51 @@ namespace tosuto::vm {
     chunk chunk;
     u8 arity = 0xff;
     std::optional<u8> varargs_start;
+    u16 num_upvals = 0;
+    // set until the body is compiled on its first call, see lazy.cpp
+    std::shared_ptr<struct lazy_fn> lazy;
+    // descs are shared by vms on other threads, so this is what says
+    // whether lazy is done with
+    std::atomic<bool> compiled = true;
+
+    [[nodiscard]] inline bool is_compiled() const {
+      return compiled.load(std::memory_order_acquire);
+    }
+  };
+
+  // compiles a function whose body was deferred, defined in lazy.cpp
+  std::expected<void, std::string> compile_lazy(value::function& fn);
+
+  // a coroutine's own stack segment and frames. they live on the vm's stack
+  // while it runs and get moved here when it yields, see vm::run
+  struct coroutine {
+    enum class status : u8 {
+      fresh,
+      suspended,
+      running,
+      // queued on or parked in the event loop, see loop.h
+      waiting,
+      done
+    };
+
+    struct saved_frame {
+      value::function fn;
+      // into fn's code
+      size_t ip;
+      // from the start of the segment
+      size_t offset;
+    };
+
+    value::function fn;
+    status state = status::fresh;
+    std::vector<value> stack;
+    std::vector<saved_frame> frames;
+    // open upvals into the segment, topmost first. they point into stack
+    // while suspended, so closures that escaped still see the locals
+    std::vector<upvalue*> upvals;
+    // the ones a copier made for it, which nothing else frees, see tasks.h
+    std::vector<std::shared_ptr<upvalue>> owned_upvals;
+    u32 gc_mark = 0;
   };
 
   struct call_frame {
@@ -143,10 +288,52 @@ namespace tosuto::vm {
     std::vector<value> stack;
     std::unordered_map<value::str, value> globals;
     upvalue* open_upvals = nullptr;
+    // where snapshot() writes to and what it's keyed by, see snapshot.h
+    std::string snapshot_path;
+    u64 snapshot_key = 0;
+    // stack top run() starts from, only set when resuming a snapshot or a
+    // paused run
+    size_t resume_top = 0;
+    // what the outermost function returned
+    value returned = value{value::nil{}};
+
+    // coroutines being run, innermost last. base is the stack slot their
+    // segment starts at, frame_base the index of their first frame. the
+    // event loop's drop what they yield and go back to run_loop()
+    struct running_coro {
+      value::coro co;
+      size_t base;
+      size_t frame_base;
+      bool from_loop = false;
+    };
+    std::vector<running_coro> coros;
+    // set by natives that parked the running coroutine in the event loop,
+    // which makes the call yield it. the loop is made on first use
+    bool park = false;
+    std::shared_ptr<struct event_loop> loop;
+
+    // set by natives that have to stop the whole run, like receive() with
+    // an empty mailbox. run() then returns with paused set and resume_run()
+    // carries on from the call, see actors.h
+    bool pause = false;
+    bool paused = false;
+    // the actor this vm runs as, or just the mailbox it receives on
+    std::shared_ptr<struct isolate> self;
+    // what it allocated, for the cycle collector
+    heap gc;
+    // modules that already ran on it, see modules.h
+    std::unordered_set<std::string> imported;
+    // profiler tick it last sampled at, see profile.h
+    u64 profile_seen = 0;
+
+    // the vm running on this thread, for natives that need it
+    static thread_local vm* current;
 
     inline explicit vm(value::function& fn) : frames{call_frame{fn, 0, 0}},
                                               stack() {
-      stack.reserve(max_of<u16>);
+      // every slot is constructed, run() assigns over whatever it finds and
+      // a freed vm's memory can come back here
+      stack.resize(max_of<u16>);
       frames.reserve(max_of<u8>);
       stack[0] = value{frames.back().fn};
     }
@@ -157,12 +344,22 @@ namespace tosuto::vm {
 
     std::expected<void, std::string> run(std::ostream& out);
 
+    // runs fn from a clean stack and returns its result, for vms that get
+    // reused for one function after another
+    std::expected<value, std::string>
+    run_fn(value::function& fn, std::ostream& out,
+           std::span<value const> args = {});
+
+    // carries on with a paused run, sent is what the call that paused it
+    // evaluates to
+    std::expected<void, std::string> resume_run(value sent, std::ostream& out);
+
     template<typename Fn>
     std::expected<void, std::string>
     call(value& callee, u8 arity, value*& stack_top,
          Fn const& update_stack_frame) {
       switch (callee.val.index()) {
-        case 7: {
+        case index_of<value::native_fn>: {
           auto fn = callee.get<value::native_fn>();
           if (arity != fn.second) {
             return std::unexpected{
@@ -171,14 +368,15 @@ namespace tosuto::vm {
               + ", got: " + std::to_string(arity) + ")"};
           }
 
-          auto res = ami_unwrap_move_fast(
+          // not _fast, natives can fail, snapshot() for one
+          auto res = ami_unwrap_move(
             fn.first(std::span{stack_top + 1 - arity, stack_top + 1}));
           stack_top -= arity;
           stack_top--;
           *(++stack_top) = res;
           return {};
         }
-        case 6: {
+        case index_of<value::function>: {
           auto& fn = callee.get<value::function>();
           // TODO: implement varargs
           if (fn.desc->arity != arity) {
@@ -188,6 +386,10 @@ namespace tosuto::vm {
               + ", got: " + std::to_string(arity) + ")"};
           }
 
+          if (!fn.desc->is_compiled()) {
+            ami_discard(compile_lazy(fn));
+          }
+
           frames.emplace_back(fn, 0, stack_top - stack.data() - arity);
           update_stack_frame(false);
 